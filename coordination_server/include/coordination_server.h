@@ -33,43 +33,9 @@
 #include "parser.h"
 #include "concurrentqueue.h"
 #include "socket_send.h"
-
-#include <ctpl.h>
-
-struct AlleleGT {
-  inline bool operator()(const std::string &a, const std::string &b) const {
-    // Months ago I wrote a sorter in python. I don't remember why it works (or if it's 100% correct?)
-    // but here is the C++ implementation. Not optimized in the slightest and horrible to read - enjoy!
-    std::vector<std::string> a_split;
-    std::vector<std::string> b_split;
-    std::vector<std::string> a_split2;
-    std::vector<std::string> b_split2;
-
-    Parser::split(a_split, a, ':');
-    Parser::split(b_split, b, ':');
-    int a_loci_1 = a_split[0] == "X" ? 24 : std::stoi(a_split[0]);
-    int b_loci_1 = b_split[0] == "X" ? 24 :std::stoi(b_split[0]);
-    Parser::split(a_split2, a_split[1], '\t');
-    Parser::split(b_split2, b_split[1], '\t');
-    std::string a_loci_2 = a_split2[0];
-    std::string b_loci_2 = b_split2[0];
-
-    if (a_loci_1 == b_loci_1) {
-      if (a_loci_2.length() != b_loci_2.length()) {
-        if (a_loci_2.length() < b_loci_2.length()) {
-          return false;
-        } else {
-          return true;
-        }
-      }
-      if (a_loci_2 > b_loci_2) {
-        return true;
-      }
-      return false;
-    }
-    return a_loci_1 > b_loci_1;
-  }
-};
+#include "result_record.h"
+#include "thread_placement.h"
+#include "reactor.h"
 
 class CoordinationServer {
   private:
@@ -92,11 +58,12 @@ class CoordinationServer {
 
     std::vector<bool> got_msg;
 
-    moodycamel::ConcurrentQueue<int> work_queue; 
-    ctpl::thread_pool t_pool;
+    // "thread_placement" in the json config
+    ThreadPlacement placement;
     bool shutdown;
 
-    std::priority_queue<std::string, std::vector<std::string>, AlleleGT > sorted_file_queue;
+    // binary results from every enclave node, sorted by variant key before they are written
+    std::vector<ResultRecord> result_records;
 
     std::ofstream output_file;
 
@@ -108,17 +75,21 @@ class CoordinationServer {
     // set up data structures
     void init(const std::string& config_file);
     
-    // parses and calls the appropriate handler for an incoming dpi request
+    // parses and calls the appropriate handler for an incoming dpi request,
+    // returns false if the connection should be closed
     bool handle_message(int connFD, CoordinationServerMessageType mtype, std::string& msg, std::string global_id);
 
     // send messages to the dpi
-    int send_msg(const std::string& hostname, const int port, int mtype, const std::string& msg, int connFD=-1);
+    void send_msg(const std::string& hostname, const int port, int mtype, const std::string& msg);
 
-    // start a thread that will handle a message and exit properly if it finds an error
-    void start_thread();
+    // reactor handler, copies the payload out and calls handle_message
+    bool receive_message(int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload);
 
     void debug_eof();
 
+    // tells every DPI and enclave node to exit
+    void end_components();
+
   public:
 
     CoordinationServer(const std::string& config_file);
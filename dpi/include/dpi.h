@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <stdexcept>
 #include <stdint.h>
+#include <cstring>
 #include <string>
 #include <thread>
 #include <atomic>
@@ -27,6 +28,10 @@
 #include "aes-crypto.h"
 #include "json.hpp"
 #include "concurrentqueue.h"
+#include "bounded_queue.h"
+#include "event_count.h"
+#include "thread_placement.h"
+#include "reactor.h"
 
 #include "attestation.h"
 
@@ -34,20 +39,61 @@
 #define _DPI_H_
 
 struct Phenotype {
-    std::string message;
+    // one message per chunk: [covariant name] chunk index, chunk count, encrypted doubles
+    std::vector<std::string> messages;
     EnclaveNodeMessageType mtype;
 };
 
-struct EncryptionBlock {
-  unsigned int line_num;
-  std::string line;
+// encrypted lines packed into one DATA message
+struct DataBatch {
+    int pos;
+    // tab separated line lengths, the header of the message
+    std::string lengths;
+    std::string block;
 };
 
-// did i ever verify this?
-struct EncryptionBlockGT {
-  inline bool operator()(const EncryptionBlock* a, const EncryptionBlock* b) const {
-    return a->line_num > b->line_num;
-  }
+// The stages of one enclave node's DATA stream, see fill_queue. Each queue is bounded so
+// the DPI holds a fixed number of lines and batches whatever the size of the allele file.
+struct DataPipeline {
+    // encrypted and routed to this enclave node, waiting to be packed
+    BoundedQueue<std::string> lines;
+    // encrypted and packed, waiting for a sender stream
+    BoundedQueue<DataBatch> batches;
+    // set before lines is closed if the allele file could not be read to the end
+    std::atomic<bool> failed;
+
+    DataPipeline(size_t line_capacity, size_t batch_capacity) 
+        : lines(line_capacity), batches(batch_capacity), failed(false) {}
+};
+
+// The allele file mapped read only, unmapped when this goes away
+struct AlleleMapping {
+    const char* data;
+    size_t size;
+    // the first line after the column header
+    const char* lines;
+
+    AlleleMapping() : data(nullptr), size(0), lines(nullptr) {}
+    ~AlleleMapping();
+    AlleleMapping(const AlleleMapping&) = delete;
+    AlleleMapping& operator=(const AlleleMapping&) = delete;
+};
+
+// The memory mapped allele file cut into chunks at line boundaries. Readers parse and encrypt
+// chunks in parallel but hand their lines to the pipelines in chunk order, see read_alleles.
+struct AlleleChunks {
+    // chunk i is [bounds[i], bounds[i + 1])
+    std::vector<const char*> bounds;
+    // the next chunk a reader takes
+    std::atomic<size_t> next;
+    // chunks whose lines are in the pipelines
+    std::atomic<size_t> routed;
+    EventCount routed_event;
+    std::atomic<size_t> line_count;
+    // a reader hit a line it couldn't parse, the others stop
+    std::atomic<bool> failed;
+
+    AlleleChunks() : next(0), routed(0), line_count(0), failed(false) {}
 };
 
 class DPI {
@@ -60,28 +106,40 @@ class DPI {
 
     int num_patients;
     int num_lines_per_block;
+    // "data_streams" in the json config
+    int num_data_streams;
+    // "line_queue_size" and "batch_queue_size" in the json config
+    int line_queue_size;
+    int batch_queue_size;
 
     std::string allele_file_name;
-    bool cov_work_start;
+    std::atomic<bool> cov_work_start;
 
     std::chrono::time_point<std::chrono::high_resolution_clock> start;
+    std::chrono::time_point<std::chrono::high_resolution_clock> fill_start;
     std::vector<buffer_t> evidence_list;
     std::atomic<int> verified_count;
     std::vector<std::vector<AESCrypto> > aes_encryptor_list;
+    std::vector<std::unique_ptr<SessionSecret> > session_secret_list;
     std::vector<std::vector<Phenotype> > phenotypes_list;
     std::vector<ConnectionInfo> enclave_node_info;
     std::vector<ConnectionInfo> dpi_info;
-    std::vector<std::queue<std::string> *> allele_queue_list;
-    std::vector<std::priority_queue<EncryptionBlock*, std::vector<EncryptionBlock* >, EncryptionBlockGT > > encryption_queue_list;
-    std::vector<std::mutex> encryption_queue_lock_list;
+    std::vector<std::unique_ptr<DataPipeline> > data_pipeline_list;
+    // DATA batches with pos below this may be sent to each enclave node, it only ever grows
+    std::vector<std::atomic<int> > data_credit_list;
+    EventCount data_credit_event;
+    // "thread_placement" in the json config
+    ThreadPlacement placement;
     std::atomic<int> y_and_cov_count;
-    std::atomic<int> filled_count;
+    std::atomic<int> packed_count;
     std::atomic<int> sync_count;
-    std::atomic<int> work_distributed_count;
     std::mutex xval_file_lock;
-    std::condition_variable start_sender_cv;
-    std::condition_variable sync_cv;
-    std::condition_variable queue_cv;
+    // cov_work_start was set
+    EventCount start_sender_event;
+    EventCount sync_event;
+    // RSA_PUB_KEY messages that arrived before the evidence, verified once it does
+    std::vector<std::string> early_pub_key_list;
+    std::mutex evidence_lock;
 
   public:
     DPI(const std::string& config_file);
@@ -92,20 +150,52 @@ class DPI {
     // Create listening socket to handle requests on indefinitely
     void run();
 
-    // parses and calls the appropriate handler for an incoming dpi request
-    void handle_message(int connFD, const unsigned int global_id, const DPIMessageType mtype, std::string& msg);
+    // reactor handler, copies the payload out and calls handle_message
+    bool receive_message(int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload);
+
+    // parses and calls the appropriate handler for an incoming dpi request,
+    // returns false if the connection should be closed
+    bool handle_message(int connFD, const unsigned int global_id, const DPIMessageType mtype, std::string& msg);
 
     // construct response header, encrypt response body, and send
-    void send_msg(const unsigned int global_id, const unsigned int mtype, const std::string& msg, int connFD=-1);
-    int send_msg(const std::string& hostname, unsigned int port, unsigned int mtype, const std::string& msg, int connFD=-1);
+    void send_msg(const unsigned int global_id, const unsigned int mtype, const std::string& msg);
+    void send_msg(const std::string& hostname, unsigned int port, unsigned int mtype, const std::string& msg);
+
+    // attest an enclave node with its evidence and send it our session secret wrapped in its key
+    void send_session_secret(const unsigned int global_id, const std::string& msg);
+
+    // send every DATA batch of one enclave node over num_data_streams streams, then EOF_DATA
+    void data_sender(const unsigned int global_id);
+
+    // one stream: take the next batch off the enclave node's pipeline and send it once credited, until it is drained
+    void data_stream(const unsigned int global_id, const int stream, std::atomic<int>& batches_sent);
+
+    // send one DATA batch, the position and lengths are gathered with block rather than copied into it
+    void send_data_batch(const ConnectionInfo& info, const int pos, const std::string& lengths,
+                         const std::string& block, const int stream);
+
+    // map the allele file and read num_patients off its first line, throws if there is none
+    std::unique_ptr<AlleleMapping> map_alleles();
+
+    // first stage: encrypt every line and route it to its enclave node's pipeline
+    void read_alleles(std::unique_ptr<AlleleMapping> mapping);
+
+    // encrypt chunks until none are left, handing each one's lines over after the chunks before it
+    void read_chunks(const int id, AlleleChunks& chunks);
+
+    // second stage: pack the encrypted lines of one enclave node into batches
+    void pack_lines(const unsigned int global_id);
 
-    void start_thread_wrapper();
+    // wait for the other DPIs, then start the phenotype and DATA senders together
+    void start_senders();
 
-    // start a thread that will handle a message and exit properly if it finds an error
-    bool start_thread(int connFD);
+    // raise the credit of an enclave node, credits arrive out of order so smaller ones are ignored
+    void grant_credit(const unsigned int global_id, const int credit);
 
-    void queue_helper(const int global_id, const int num_helpers);
+    // block until the enclave node has granted credit for batch pos
+    void wait_for_credit(const unsigned int global_id, const int pos);
 
+    // start the stages of every enclave node's pipeline
     void fill_queue();
 
     void prepare_tsv_file(unsigned int global_id, const std::string& filename, EnclaveNodeMessageType mtype);
@@ -1,13 +1,16 @@
 #include "dpi.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/thread.hpp>
 
-std::mutex cout_lock;
+// bytes of the allele file a reader takes at a time, extended to the end of the line. Smaller
+// files are cut finer so every reader gets a few chunks.
+#define ALLELE_CHUNK_SIZE (1 << 22)
+#define MIN_ALLELE_CHUNK_SIZE (1 << 16)
 
-void custom_set_highest_priority(std::thread& th, unsigned int subtract) {               
-  sched_param sch;
-  sch.sched_priority = sched_get_priority_max(SCHED_FIFO) - subtract;                      
-  pthread_setschedparam(th.native_handle(), SCHED_FIFO, &sch);
-}
+std::mutex cout_lock;
 
 DPI::DPI(const std::string& config_file) {
     init(config_file);
@@ -29,149 +32,81 @@ void DPI::init(const std::string& config_file) {
 
     allele_file_name = dpi_config["allele_file"];
 
+    // parallel DATA connections to each enclave node, each with its own sender thread
+    num_data_streams = 4;
+    if (dpi_config.count("data_streams")) {
+        num_data_streams = dpi_config["data_streams"];
+    }
+    if (num_data_streams < 1) {
+        throw std::runtime_error("Config \"data_streams\" must be at least 1.");
+    }
+    // lines and batches each enclave node's pipeline holds between its stages
+    line_queue_size = 256;
+    if (dpi_config.count("line_queue_size")) {
+        line_queue_size = dpi_config["line_queue_size"];
+    }
+    batch_queue_size = 4 * num_data_streams;
+    if (dpi_config.count("batch_queue_size")) {
+        batch_queue_size = dpi_config["batch_queue_size"];
+    }
+    if (line_queue_size < 1 || batch_queue_size < 1) {
+        throw std::runtime_error("Config \"line_queue_size\" and \"batch_queue_size\" must be at least 1.");
+    }
+
     auto info = dpi_config["coordination_server_info"];
     send_msg(info["hostname"], info["port"], CoordinationServerMessageType::DPI_REGISTER, dpi_hostname + "\t" + std::to_string(listen_port));
 
     num_patients = 0;
-    work_distributed_count = 0;
     y_and_cov_count = 0;
-    filled_count = 0;
+    packed_count = 0;
     sync_count = 0;
     verified_count = 0;
     cov_work_start = false;
 
+    placement.load(dpi_config, {PLACEMENT_DPI_HELPERS, PLACEMENT_DPI_PACKERS, PLACEMENT_NETWORK});
+    guarded_cout(placement.report(), cout_lock);
+
     if (strcmp(ENCLAVE_PUBLIC_SIGNING_KEY, "Invalid") == 0) {
         throw std::runtime_error("The public signing key is not specified. See enclave_node/enclave/gen_pubkey_header.sh for an example of how to generate a proper header.");
     }
 }
 
 void DPI::run() {
-    // set up the server to do nothing when it receives a broken pipe error
-    //signal(SIGPIPE, signal_handler);
-    // create a master socket to listen for requests on
-    // (1) Create socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    // (2) Set the "reuse port" socket option
-	int yesval = 1;
-	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval));
-
-    // (3) Create a sockaddr_in struct for the proper port and bind() to it.
-	struct sockaddr_in addr;
-    socklen_t addrSize = sizeof(addr);
-    memset(&addr, 0, addrSize);
-
-    // specify socket family (Internet)
-	addr.sin_family = AF_INET;
-
-	// specify socket hostname
-	// The socket will be a server, so it will only be listening.
-	// Let the OS map it to the correct address.
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(listen_port);
-
-    // bind to our given port, or randomly get one if port = 0
-	if (bind(sockfd, (struct sockaddr*) &addr, addrSize) < 0) {
-        guarded_cout("bind failure " + std::to_string(errno), cout_lock);
-    } 
-
-    // update our member variable to the port we just assigned
-    if (getsockname(sockfd, (struct sockaddr*) &addr, &addrSize) < 0) {
-        guarded_cout("getsockname failure: " + std::to_string(errno), cout_lock);
-    }
-
-    // (4) Begin listening for incoming connections.
-	if (listen(sockfd, 4096) < 0) {
-        guarded_cout("listen: " + std::to_string(errno), cout_lock);
+    // the reactor's threads are started from this one and inherit its cores
+    placement.pin_current(PLACEMENT_NETWORK);
+    Reactor reactor(dpi_config, [this](int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload) {
+        return receive_message(connFD, header, payload);
+    });
+    listen_port = reactor.listen(listen_port);
+    std::string own_path;
+    bool shared_memory;
+    // ip.txt may name a socket file of our own, see parse_local_endpoint
+    if (parse_local_endpoint(dpi_hostname, own_path, shared_memory) && !own_path.empty()) {
+        reactor.listen_local(own_path);
     }
-
-    listen_port = ntohs(addr.sin_port);
     guarded_cout("\n Running on port " + std::to_string(listen_port), cout_lock);
 
-    // (5) Serve incoming connections one by one forever (a lonely fate).
-	while (true) {
-        // accept connection from dpi
-        int connFD = accept(sockfd, (struct sockaddr*) &addr, &addrSize);
+    reactor.run();
+}
 
-        // spin up a new thread to handle this message
-        std::thread msg_thread(&DPI::start_thread, this, connFD);
-        msg_thread.detach();
+bool DPI::receive_message(int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload) {
+    std::string msg;
+    if (header.payload_length) {
+        msg.assign(payload.get(), header.payload_length);
     }
-}
+    const std::string sender = frame_sender(header);
 
-bool DPI::start_thread(int connFD) {
-    char* body_buffer = new char[MAX_MESSAGE_SIZE]();
-    // if we catch any errors we will throw an error to catch and close the connection
+    // guarded_cout("ID: " + sender + 
+    //              " Msg Type: " + std::to_string(header.mtype), cout_lock);
     try {
-        char header_buffer[128];
-        // receive header, byte by byte until we hit deliminating char
-        memset(header_buffer, 0, sizeof(header_buffer));
-
-        int header_size = 0;
-        bool found_delim = false;
-        while (header_size < 128) {
-            // Receive exactly one byte
-            int rval = recv(connFD, header_buffer + header_size, 1, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Socket recv failed\n");
-            } else if (rval == 0) {
-                return false;
-            }
-            // Stop if we received a deliminating character
-            if (header_buffer[header_size] == '\n') {
-                found_delim = true;
-                break;
-            }
-            header_size++;
-        }
-        if (!found_delim) {
-            throw std::runtime_error("Didn't read in a null terminating char");
-        }
-        std::string header(header_buffer, header_size);
-        if (header.find("GET / HTTP/1.1") != std::string::npos) {
-            std::cout << "Strange get request? Ignoring for now." << std::endl;
-            delete[] body_buffer;
-            return true;
-        }
-        unsigned int body_size;
-        try {
-            body_size = std::stoi(header);
-        } catch (const std::invalid_argument &e) {
-            std::cout << "Failed to read body size: " << header << std::endl;
-            return true;
-        }
-        
-        if (body_size != 0) {
-            // read in encrypted body
-            int rval = recv(connFD, body_buffer, body_size, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Error reading request body");
-            }
-        }
-        std::string body(body_buffer, body_size);
-        std::vector<std::string> parsed_header;
-        Parser::split(parsed_header, body, ' ', 2);
-
-        // guarded_cout("ID: " + parsed_header[0] + 
-        //              " Msg Type: " + parsed_header[1], cout_lock);
-        // guarded_cout("\nEncrypted body:\n" + parsed_header[2], cout_lock);
-        try {
-            handle_message(connFD, std::stoi(parsed_header[0]), static_cast<DPIMessageType>(std::stoi(parsed_header[1])), parsed_header[2]);
-        } catch (const std::invalid_argument &e) {
-            std::cout << "Failed parse header type \n" << header << std::endl;
-            return true;
-        }
-    }
-    catch (const std::runtime_error& e)  {
-        guarded_cout("Exception " + std::string(e.what()) + "\n", cout_lock);
-        close(connFD);
+        return handle_message(connFD, std::stoi(sender), static_cast<DPIMessageType>(header.mtype), msg);
+    } catch (const std::invalid_argument &e) {
+        std::cout << "Failed parse header type \n" << sender << " " << header.mtype << std::endl;
         return false;
     }
-    delete[] body_buffer;
-    return true;
 }
 
-void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMessageType mtype, std::string& msg) {
+bool DPI::handle_message(int connFD, const unsigned int global_id, const DPIMessageType mtype, std::string& msg) {
 
     std::string response;
 
@@ -199,25 +134,30 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
             int aes_idx = 0;
             const int num_enclave_nodes = parsed_enclave_info.size();
             aes_encryptor_list = std::vector<std::vector<AESCrypto> >(num_enclave_nodes);
+            session_secret_list.resize(num_enclave_nodes);
             phenotypes_list.resize(num_enclave_nodes);
-            allele_queue_list.resize(num_enclave_nodes);
-            encryption_queue_list.resize(num_enclave_nodes);
             evidence_list.resize(num_enclave_nodes);
-            // Mutexes are not movable apparently :/
-            std::vector<std::mutex> tmp(num_enclave_nodes);
-            encryption_queue_lock_list.swap(tmp);
+            early_pub_key_list.resize(num_enclave_nodes);
+            std::vector<std::atomic<int> > credits(num_enclave_nodes);
+            for (std::atomic<int>& credit : credits) {
+                credit = 0;
+            }
+            data_credit_list.swap(credits);
 
             for (int idx = 0; idx < num_enclave_nodes; ++idx) {
-                allele_queue_list[idx] = new std::queue<std::string>();
-            } 
+                data_pipeline_list.emplace_back(new DataPipeline(line_queue_size, batch_queue_size));
+            }
 
             for (const std::string& enclave_info : parsed_enclave_info) {
                 ConnectionInfo info;
                 Parser::parse_connection_info(enclave_info, info, true);
                 enclave_node_info.push_back(info);
 
-                // Create AES keys for each thread of this enclave node
-                aes_encryptor_list[aes_idx++] = std::vector<AESCrypto>(info.num_threads);
+                // Create AES keys for each stream of this enclave node, all derived from one session secret
+                session_secret_list[aes_idx].reset(new SessionSecret());
+                aes_encryptor_list[aes_idx] = std::vector<AESCrypto>(info.num_threads);
+                session_secret_list[aes_idx]->derive_stream_encryptors(aes_encryptor_list[aes_idx]);
+                aes_idx++;
             }
             for (unsigned int id = 0; id < enclave_node_info.size(); ++id) {
                 evidence_list[id].buffer = nullptr;
@@ -229,50 +169,32 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
         }
         case EVIDENCE:
         {
-            evidence_list[global_id].buffer = new uint8_t[msg.length()];
-            std::memcpy(evidence_list[global_id].buffer, reinterpret_cast<const uint8_t*>(msg.c_str()), msg.length());
-            evidence_list[global_id].size = msg.length();
+            std::string pub_key;
+            {
+                std::lock_guard<std::mutex> raii(evidence_lock);
+                evidence_list[global_id].buffer = new uint8_t[msg.length()];
+                std::memcpy(evidence_list[global_id].buffer, reinterpret_cast<const uint8_t*>(msg.c_str()), msg.length());
+                evidence_list[global_id].size = msg.length();
+                pub_key.swap(early_pub_key_list[global_id]);
+            }
+            // the key overtook the evidence, it can be verified now
+            if (pub_key.length()) {
+                send_session_secret(global_id, pub_key);
+            }
             break;
         }
         case RSA_PUB_KEY:
         {
-            // Wait for the evidence if we didn't already recieve it
-            while(!evidence_list[global_id].size) {
-                std::this_thread::yield();
-            }
-
-            // Verify the evidence - we need to attest the enclave
-            uint8_t pubkey_raw[RSA_PUB_KEY_SIZE];
-            std::copy(msg.begin(), msg.end(), std::begin(pubkey_raw));
-            if (Attestation::verify_evidence(&evidence_list[global_id], pubkey_raw) != 0) {
-                throw std::runtime_error("Failed to verify remote enclave!");
-            }
-            if (static_cast<unsigned long>(++verified_count) == evidence_list.size()) {
-                std::cout << "All enclaves successfully attested and verified" << std::endl;
-            }
-
-            // I wanted to use .resize() but the compiler cried about it, this is not ideal but acceptable.
-            
-            const std::string header = "-----BEGIN PUBLIC KEY-----";
-            const std::string footer = "-----END PUBLIC KEY-----";
-
-            size_t pos1 = msg.find(header);
-            size_t pos2 = msg.find(footer, pos1+1);
-            if (pos1 == std::string::npos || pos2 == std::string::npos) {
-                throw std::runtime_error("PEM header/footer not found");
-            }
-            // Start position and length
-            pos1 = pos1 + header.length();
-            pos2 = pos2 - pos1;
-            CryptoPP::StringSource pub_key_source(aes_encryptor_list[global_id].front().decode(msg.substr(pos1, pos2)), true);
-            CryptoPP::RSA::PublicKey public_key;
-            public_key.Load(pub_key_source);
-            
-            CryptoPP::RSAES<CryptoPP::OAEP<CryptoPP::SHA256> >::Encryptor rsa_encryptor(public_key);
-            for (unsigned int thread_id = 0; thread_id < enclave_node_info[global_id].num_threads; ++thread_id) {
-                send_msg(global_id, AES_KEY, aes_encryptor_list[global_id][thread_id].get_key_and_iv(rsa_encryptor) + "\t" + std::to_string(thread_id));
+            // Keep the key until the evidence arrives if it hasn't yet, the evidence comes in
+            // on another connection and may need this handler thread
+            {
+                std::lock_guard<std::mutex> raii(evidence_lock);
+                if (evidence_list[global_id].size == 0) {
+                    early_pub_key_list[global_id] = msg;
+                    break;
+                }
             }
-
+            send_session_secret(global_id, msg);
             break;
         }
         case Y_AND_COV:
@@ -301,67 +223,22 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
         }
         case DATA_REQUEST:
         {   
-            // Wait until all data is ready to go!
-            std::mutex useless_lock;
-            std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
-            while (static_cast<unsigned int>(filled_count) != allele_queue_list.size()) {
-                start_sender_cv.wait(useless_lock_wrapper);
-            }
-
-            ConnectionInfo info = enclave_node_info[global_id];
-            std::queue<std::string> *allele_queue = allele_queue_list[global_id];
-
-            int blocks_sent = 0;
-            std::string block;
-            std::string lengths;
-
-            std::string line;
-            std::string line_length;
-            int data_conn = -1;
-            while (!allele_queue->empty()) {
-                line = allele_queue->front();
-                allele_queue->pop();
-                line_length = "\t" + std::to_string(line.length());
-
-                // 30 is magic number for extra padding
-                int prospective_length = block.length() + line.length() + lengths.length() + line_length.length() + 30;
-                if ((prospective_length > (1 << 16) - 1) && block.length()) {
-                    // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
-                    std::string block_msg = std::to_string(blocks_sent++) + lengths + "\n" + block;
-                    data_conn = send_msg(info.hostname, info.port, EnclaveNodeMessageType::DATA, block_msg, data_conn);
-
-                    // Reset block
-                    block.clear(); 
-                    lengths.clear();
-                }
-                block += line;
-                lengths += line_length;
-            }
-            // TODO: Re-evaluate why I compare it to 10? at some point this made a lot of sense to me, not it makes none
-            // Send the leftover lines, 10 is an arbitary cut off. I assume most lines will be at least a few hundred characters
-            // and we won't be sending more than 10^10 blocks
-            if (block.length() > 10) {
-                // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
-                std::string block_msg = std::to_string(blocks_sent++) + lengths + "\n" + block;
-                send_msg(info.hostname, info.port, DATA, block_msg);
-            }
-            // If get_block failed we have reached the end of the file, send an EOF.
-            send_msg(global_id, EOF_DATA, std::to_string(blocks_sent));
-
-
-            if (global_id == 0) {
-                std::cout << "Sending last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
-
-                auto stop = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-                std::cout << "Data send time total: " << duration.count() << std::endl;
-            }
+            // the request carries the enclave node's first credit
+            grant_credit(global_id, std::stoi(msg));
+            // the stream runs for the rest of the job, give it a thread rather than a handler
+            std::thread sender_thread(&DPI::data_sender, this, global_id);
+            sender_thread.detach();
+            break;
+        }
+        case DATA_CREDIT:
+        {
+            grant_credit(global_id, std::stoi(msg));
             break;
         }
         case DPI_SYNC: 
         {
             if (static_cast<unsigned int>(++sync_count) == dpi_info.size()) {
-                sync_cv.notify_all();
+                sync_event.notify_all();
             }
             break;
         }
@@ -374,171 +251,357 @@ void DPI::handle_message(int connFD, const unsigned int global_id, const DPIMess
         default:
             throw std::runtime_error("Not a valid response type");
     }
-    if (mtype != DATA_REQUEST) {
-        close(connFD);
+    // senders keep their connections in a pool, they stay open until the sender closes them
+    return true;
+}
+
+void DPI::send_session_secret(const unsigned int global_id, const std::string& msg) {
+    // Verify the evidence - we need to attest the enclave
+    uint8_t pubkey_raw[RSA_PUB_KEY_SIZE];
+    std::copy(msg.begin(), msg.end(), std::begin(pubkey_raw));
+    if (Attestation::verify_evidence(&evidence_list[global_id], pubkey_raw) != 0) {
+        throw std::runtime_error("Failed to verify remote enclave!");
+    }
+    if (static_cast<unsigned long>(++verified_count) == evidence_list.size()) {
+        std::cout << "All enclaves successfully attested and verified" << std::endl;
+    }
+
+    // I wanted to use .resize() but the compiler cried about it, this is not ideal but acceptable.
+        
+    const std::string header = "-----BEGIN PUBLIC KEY-----";
+    const std::string footer = "-----END PUBLIC KEY-----";
+
+    size_t pos1 = msg.find(header);
+    size_t pos2 = msg.find(footer, pos1+1);
+    if (pos1 == std::string::npos || pos2 == std::string::npos) {
+        throw std::runtime_error("PEM header/footer not found");
     }
+    // Start position and length
+    pos1 = pos1 + header.length();
+    pos2 = pos2 - pos1;
+    CryptoPP::StringSource pub_key_source(aes_encryptor_list[global_id].front().decode(msg.substr(pos1, pos2)), true);
+    CryptoPP::RSA::PublicKey public_key;
+    public_key.Load(pub_key_source);
+        
+    CryptoPP::RSAES<CryptoPP::OAEP<CryptoPP::SHA256> >::Encryptor rsa_encryptor(public_key);
+    // A single RSA wrapped secret, the enclave derives every stream key from it
+    send_msg(global_id, AES_KEY, session_secret_list[global_id]->wrap(rsa_encryptor));
 }
 
-void DPI::send_msg(const unsigned int global_id, const unsigned int mtype, const std::string& msg, int connFD) {
-    std::string message = dpi_name + " " + std::to_string(mtype) + " ";
-    message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
+void DPI::data_sender(const unsigned int global_id) {
+    // the pipeline has been filling up since the phenotypes were requested, wait for the other DPIs
+    start_sender_event.await([this]() { return cov_work_start.load(); });
+
+    // every stream takes the next packed batch, the enclave node puts them back in order by pos
+    std::atomic<int> batches_sent(0);
+    std::vector<std::thread> streams;
+    for (int stream = 0; stream < num_data_streams; ++stream) {
+        streams.emplace_back(&DPI::data_stream, this, global_id, stream, std::ref(batches_sent));
+    }
+    for (std::thread& stream : streams) {
+        stream.join();
+    }
+    // An EOF would have the enclave node output a partial file, fail the run instead
+    if (data_pipeline_list[global_id]->failed) {
+        guarded_cout("Failing the run on enclave node " + std::to_string(global_id) + 
+                     ", the allele file could not be read to the end", cout_lock);
+        send_msg(global_id, DATA_ERROR, "allele file could not be read to the end");
+        return;
+    }
+    // The pipeline is drained, we have reached the end of the file, send an EOF.
+    send_msg(global_id, EOF_DATA, std::to_string(batches_sent.load()));
+
+
+    if (global_id == 0) {
+        std::cout << "Sending last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
+
+        auto stop = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+        std::cout << "Data send time total: " << duration.count() << std::endl;
+        std::cout << "Event count spins: " << event_count_spins().load() << std::endl;
+    }
+}
+
+void DPI::data_stream(const unsigned int global_id, const int stream, std::atomic<int>& batches_sent) {
     ConnectionInfo info = enclave_node_info[global_id];
-    send_message(info.hostname.c_str(), info.port, message.data(), message.length(), connFD);
+    BoundedQueue<DataBatch>& batches = data_pipeline_list[global_id]->batches;
+
+    DataBatch batch;
+    while (batches.pop(batch)) {
+        wait_for_credit(global_id, batch.pos);
+        send_data_batch(info, batch.pos, batch.lengths, batch.block, stream);
+        batches_sent++;
+    }
 }
 
-int DPI::send_msg(const std::string& hostname, unsigned int port, unsigned int mtype, const std::string& msg, int connFD) {
-    std::string message = dpi_name + " " + std::to_string(mtype) + " ";
-    message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
-    return send_message(hostname.c_str(), port, message.data(), message.length(), connFD);
+void DPI::send_msg(const unsigned int global_id, const unsigned int mtype, const std::string& msg) {
+    ConnectionInfo info = enclave_node_info[global_id];
+    ConnectionPool::instance().send(info.hostname, info.port, CHANNEL_CONTROL, dpi_name, mtype, msg.data(), msg.length());
 }
 
-void DPI::queue_helper(const int global_id, const int num_helpers) {
-    std::ifstream allele_file(allele_file_name);
-    std::string line;
+void DPI::send_msg(const std::string& hostname, unsigned int port, unsigned int mtype, const std::string& msg) {
+    ConnectionPool::instance().send(hostname, port, CHANNEL_CONTROL, dpi_name, mtype, msg.data(), msg.length());
+}
+
+void DPI::send_data_batch(const ConnectionInfo& info, const int pos, const std::string& lengths,
+                          const std::string& block, const int stream) {
+    // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
+    const std::string batch_header = std::to_string(pos) + lengths + "\n";
+    struct iovec payload[2];
+    payload[0].iov_base = const_cast<char*>(batch_header.data());
+    payload[0].iov_len = batch_header.length();
+    payload[1].iov_base = const_cast<char*>(block.data());
+    payload[1].iov_len = block.length();
+    ConnectionPool::instance().send(info.hostname, info.port, CHANNEL_DATA + stream, dpi_name, DATA, payload, 2);
+}
+
+void DPI::grant_credit(const unsigned int global_id, const int credit) {
+    std::atomic<int>& granted = data_credit_list[global_id];
+    int current = granted.load();
+    while (current < credit && !granted.compare_exchange_weak(current, credit)) {}
+    data_credit_event.notify_all();
+}
+
+void DPI::wait_for_credit(const unsigned int global_id, const int pos) {
+    std::atomic<int>& granted = data_credit_list[global_id];
+    data_credit_event.await([&granted, pos]() { return pos < granted.load(); });
+}
+
+AlleleMapping::~AlleleMapping() {
+    if (data) {
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+std::unique_ptr<AlleleMapping> DPI::map_alleles() {
+    int fd = open(allele_file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open allele file " + allele_file_name);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0 || file_stat.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Empty allele file provided");
+    }
+    const size_t file_size = file_stat.st_size;
+    void* file_mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file_mapping == MAP_FAILED) {
+        throw std::runtime_error("Failed to map allele file " + allele_file_name);
+    }
+    std::unique_ptr<AlleleMapping> mapping(new AlleleMapping());
+    mapping->data = static_cast<const char*>(file_mapping);
+    mapping->size = file_size;
+    madvise(file_mapping, file_size, MADV_SEQUENTIAL);
+    const char* file_end = mapping->data + file_size;
+
     // remove first line from file
-    getline(allele_file, line);
+    const char* first = static_cast<const char*>(memchr(mapping->data, '\n', file_size));
+    first = first ? first + 1 : file_end;
+    if (first == file_end) {
+        throw std::runtime_error("Empty allele file provided");
+    }
+    mapping->lines = first;
+    // the encryptors size their buffers from this, it is set before any line is queued
+    const char* first_end = static_cast<const char*>(memchr(first, '\n', file_end - first));
+    std::vector<std::string> patients_split;
+    Parser::split(patients_split, std::string(first, first_end ? first_end : file_end), '\t');
+    // Subtract 2 for locus->alleles tab and alleles->first value tab
+    num_patients = patients_split.size() - 2;
+    return mapping;
+}
 
-    unsigned int line_num = 0;
-    start = std::chrono::high_resolution_clock::now();
+void DPI::read_alleles(std::unique_ptr<AlleleMapping> mapping) {
+    const char* first = mapping->lines;
+    const char* file_end = mapping->data + mapping->size;
+
+    // one reader per core, encryption is most of their work
+    const int num_readers = std::max(1u, std::thread::hardware_concurrency());
+    const size_t chunk_size = std::max<size_t>(MIN_ALLELE_CHUNK_SIZE,
+                                               std::min<size_t>(ALLELE_CHUNK_SIZE, (file_end - first) / (4 * num_readers)));
+    AlleleChunks chunks;
+    chunks.bounds.push_back(first);
+    while (chunks.bounds.back() != file_end) {
+        const char* cut = chunks.bounds.back() + std::min<size_t>(chunk_size, file_end - chunks.bounds.back());
+        if (cut != file_end) {
+            cut = static_cast<const char*>(memchr(cut, '\n', file_end - cut));
+            cut = cut ? cut + 1 : file_end;
+        }
+        chunks.bounds.push_back(cut);
+    }
 
-    // Put the helper file handler on an offset based on the id
-    for (int i = 0; i < global_id; ++i) {
-        allele_file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        line_num++;
-    }
-
-    while (true) {
-        if (getline(allele_file, line)) {
-            // It's ok to have a benign data race here - each thread will do redundant writes of the same value.
-            // I used to eliminate this redundancy by only having thread with id 0 do this write, but it is
-            // theoretically (and practially...) possible for thread 0 to not get any lines causing
-            // num_patients to never be written. This seems like the best solution!
-            if (!num_patients) {
-                // Subtract 2 for locus->alleles tab and alleles->first value tab
-                std::vector<std::string> patients_split;
-                Parser::split(patients_split, line, '\t');
-                num_patients = patients_split.size() - 2;
-            }
+    std::vector<std::thread> readers;
+    for (int id = 0; id < num_readers; ++id) {
+        readers.emplace_back(&DPI::read_chunks, this, id, std::ref(chunks));
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+
+    // nobody is left to catch an exception on this thread, the senders report it instead
+    const bool failed = chunks.failed || !chunks.line_count;
+    if (!chunks.line_count && !chunks.failed) {
+        guarded_cout("Empty allele file provided", cout_lock);
+    }
+    for (std::unique_ptr<DataPipeline>& pipeline : data_pipeline_list) {
+        pipeline->failed = failed;
+        pipeline->lines.close();
+    }
+}
 
-            EncryptionBlock *block = new EncryptionBlock();
-            block->line_num = line_num++;
-            block->line = line;
-            unsigned int enclave_node_hash = Parser::parse_hash(block->line, aes_encryptor_list.size());
-            encryption_queue_lock_list[enclave_node_hash].lock(); 
-            encryption_queue_list[enclave_node_hash].push(block);
-            encryption_queue_lock_list[enclave_node_hash].unlock();
-        } else {
-            allele_file.close();
-            work_distributed_count++;
-            queue_cv.notify_all();
+void DPI::read_chunks(const int id, AlleleChunks& chunks) {
+    // pinned before compressed_vals and the keys are allocated, so they are local to the core
+    placement.pin_current(PLACEMENT_DPI_HELPERS, id);
+    std::vector<std::vector<std::string> > routed_lines(data_pipeline_list.size());
+    std::vector<uint8_t> compressed_vals((num_patients / TWO_BIT_INT_ARR_SIZE) + (num_patients % TWO_BIT_INT_ARR_SIZE ? 1 : 0));
+    // AESCrypto is not thread safe, every reader derives its own copy of each enclave node's
+    // stream keys. Lines carry their own IV, so which copy encrypts a line doesn't matter.
+    std::vector<std::vector<AESCrypto> > encryptor_list(aes_encryptor_list.size());
+    for (unsigned int enclave_id = 0; enclave_id < encryptor_list.size(); ++enclave_id) {
+        encryptor_list[enclave_id] = std::vector<AESCrypto>(aes_encryptor_list[enclave_id].size());
+        session_secret_list[enclave_id]->derive_stream_encryptors(encryptor_list[enclave_id]);
+    }
+    while (!chunks.failed) {
+        const size_t chunk = chunks.next++;
+        if (chunk + 1 >= chunks.bounds.size()) {
             break;
         }
+        const char* line = chunks.bounds[chunk];
+        const char* chunk_end = chunks.bounds[chunk + 1];
+        try {
+            while (line < chunk_end) {
+                const char* line_end = static_cast<const char*>(memchr(line, '\n', chunk_end - line));
+                if (!line_end) {
+                    line_end = chunk_end;
+                }
+                if (line_end != line) {
+                    std::string text(line, line_end);
+                    const unsigned int enclave_node_hash = Parser::parse_hash(text, data_pipeline_list.size());
+                    Parser::parse_allele_line(text, 
+                                              num_patients, 
+                                              compressed_vals, 
+                                              encryptor_list, 
+                                              enclave_node_hash);
+                    routed_lines[enclave_node_hash].push_back(std::move(text));
+                }
+                line = line_end == chunk_end ? chunk_end : line_end + 1;
+            }
+        } catch (const std::exception& e) {
+            // the chunk is never routed, so the readers waiting for it have to give up too
+            guarded_cout("Failed to read the allele file: " + std::string(e.what()), cout_lock);
+            chunks.failed = true;
+            chunks.routed_event.notify_all();
+            return;
+        }
 
-        // Skip forward a number of lines equal to the number of helper threads
-        for (int i = 0; i < num_helpers - 1; ++i) {
-            line_num++;
-            // Skip ahead num patients (plus the tab delimeters), but this doesnt account for the
-            // length of the locus + allele, so skip to the newline char after
-            allele_file.seekg(num_patients * 2, std::ios_base::cur);
-            allele_file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        // lines reach each enclave node in file order, wait for the chunks before this one
+        chunks.routed_event.await([&chunks, chunk]() { return chunks.routed.load() == chunk || chunks.failed.load(); });
+        if (chunks.failed) {
+            return;
         }
+        for (unsigned int hash = 0; hash < routed_lines.size(); ++hash) {
+            chunks.line_count += routed_lines[hash].size();
+            for (std::string& text : routed_lines[hash]) {
+                data_pipeline_list[hash]->lines.push(std::move(text));
+            }
+            routed_lines[hash].clear();
+        }
+        chunks.routed++;
+        chunks.routed_event.notify_all();
     }
+}
 
-    std::mutex useless_lock;
-    std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
-    while (work_distributed_count != num_helpers) {
-        queue_cv.wait(useless_lock_wrapper);
+void DPI::pack_lines(const unsigned int global_id) {
+    // readers take every helper core, a packer there would hold back the reader it shares it with
+    placement.pin_current(PLACEMENT_DPI_PACKERS, global_id);
+    DataPipeline& pipeline = *data_pipeline_list[global_id];
+
+    DataBatch batch;
+    batch.pos = 0;
+    // 30 is magic number for extra padding
+    size_t batch_length = 30;
+    std::string line;
+    while (pipeline.lines.pop(line)) {
+        const size_t line_length = line.length() + std::to_string(line.length()).length() + 1;
+        if (batch_length + line_length > (1 << 16) - 1 && !batch.block.empty()) {
+            const int next_pos = batch.pos + 1;
+            pipeline.batches.push(std::move(batch));
+            batch = DataBatch();
+            batch.pos = next_pos;
+            batch_length = 30;
+        }
+        batch_length += line_length;
+        batch.lengths += "\t" + std::to_string(line.length());
+        batch.block += line;
     }
-    // We no longer need this thread if it is not in the encryption list range
-    if (static_cast<unsigned int>(global_id) >= encryption_queue_list.size()) {
-        return;
+    if (!batch.block.empty()) {
+        pipeline.batches.push(std::move(batch));
     }
+    pipeline.batches.close();
 
-    std::vector<uint8_t> vals;
-    std::vector<uint8_t> compressed_vals;
-    vals.resize(num_patients);
-    compressed_vals.resize((num_patients / TWO_BIT_INT_ARR_SIZE) + (num_patients % TWO_BIT_INT_ARR_SIZE ? 1 : 0));
-    while (encryption_queue_list[global_id].size()) {
-        EncryptionBlock *block = encryption_queue_list[global_id].top();
-        encryption_queue_list[global_id].pop();
-        line = block->line;
-        delete block;
-
-        Parser::parse_allele_line(line, 
-                                  vals, 
-                                  compressed_vals, 
-                                  aes_encryptor_list, 
-                                  global_id);
-        allele_queue_list[global_id]->push(line);
-    }
-    if (static_cast<unsigned int>(++filled_count) == allele_queue_list.size()) {
-        // Make sure we read in at least one value
-        int any = 0;
-        for (unsigned int id = 0; id < enclave_node_info.size(); ++id){
-            any ^= allele_queue_list[id]->size();
-        }
-        if (!any) {
-            throw std::runtime_error("Empty allele file provided");
-        }
+    if (static_cast<unsigned int>(++packed_count) == data_pipeline_list.size()) {
         auto stop = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - fill_start);
         // Using guarded_cout is hard here because converting duration.count() to a string sucks
         cout_lock.lock();
         std::cout << "Fill/encryption time total: " << duration.count() << std::endl;
         cout_lock.unlock();
+    }
+}
 
-        // Spin up cov sender threads
-        int id = 0;
-        for (const std::vector<Phenotype>& phenotypes : phenotypes_list) {
-            int priority_diff = 0;
-            for (const Phenotype& ptype : phenotypes) {
-                std::thread th([id, ptype, this]() {
-                    std::mutex useless_lock;
-                    std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
-                    while (!cov_work_start) {
-                        start_sender_cv.wait(useless_lock_wrapper);
-                    }
-                    send_msg(id, ptype.mtype, ptype.message);
-                });
-                custom_set_highest_priority(th, priority_diff++);
-                th.detach();
-            }
-            id++;
+void DPI::start_senders() {
+    // Spin up cov sender threads
+    int id = 0;
+    for (const std::vector<Phenotype>& phenotypes : phenotypes_list) {
+        for (const Phenotype& ptype : phenotypes) {
+            std::thread th([id, ptype, this]() {
+                // started from a helper, move back to the network cores
+                placement.pin_current(PLACEMENT_NETWORK);
+                start_sender_event.await([this]() { return cov_work_start.load(); });
+                for (const std::string& message : ptype.messages) {
+                    send_msg(id, ptype.mtype, message);
+                }
+            });
+            th.detach();
         }
+        id++;
+    }
 
-        //  std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 10000));
-        // Ok so this machine is finished, but we need to sync with the other dpis to help with timing accuracy
-        for (ConnectionInfo info : dpi_info) {
-            std::string msg = "";
-            std::string message = "-2 " + std::to_string(DPIMessageType::DPI_SYNC) + " ";
-            message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
-            send_message(info.hostname.c_str(), info.port, message.data(), message.length());
-        }
-        
-        while (static_cast<unsigned int>(sync_count) < dpi_info.size()) {
-            std::mutex useless_lock;
-            std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
-            sync_cv.wait(useless_lock_wrapper);
-        }
+    //  std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 10000));
+    // Ok so this machine is ready, but we need to sync with the other dpis to help with timing accuracy
+    for (ConnectionInfo info : dpi_info) {
+        ConnectionPool::instance().send(info.hostname, info.port, CHANNEL_CONTROL, "-2", DPIMessageType::DPI_SYNC, nullptr, 0);
+    }
+    
+    sync_event.await([this]() { return static_cast<unsigned int>(sync_count) >= dpi_info.size(); });
 
-        // Start timing of first message and wake up all threads!
-        start = std::chrono::high_resolution_clock::now();
-        // Casting duration.count() to a string sucks, so RAII is difficult here
-        cout_lock.lock();
-        std::cout << "Sending first message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
-        cout_lock.unlock();
+    // Start timing of first message and wake up all threads!
+    start = std::chrono::high_resolution_clock::now();
+    // Casting duration.count() to a string sucks, so RAII is difficult here
+    cout_lock.lock();
+    std::cout << "Sending first message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
+    cout_lock.unlock();
 
-        cov_work_start = true;
-        start_sender_cv.notify_all();
-    }
+    cov_work_start = true;
+    start_sender_event.notify_all();
 }
 
 void DPI::fill_queue() {
-    const int num_helpers = std::max((unsigned int)boost::thread::hardware_concurrency(), (unsigned int)encryption_queue_list.size());
-    for (int id = 0; id < num_helpers; ++id) {
-        std::thread helper_thread(&DPI::queue_helper, this, id, num_helpers);
-        helper_thread.detach();
+    // Lines flow readers (parsing and encrypting, one per core) -> packer -> sender streams
+    // through bounded queues. The stages run at the pace of the slowest, the first batches
+    // are ready as soon as the senders start and memory does not grow with the allele file.
+    fill_start = std::chrono::high_resolution_clock::now();
+    // mapped on this thread so a missing or empty file reaches the reactor's handler
+    std::unique_ptr<AlleleMapping> mapping = map_alleles();
+    std::thread reader_thread(&DPI::read_alleles, this, std::move(mapping));
+    reader_thread.detach();
+    for (unsigned int id = 0; id < data_pipeline_list.size(); ++id) {
+        std::thread packer_thread(&DPI::pack_lines, this, id);
+        packer_thread.detach();
     }
+    // waits for the other DPIs, so not on this handler thread
+    std::thread starter_thread(&DPI::start_senders, this);
+    starter_thread.detach();
 }
 
 bool replace_str(std::string& str, const std::string& from, const std::string& to) {
@@ -549,41 +612,70 @@ bool replace_str(std::string& str, const std::string& from, const std::string& t
     return true;
 }
 
+// Phenotypes travel as little-endian IEEE-754 doubles whatever our own byte order is
+void write_double_le(double value, uint8_t* out) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (unsigned int byte = 0; byte < sizeof(bits); ++byte) {
+        out[byte] = (bits >> (8 * byte)) & 0xff;
+    }
+}
+
 void DPI::prepare_tsv_file(unsigned int global_id, const std::string& filename, EnclaveNodeMessageType mtype) {
     std::ifstream tsv_file("dpi_data/" + filename + ".tsv");
-    std::string data;
     std::string line;
 
     std::vector<std::string> patient_and_data;
-    int patient_count = -1;
+    std::vector<double> values;
+    // skip the column header
+    getline(tsv_file, line);
     while(getline(tsv_file, line)) {
         patient_and_data.clear();
         Parser::split(patient_and_data, line, '\t');
         std::string val = patient_and_data.back();
         replace_str(val, "false", "0");
         replace_str(val, "true", "1");
-        
-        data.append(val + "\t");
-        patient_count++;
+        try {
+            values.push_back(std::stod(val));
+        } catch (const std::exception& e) {
+            throw std::runtime_error("Invalid value in " + filename + ".tsv: " + val);
+        }
+    }
+    tsv_file.close();
+    // an empty file would send no chunks at all and leave the enclave node waiting for them
+    if (values.empty()) {
+        throw std::runtime_error("No patients in " + filename + ".tsv");
     }
-    data.pop_back();
 
     if (mtype == Y_VAL) {
-        std::string patient_count_str = std::to_string(patient_count);
+        std::string patient_count_str = std::to_string(values.size());
         patient_count_str = aes_encryptor_list[global_id].front().encrypt_line((byte *)&patient_count_str[0], patient_count_str.length());
         send_msg(global_id, EnclaveNodeMessageType::PATIENT_COUNT, patient_count_str);
     }
 
     // Some things are read by all threads (y values, covariants, etc.) and therefore 
-    // should use the same AES key across all threads - we just thread id 0.
-    data = aes_encryptor_list[global_id].front().encrypt_line((byte *)&data[0], data.length());
-    if (mtype == COVARIANT) {
-        data = filename + " " + data;
-    }
+    // should use the same AES key across all threads - we just use stream 0. Every chunk
+    // carries its own IV and index, so chunks can reach the enclave node in any order.
+    AESCrypto& encryptor = aes_encryptor_list[global_id].front();
+    const std::size_t num_chunks = (values.size() + PHENOTYPE_CHUNK_VALUES - 1) / PHENOTYPE_CHUNK_VALUES;
+    std::vector<uint8_t> chunk;
 
     Phenotype ptype;
-    ptype.message = data;
     ptype.mtype = mtype;
+    for (std::size_t chunk_idx = 0; chunk_idx < num_chunks; ++chunk_idx) {
+        const std::size_t first = chunk_idx * PHENOTYPE_CHUNK_VALUES;
+        const std::size_t count = std::min<std::size_t>(PHENOTYPE_CHUNK_VALUES, values.size() - first);
+        chunk.resize(count * sizeof(double));
+        for (std::size_t i = 0; i < count; ++i) {
+            write_double_le(values[first + i], &chunk[i * sizeof(double)]);
+        }
+
+        std::string message = std::to_string(chunk_idx) + " " + std::to_string(num_chunks) + " " + 
+                              encryptor.encrypt_line_with_iv((byte *)&chunk[0], chunk.size());
+        if (mtype == COVARIANT) {
+            message = filename + " " + message;
+        }
+        ptype.messages.push_back(message);
+    }
     phenotypes_list[global_id].push_back(ptype);
-    tsv_file.close();
 }
\ No newline at end of file
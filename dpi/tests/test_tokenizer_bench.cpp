@@ -0,0 +1,198 @@
+/*
+ * Checks genotype_tokenizer::pack against the split/switch/two_bit_compress path it
+ * replaced in Parser::parse_allele_line and times both on 100k-sample lines.
+ *
+ * make tests && ./bin/test_tokenizer_bench.o [lines] [samples]
+ */
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "genotype_tokenizer.h"
+
+#define NUM_LINES 200
+#define NUM_SAMPLES 100000
+// share of NA genotypes
+#define NA_RATE 0.01
+
+// the previous path, from Parser
+static void split(std::vector<std::string>& split_strings, const std::string& str, char delim=' ', int num_splits=-1) {
+    std::string split_string;
+    int i = 0;
+    for (char ch : str) {
+        if (ch != delim || i == num_splits) {
+            split_string += ch;
+        }
+        else {
+            ++i;
+            split_strings.push_back(split_string);
+            split_string.clear();
+        }
+    }
+    if (split_string.length()) split_strings.push_back(split_string);
+}
+
+static void two_bit_compress(uint8_t* input, uint8_t* compressed, unsigned int size) {
+    int two_bit_arr = 0;
+    int two_bit_arr_count = 0;
+    int compressed_idx = 0;
+    for (unsigned int input_idx = 0; input_idx < size; ++input_idx) {
+        two_bit_arr += input[input_idx] << (2 * two_bit_arr_count++);
+        if (two_bit_arr_count == 4) {
+            compressed[compressed_idx++] = two_bit_arr;
+            two_bit_arr = 0;
+            two_bit_arr_count = 0;
+        }
+    }
+    if (two_bit_arr_count != 0) {
+        compressed[compressed_idx] = two_bit_arr;
+    }
+}
+
+static void legacy_pack(const std::string& line, std::vector<uint8_t>& vals, std::vector<uint8_t>& compressed_vals) {
+    std::vector<std::string> line_split;
+    split(line_split, line, '\t', 2);
+    std::string line_vals = line_split.back();
+    int val_idx = 0;
+    for (std::size_t line_idx = 0; line_idx < line_vals.length(); line_idx += 2) {
+        switch(line_vals[line_idx]) {
+            case '0':
+                vals[val_idx++] = static_cast<char>(0);
+                break;
+            case '1':
+                vals[val_idx++] = static_cast<char>(1);
+                break;
+            case '2':
+                vals[val_idx++] = static_cast<char>(2);
+                break;
+            case 'N':
+                vals[val_idx++] = static_cast<char>(3);
+                line_idx++;
+                break;
+            default:
+                throw std::runtime_error("Invalid alleles file!");
+        }
+    }
+    two_bit_compress(&vals[0], &compressed_vals[0], vals.size());
+}
+
+static void tokenizer_pack(const std::string& line, std::vector<uint8_t>& compressed_vals, size_t num_samples) {
+    const size_t locus_end = line.find('\t');
+    const size_t genotypes_start = line.find('\t', locus_end + 1) + 1;
+    genotype_tokenizer::pack(line.data(), genotypes_start, line.length(), &compressed_vals[0], num_samples);
+}
+
+static std::string make_line(std::mt19937& rng, size_t num_samples, double na_rate) {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::string line = "1:" + std::to_string(rng() % 100000000) + "\t[\"A\",\"G\"]";
+    for (size_t sample = 0; sample < num_samples; ++sample) {
+        line += '\t';
+        if (uniform(rng) < na_rate) {
+            line += "NA";
+        } else {
+            line += static_cast<char>('0' + rng() % 3);
+        }
+    }
+    return line;
+}
+
+// pack must throw, naming column
+static bool expect_error(const std::string& genotypes, size_t count, size_t column) {
+    const std::string line = "1:100\t[\"A\",\"G\"]\t" + genotypes;
+    const size_t start = line.length() - genotypes.length();
+    std::vector<uint8_t> packed(count / 4 + 1);
+    try {
+        genotype_tokenizer::pack(line.data(), start, line.length(), &packed[0], count);
+    } catch (const std::runtime_error& e) {
+        const std::string expected = "at byte " + std::to_string(start + column) + " ";
+        if (std::string(e.what()).find(expected) != std::string::npos) {
+            return true;
+        }
+        std::cout << "wrong position for \"" << genotypes << "\": " << e.what() << std::endl;
+        return false;
+    }
+    std::cout << "no error for \"" << genotypes << "\"" << std::endl;
+    return false;
+}
+
+int main(int argc, char** argv) {
+    const size_t num_lines = argc > 1 ? std::stoul(argv[1]) : NUM_LINES;
+    const size_t num_samples = argc > 2 ? std::stoul(argv[2]) : NUM_SAMPLES;
+    const size_t packed_size = num_samples / 4 + (num_samples % 4 ? 1 : 0);
+    bool ok = true;
+
+    std::mt19937 rng(42);
+    std::vector<std::string> lines;
+    size_t total_bytes = 0;
+    for (size_t idx = 0; idx < num_lines; ++idx) {
+        // every other line without NA, that is the vector path's best case
+        lines.push_back(make_line(rng, num_samples, idx % 2 ? NA_RATE : 0));
+        total_bytes += lines.back().length();
+    }
+
+    std::vector<uint8_t> vals(num_samples);
+    std::vector<uint8_t> legacy(packed_size);
+    std::vector<uint8_t> packed(packed_size);
+    for (const std::string& line : lines) {
+        legacy_pack(line, vals, legacy);
+        tokenizer_pack(line, packed, num_samples);
+        if (legacy != packed) {
+            std::cout << "packed genotypes differ from the previous path" << std::endl;
+            ok = false;
+            break;
+        }
+    }
+
+    // short lines run entirely through the tail and token paths
+    for (size_t samples = 1; samples < 80; ++samples) {
+        std::vector<uint8_t> short_vals(samples);
+        std::vector<uint8_t> short_legacy(samples / 4 + 1);
+        std::vector<uint8_t> short_packed(samples / 4 + 1);
+        const std::string line = make_line(rng, samples, 0.2);
+        legacy_pack(line, short_vals, short_legacy);
+        tokenizer_pack(line, short_packed, samples);
+        if (short_legacy != short_packed) {
+            std::cout << "packed genotypes differ for " << samples << " samples" << std::endl;
+            ok = false;
+        }
+    }
+
+    std::string long_valid;
+    for (int idx = 0; idx < 40; ++idx) {
+        long_valid += idx ? "\t1" : "1";
+    }
+    ok &= expect_error("0\t1\t3", 3, 4);
+    ok &= expect_error("0\t1\tN\t2", 4, 5);
+    ok &= expect_error("0 1\t2", 3, 1);
+    ok &= expect_error("0\t1\t", 3, 4);
+    ok &= expect_error("0\t1", 3, 3);
+    ok &= expect_error("0\t1\t2\t0", 3, 6);
+    ok &= expect_error("", 1, 0);
+    // inside what would otherwise be a vector block
+    ok &= expect_error(long_valid.substr(0, 41) + "x" + long_valid.substr(42), 40, 41);
+    ok &= expect_error(long_valid.substr(0, 40) + " " + long_valid.substr(41), 40, 40);
+
+    double legacy_seconds = 0;
+    double tokenizer_seconds = 0;
+    for (int round = 0; round < 3; ++round) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const std::string& line : lines) {
+            legacy_pack(line, vals, legacy);
+        }
+        auto middle = std::chrono::high_resolution_clock::now();
+        for (const std::string& line : lines) {
+            tokenizer_pack(line, packed, num_samples);
+        }
+        auto stop = std::chrono::high_resolution_clock::now();
+        legacy_seconds += std::chrono::duration<double>(middle - start).count();
+        tokenizer_seconds += std::chrono::duration<double>(stop - middle).count();
+    }
+    const double megabytes = 3.0 * total_bytes / (1 << 20);
+    std::cout << num_lines << " lines of " << num_samples << " samples" << std::endl;
+    std::cout << "split/switch/two_bit_compress: " << megabytes / legacy_seconds << " MB/s" << std::endl;
+    std::cout << "genotype_tokenizer::pack:      " << megabytes / tokenizer_seconds << " MB/s" << std::endl;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -7,6 +7,7 @@
 #include "linear_regression.h"
 #include "oblivious_logistic_regression.h"
 #include "oblivious_linear_regression.h"
+#include "null_kernel.h"
 #include "enc_gwas.h"
 
 #ifdef NON_OE
@@ -22,7 +23,7 @@ class Batch {
     char* plaintxt;
     size_t txt_size;
     EncAnalysis type;
-    char outtxt[ENCLAVE_READ_BUFFER_SIZE];
+    char* outtxt;
 
     /* status */
     size_t out_tail;
@@ -32,13 +33,15 @@ class Batch {
 
     /* meta data */
     size_t row_size;
+    int thread_id;
 
    public:
     size_t batch_head;
-    Batch(size_t _row_size, EncAnalysis analysis_type, ImputePolicy impute_policy, GWAS* _gwas, char *plaintxt_buffer, const std::vector<int>& sizes, int thread_id);
+    Batch(size_t _row_size, EncAnalysis analysis_type, ImputePolicy impute_policy, GWAS* _gwas, char *plaintxt_buffer, 
+          size_t output_size, const std::vector<int>& sizes, int thread_id);
     ~Batch() { 
         delete row; 
-        delete plaintxt;
+        delete[] outtxt;
     }
 
     /* status */
@@ -50,7 +53,7 @@ class Batch {
     size_t *plaintxt_size() { return &txt_size; }
     void reset();
     Row* get_row(Buffer* buffer);  // return nullptr is reached ead of batch
-    void write(const std::string &);
+    void write(const ResultRecord &);
 
     size_t get_out_tail();
 };
@@ -15,39 +15,50 @@
 class Batch;
 
 struct DPIInfo{
+    // one key per stream, only the front entry's chained IV is ever updated (setup data)
     std::vector<AESData> aes_list;
     size_t crypto_size;
     size_t size;
+    // where this dpi's compressed genotypes start in a decrypted row
+    size_t plaintxt_offset;
 };
 
-void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi, const int thread_id);
+void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi, const int stream_id);
 void two_bit_decompress(uint8_t* input, uint8_t* decompressed, unsigned int size);
 
+// The most plaintext batch_budget bytes of ciphertext decrypt to. Absent dpis are filled in
+// with NA, so every line may grow to a whole row however few dpis it carries. A line carries
+// at least one dpi, so there are at most batch_budget / min_crypto_size + 1 of them.
+size_t max_batch_plaintxt_size(size_t batch_budget, size_t min_crypto_size, size_t row_plaintxt_size);
+
 class Buffer {
     /* meta data */
     size_t row_size;
     EncAnalysis analysis_type;
     size_t output_tail;
+    size_t batch_budget;
+    size_t plaintxt_size;
+    size_t output_size;
 
     /* data member */
     char* crypttxt;
-    uint8_t* plain_txt_compressed;
-    char output_buffer[ENCLAVE_READ_BUFFER_SIZE];
+    char* output_buffer;
     Batch* free_batch;
     char* plaintxt_buffer;
-    int* dpi_list;
-    char** dpi_crypto_map;
-    int dpi_count;
     bool eof;
 
     int thread_id;
 
     void output(const char* out, const size_t& length);
 
-    void decrypt_line(char* plaintxt, size_t* plaintxt_length, unsigned int num_lines, const std::vector<DPIInfo>& dpi_info_list, const int thread_id);
+    // false, with nothing past plaintxt_size written, if the batch decrypts to more than that
+    bool decrypt_line(char* plaintxt, size_t* plaintxt_length, unsigned int num_lines, const std::vector<DPIInfo>& dpi_info_list, const int thread_id);
 
 public:
-    Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int thread_id);
+    // batch_budget is the most ciphertext bytes the host may hand us per batch, plaintxt_size
+    // and output_size what a batch of that size can decrypt to and produce at most
+    Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int thread_id, size_t batch_budget, 
+           size_t plaintxt_size, size_t output_size);
     ~Buffer();
     void add_gwas(GWAS* _gwas, ImputePolicy impute_policy, const std::vector<int>& sizes);
     void finish();
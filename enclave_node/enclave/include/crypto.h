@@ -53,6 +53,15 @@ void aes_decrypt_data(mbedtls_aes_context* aes_context,
                       int input_size, 
                       unsigned char* output_data);
 
+/**
+ * HKDF-SHA256 (RFC 5869) built on mbedtls HMAC. Derives the AES key and IV
+ * of each stream from the session secret a DPI sent us.
+ */
+bool hkdf_sha256(const unsigned char* secret, size_t secret_size,
+                 const unsigned char* salt, size_t salt_size,
+                 const unsigned char* info, size_t info_size,
+                 unsigned char* output, size_t output_size);
+
 class RSACrypto {
     private:
       mbedtls_ctr_drbg_context m_ctr_drbg_context;
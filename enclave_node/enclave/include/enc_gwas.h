@@ -13,6 +13,7 @@
 #include "Matrix.h"
 #include "gwas.h"
 /* provide Alleles & Loci */
+#include "result_record.h"
 
 #define NA_byte 0xFF
 #define NA_uint8 0x3
@@ -95,7 +96,7 @@ class Row {
      virtual double get_beta(int thread_id) { return -1; }
      virtual double get_t_stat(int thread_id) { return -1; }
      virtual double get_standard_error(int thread_id) { return -1; }
-     virtual void get_outputs(int thread_id, std::string& output_string) {};
+     virtual void get_outputs(int thread_id, ResultRecord& record) {};
      int get_iterations() { return it_count; }
 
 
@@ -153,26 +154,21 @@ class Covar {
     friend class Lin_row;
     friend class Oblivious_lin_row;
     friend class Oblivious_log_row;
+    friend class Null_row;
     friend class GWAS;
     std::vector< std::vector<double> > data;
     int n;
-    int m;
-    int covar_idx;
     std::string name_str;
 
    public:
     Covar() : n(0), name_str("NA") { }
-    Covar(const char* input, int res_size = 0) { read(input, res_size); }
-    Covar(int _n, int _m) : n(_n), m(0), covar_idx(0) {data.resize(_n, std::vector<double>(_m));}
-    int read(const char* input, int res_size = 0);
+    Covar(int _n, int _m) : n(_n) {data.resize(_n, std::vector<double>(_m));}
+    // decode count little-endian doubles into column, starting at row_offset
+    void read_binary(int column, int row_offset, const unsigned char* input, int count);
+    void fill_column(int column, double value);
     void reserve(int total_row_size);
-    void init_1_covar(int total_row_size);
     int size() { return n; }
     const std::string& name() { return name_str; }
-    void after_covar() {
-        m++;
-        covar_idx = 0;
-    }
 };
 
 
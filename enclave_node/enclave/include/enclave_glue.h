@@ -9,19 +9,22 @@
 
 /* ECALL */
 void setup_enclave_encryption(const int num_threads);
+void setup_perf_counters(const int num_threads, const uint64_t* host_ticks, size_t export_interval);
 void setup_num_patients();
-void setup_enclave_phenotypes(const int num_threads, enum EncAnalysis analysis_type, enum ImputePolicy impute_policy);
+void setup_enclave_phenotypes(const int num_threads, enum EncAnalysis analysis_type,
+                              size_t heap_size, size_t batch_budget_override);
+bool ingest_phenotype_chunk(const int dpi_num, const int column, const int chunk_idx,
+                            const unsigned char* chunk, size_t chunk_size);
+void finish_enclave_phenotypes(const int num_threads, enum ImputePolicy impute_policy);
 void regression(const int thread_id, EncAnalysis analysis_type);
 void mark_eof_wrapper(const int thread_id);
 
 /* OCALLs */
-void start_timer(const char func_name[ENCLAVE_READ_BUFFER_SIZE]);
-
-void stop_timer(const char func_name[ENCLAVE_READ_BUFFER_SIZE]);
+void exportcounters(const uint8_t* counters, size_t counters_size);
 
 void setrsapubkey(uint8_t enc_rsa_pub_key[RSA_PUB_KEY_SIZE]);
 
-void setmaxbatchlines(int lines);
+void setbatchbudget(size_t batch_budget);
 
 void getdpinum(int* _retval);
 
@@ -29,21 +32,14 @@ void get_num_patients(int* _retval, const int dpi_num, char num_patients_buffer[
 
 void getcovlist(char covlist[ENCLAVE_READ_BUFFER_SIZE]);
 
-void getaes(bool* _retval, const int dpi_num, const int thread_id,
-                   unsigned char key[256], unsigned char iv[256]);
-
-void gety(int* _retval, const int dpi_num,
-                 char y[ENCLAVE_READ_BUFFER_SIZE]);
-
-void getcov(int* _retval, const int dpi_num,
-                   const char cov_name[MAX_DPINAME_LENGTH],
-                   char cov[ENCLAVE_READ_BUFFER_SIZE]);
+void getsessionsecret(bool* _retval, const int dpi_num,
+                      unsigned char session_secret[256]);
 
-void getbatch(int* _retval, char batch[ENCLAVE_READ_BUFFER_SIZE],
+void getbatch(int* _retval, char* batch, size_t batch_size,
                      const int thread_id);
 
-void writebatch(char buffer[ENCLAVE_READ_BUFFER_SIZE],
-                    const int buffer_size,
+void writebatch(char* buffer,
+                    size_t buffer_size,
                     const int thread_id);
 
 #endif
\ No newline at end of file
@@ -40,7 +40,7 @@ class Lin_row_dummy : public Row {
     double get_beta(int thread_id);
     double get_t_stat(int thread_id);
     double get_standard_error(int thread_id);
-    void get_outputs(int thread_id, std::string& output_string);
+    void get_outputs(int thread_id, ResultRecord& record);
 
     int size() { return n; }
     /* reqires boost library. To avoid using boost:
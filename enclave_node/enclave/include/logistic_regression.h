@@ -43,7 +43,7 @@ class Log_row : public Row {
     double get_beta(int thread_id);
     double get_t_stat(int thread_id);
     double get_standard_error(int thread_id);
-    void get_outputs(int thread_id, std::string& output_string);
+    void get_outputs(int thread_id, ResultRecord& record);
 };
 
 #endif
\ No newline at end of file
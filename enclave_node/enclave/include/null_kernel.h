@@ -0,0 +1,30 @@
+#ifndef __NULL_KERNEL_H_
+#define __NULL_KERNEL_H_
+/* No regression at all, for measuring how fast the rest of the pipeline can go */
+
+#include "enc_gwas.h"
+#ifdef NON_OE
+#include "enclave_glue.h"
+#else
+#include "gwas_t.h"
+#endif
+
+class Null_row : public Row {
+
+    /* sum of every genotype byte in the row, so nothing can skip reading them */
+    uint32_t checksum;
+
+   public:
+   /* setup */
+    Null_row(int size, const std::vector<int>& sizes, GWAS* _gwas, ImputePolicy _impute_policy, int thread_id);
+
+    /* fitting */
+    bool fit(int thread_id = -1, int max_iteration = 15, double sig = 1e-6);
+
+    /* output results */
+    void get_outputs(int thread_id, ResultRecord& record);
+
+    int size() { return n; }
+};
+
+#endif
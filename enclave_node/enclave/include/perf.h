@@ -0,0 +1,35 @@
+#ifndef ENC_PERF_H
+#define ENC_PERF_H
+
+#include "perf_counters.h"
+
+// Set up by setup_perf_counters. SGX gives the enclave no cheap trusted clock, so the host
+// publishes nanoseconds into untrusted memory and we read it. The ticks only ever feed
+// these counters, never anything that is computed or output.
+extern const volatile uint64_t* perf_host_ticks;
+extern PerfCounters* perf_counters;
+
+inline uint64_t perf_now() {
+    return perf_host_ticks ? *perf_host_ticks : 0;
+}
+
+// adds the ticks between construction and stop() (or destruction) to one stage
+class PerfTimer {
+    uint64_t* stage_ticks;
+    uint64_t start;
+
+  public:
+    PerfTimer(PerfCounters& counters, PerfStage stage)
+        : stage_ticks(&counters.stage_ticks[stage]), start(perf_now()) {}
+    ~PerfTimer() { stop(); }
+
+    void stop() {
+        if (!stage_ticks) return;
+        uint64_t now = perf_now();
+        // the host could hand us a time that goes backwards
+        if (now > start) *stage_ticks += now - start;
+        stage_ticks = nullptr;
+    }
+};
+
+#endif
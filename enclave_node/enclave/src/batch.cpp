@@ -1,4 +1,5 @@
 #include "batch.h"
+#include "perf.h"
 #include <cstring>
 
 #ifdef NON_OE
@@ -7,8 +8,9 @@
 #include "gwas_t.h"
 #endif
 
-Batch::Batch(size_t _row_size, EncAnalysis analysis_type, ImputePolicy impute_policy, GWAS* _gwas, char *plaintxt_buffer, const std::vector<int>& sizes, int thread_id)
-    : row_size(_row_size), type(analysis_type) {
+Batch::Batch(size_t _row_size, EncAnalysis analysis_type, ImputePolicy impute_policy, GWAS* _gwas, char *plaintxt_buffer, 
+             size_t output_size, const std::vector<int>& sizes, int thread_id)
+    : row_size(_row_size), type(analysis_type), thread_id(thread_id) {
     switch (analysis_type) {
         case EncAnalysis::logistic:
             row = new Log_row(row_size, sizes, _gwas, impute_policy, thread_id);
@@ -25,11 +27,15 @@ Batch::Batch(size_t _row_size, EncAnalysis analysis_type, ImputePolicy impute_po
         case EncAnalysis::linear_oblivious:
             row = new Oblivious_lin_row(row_size, sizes, _gwas, impute_policy, thread_id);
             break;
+        case EncAnalysis::null_kernel:
+            row = new Null_row(row_size, sizes, _gwas, impute_policy, thread_id);
+            break;
         default:
             throw std::runtime_error("No valid analysis type provided.");
             break;
     }
     plaintxt = plaintxt_buffer;
+    outtxt = new char[output_size + 1];
     batch_head = 0;
     st = Empty;
     txt_size = 0;
@@ -47,12 +53,10 @@ void Batch::reset() {
 Row* Batch::get_row(Buffer* buffer) {
     if (batch_head >= txt_size) {
         st = Finished;
-        //start_timer("output()");
         buffer->finish();
-        //stop_timer("output()");
         return nullptr;
     }
-    //start_timer("parse_and_decrypt()");
+    PerfTimer parse_timer(perf_counters[thread_id], PERF_PARSE);
     st = Working;
     //row->reset();
     int res = row->read(plaintxt + batch_head);
@@ -63,9 +67,9 @@ Row* Batch::get_row(Buffer* buffer) {
     return row;
 }
 
-void Batch::write(const std::string& output) {
-    strcpy(outtxt + out_tail, output.c_str());
-    out_tail += output.size();
+void Batch::write(const ResultRecord& record) {
+    memcpy(outtxt + out_tail, &record, sizeof(ResultRecord));
+    out_tail += sizeof(ResultRecord);
 }
 
 size_t Batch::get_out_tail() {
@@ -2,15 +2,20 @@
 #include "buffer.h"
 
 #include "logistic_regression.h"
+#include "perf.h"
 #include "string.h"
 #include <map>
 #include <thread>
 
-void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi, const int thread_id) {
-    aes_decrypt_data(dpi.aes_list[thread_id].aes_context,
-                     (unsigned char *)dpi.aes_list[thread_id].aes_iv,
-                     crypto,
-                     dpi.crypto_size - 1, 
+void aes_decrypt_dpi(const unsigned char* crypto, unsigned char* plaintxt, const DPIInfo& dpi, const int stream_id) {
+    // Each line starts with its own IV, copy it since mbedtls overwrites the IV it is given.
+    // The stream's key context is only read, so any thread can decrypt any stream.
+    unsigned char line_iv[AES_IV_LENGTH];
+    memcpy(line_iv, crypto, AES_IV_LENGTH);
+    aes_decrypt_data(dpi.aes_list[stream_id].aes_context,
+                     line_iv,
+                     crypto + AES_IV_LENGTH,
+                     dpi.crypto_size - AES_IV_LENGTH - 1, 
                      plaintxt);
 }
 
@@ -28,10 +33,15 @@ void two_bit_decompress(uint8_t* input, uint8_t* decompressed, unsigned int size
     }
 }
 
-void Buffer::decrypt_line(char* plaintxt, size_t* plaintxt_length, unsigned int num_lines, const std::vector<DPIInfo>& dpi_info_list, const int thread_id) {
+bool Buffer::decrypt_line(char* plaintxt, size_t* plaintxt_length, unsigned int num_lines, const std::vector<DPIInfo>& dpi_info_list, const int thread_id) {
     char* crypt_head = crypttxt; 
     char *crypt_start, *end_of_allele, *end_of_loci;
     char* plaintxt_head = plaintxt;
+    size_t bytes_decrypted = 0;
+    const int num_streams = dpi_info_list.front().aes_list.size();
+    const int num_dpis = dpi_info_list.size();
+    const int bitmap_bytes = PRESENCE_BITMAP_BYTES(num_dpis);
+    const size_t row_plaintxt_size = dpi_info_list.back().plaintxt_offset + dpi_info_list.back().size;
     for (int line = 0; line < num_lines; ++line) {
         crypt_start = crypt_head;
         end_of_allele = crypt_head;
@@ -47,90 +57,99 @@ void Buffer::decrypt_line(char* plaintxt, size_t* plaintxt_length, unsigned int
             }
             crypt_head++;
         }
+        // A line grows to a whole row however few dpis it carries, check the row and its
+        // newline fit before writing any of it. The null terminator has the buffer's extra byte.
+        const size_t line_plaintxt_size = end_of_allele - crypt_start + 1 + row_plaintxt_size + 1;
+        if (static_cast<size_t>(plaintxt_head - plaintxt) + line_plaintxt_size > plaintxt_size) {
+            std::cout << "Batch does not fit the plaintext buffer, " << line << " of " << num_lines 
+                      << " lines decrypted" << std::endl;
+            return false;
+        }
+
         /* copy allele & loci to plaintxt */
         strncpy(plaintxt_head, crypt_start, end_of_allele - crypt_start + 1);
         plaintxt_head += end_of_allele - crypt_start + 1;
 
-        char* tab_pos = end_of_allele;
-        dpi_count = 0;
-        /* get dpi list */
+        /* get key stream id */
         crypt_head++;
-        while (true) {
-            if(*crypt_head == '\t'){
-                *crypt_head = '\0';
-                int dpi = atoi(tab_pos + 1);
-                dpi_list[dpi_count++] = dpi;
-                *crypt_head = '\t';
-                tab_pos = crypt_head;
-            }
-            if (*crypt_head == ' ') {
-                *crypt_head = '\0';
-                int dpi = atoi(tab_pos + 1);
-                dpi_list[dpi_count++] = dpi;
-                *crypt_head = ' ';
-                crypt_head++;
-                break;
-            }
+        char* stream_start = crypt_head;
+        while (*crypt_head != '\t') {
             crypt_head++;
         }
-        /* decrypt data */
-        for (int i = 0; i < dpi_count; i++){
-            dpi_crypto_map[dpi_list[i]] = crypt_head;
-            crypt_head += dpi_info_list[dpi_list[i]].crypto_size;
+        *crypt_head = '\0';
+        int stream_id = atoi(stream_start);
+        *crypt_head = '\t';
+        // the stream id comes from the untrusted host, never index with it unchecked
+        if (stream_id < 0 || stream_id >= num_streams) {
+            std::cout << "Key stream out of range: " << stream_id << std::endl;
+            exit(0);
         }
-        bool dpi_found;
-        for (int dpi = 0; dpi < dpi_info_list.size(); dpi++) {
-            dpi_found = false;
-            for (int list_id = 0; list_id < dpi_count; ++list_id) {
-                if (dpi_list[list_id] == dpi) {
-                    aes_decrypt_dpi((const unsigned char*)dpi_crypto_map[list_id],
-                                       (unsigned char*)plaintxt_head,
-                                       dpi_info_list[dpi], 
-                                       thread_id);
-                    // two_bit_decompress(plain_txt_compressed, 
-                    //                    (uint8_t*)plaintxt_head, 
-                    //                    dpi_info_list[dpi].size);
-                    // memset(plain_txt_compressed, 0, ENCLAVE_READ_BUFFER_SIZE);
-                    // memset(dpi_crypto_map[list_id], 0, dpi_info_list[dpi].crypto_size);
-                    dpi_found = true;
-                }
-            }
-            if (!dpi_found) {
-                // this dpi does have target allele
-                for (int j = 0; j < dpi_info_list[dpi].size; j++) {
-                    *(plaintxt_head + j) = NA_byte; // set whole byte to 0b11111111
-                }
+
+        /* presence bitmap, bit dpi % 8 of byte dpi / 8 is set if that dpi sent this locus */
+        crypt_head++;
+        const uint8_t* bitmap = (const uint8_t*)crypt_head;
+        crypt_head += bitmap_bytes;
+        if (num_dpis % 8 && bitmap[bitmap_bytes - 1] >> (num_dpis % 8)) {
+            std::cout << "Presence bitmap names a dpi that does not exist" << std::endl;
+            exit(0);
+        }
+
+        /* decrypt the present dpis in order, absent runs between them become NA in one memset */
+        size_t row_filled = 0;
+        for (int bitmap_idx = 0; bitmap_idx < bitmap_bytes; ++bitmap_idx) {
+            unsigned int present = bitmap[bitmap_idx];
+            while (present) {
+                const int dpi = bitmap_idx * 8 + __builtin_ctz(present);
+                present &= present - 1;
+                const DPIInfo& info = dpi_info_list[dpi];
+                memset(plaintxt_head + row_filled, NA_byte, info.plaintxt_offset - row_filled);
+                aes_decrypt_dpi((const unsigned char*)crypt_head,
+                                (unsigned char*)plaintxt_head + info.plaintxt_offset,
+                                info, 
+                                stream_id);
+                bytes_decrypted += info.crypto_size - AES_IV_LENGTH - 1;
+                crypt_head += info.crypto_size;
+                row_filled = info.plaintxt_offset + info.size;
             }
-            plaintxt_head += dpi_info_list[dpi].size;
         }
+        memset(plaintxt_head + row_filled, NA_byte, row_plaintxt_size - row_filled);
+        plaintxt_head += row_plaintxt_size;
         *plaintxt_head = '\n';
         plaintxt_head++;
     }
     *plaintxt_head = '\0';
     *plaintxt_length = plaintxt_head - plaintxt;
+    perf_counters[thread_id].bytes_decrypted += bytes_decrypted;
+    return true;
+}
+
+size_t max_batch_plaintxt_size(size_t batch_budget, size_t min_crypto_size, size_t row_plaintxt_size) {
+    // loci and alleles are copied as they are, they are already counted in batch_budget
+    return batch_budget + (batch_budget / min_crypto_size + 1) * (row_plaintxt_size + 1);
 }
 
-Buffer::Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int _thread_id)
-    : row_size(_row_size), analysis_type(type), thread_id(_thread_id) {
-    crypttxt = new char[ENCLAVE_READ_BUFFER_SIZE];
-    plain_txt_compressed = new uint8_t[ENCLAVE_READ_BUFFER_SIZE];
-    dpi_list = new int[num_dpis];
-    dpi_crypto_map = new char* [num_dpis];
-    // I now remember why we do this! Because we do batching, we can load in ENCLAVE_READ_BUFFER_SIZE
-    // amount of data in at a time, BUT this data when decompressed can actually be up to 4 * ENCLAVE_READ_BUFFER_SIZE large
-    plaintxt_buffer = new char[ENCLAVE_READ_BUFFER_SIZE];
+Buffer::Buffer(size_t _row_size, EncAnalysis type, int num_dpis, int _thread_id, size_t _batch_budget, 
+               size_t _plaintxt_size, size_t _output_size)
+    : row_size(_row_size), analysis_type(type), thread_id(_thread_id), batch_budget(_batch_budget), 
+      plaintxt_size(_plaintxt_size), output_size(_output_size) {
+    // +1 everywhere for the null terminator
+    crypttxt = new char[batch_budget + 1];
+    plaintxt_buffer = new char[plaintxt_size + 1];
+    output_buffer = new char[output_size + 1];
     output_tail = 0;
     eof = false;
+    free_batch = nullptr;
 
-    memset(crypttxt, 0, ENCLAVE_READ_BUFFER_SIZE);
-    memset(plain_txt_compressed, 0, ENCLAVE_READ_BUFFER_SIZE);
-    memset(plaintxt_buffer, 0, ENCLAVE_READ_BUFFER_SIZE);
+    memset(crypttxt, 0, batch_budget + 1);
+    memset(plaintxt_buffer, 0, plaintxt_size + 1);
+    memset(output_buffer, 0, output_size + 1);
 }
 
 Buffer::~Buffer() {
     delete free_batch;
-    delete [] dpi_list;
-    delete [] dpi_crypto_map;
+    delete [] crypttxt;
+    delete [] plaintxt_buffer;
+    delete [] output_buffer;
 }
 
 void Buffer::mark_eof() {
@@ -138,47 +157,58 @@ void Buffer::mark_eof() {
 }
 
 void Buffer::add_gwas(GWAS* _gwas, ImputePolicy impute_policy, const std::vector<int>& sizes) {
-    free_batch = new Batch(row_size, analysis_type, impute_policy, _gwas, plaintxt_buffer, sizes, thread_id);
+    free_batch = new Batch(row_size, analysis_type, impute_policy, _gwas, plaintxt_buffer, output_size, sizes, thread_id);
 }
 
 void Buffer::output(const char* out, const size_t& length) {
-    if (output_tail + length >= ENCLAVE_READ_BUFFER_SIZE) {
+    if (output_tail + length >= output_size) {
         writebatch(output_buffer, output_tail, thread_id);
-        memset(output_buffer, 0, ENCLAVE_READ_BUFFER_SIZE);
         output_tail = 0;
     }
-    strcpy(output_buffer + output_tail, out);
+    memcpy(output_buffer + output_tail, out, length);
     output_tail += length;
 }
 
 void Buffer::clean_up() {
+    PerfTimer output_timer(perf_counters[thread_id], PERF_OUTPUT);
     if (output_tail > 0) {
         writebatch(output_buffer, output_tail, thread_id);
     }
 }
 
 void Buffer::finish() {
+    PerfTimer output_timer(perf_counters[thread_id], PERF_OUTPUT);
     output(free_batch->output_buffer(), free_batch->get_out_tail());
     free_batch->reset();
 }
 
 Batch* Buffer::launch(std::vector<DPIInfo>& dpi_info_list, const int thread_id) {
-    int num_lines = 0;
-    while (!num_lines) {
-        getbatch(&num_lines, crypttxt, thread_id);
-        if (eof) {
+    PerfCounters& perf = perf_counters[thread_id];
+    while (true) {
+        int num_lines = 0;
+        PerfTimer fetch_timer(perf, PERF_FETCH);
+        while (!num_lines) {
+            getbatch(&num_lines, crypttxt, batch_budget + 1, thread_id);
+            if (eof) {
+                return nullptr;
+            }
+            if (!num_lines) {
+                std::this_thread::yield();
+            }
+        }
+        fetch_timer.stop();
+        if (num_lines == -1) {
             return nullptr;
         }
-        if (!num_lines) {
-            std::this_thread::yield();
+        //if (!strcmp(crypttxt, EOFSeperator)) return nullptr;
+        if (!free_batch) return nullptr;
+        *free_batch->plaintxt_size() = 0;
+        PerfTimer decrypt_timer(perf, PERF_DECRYPT);
+        if (decrypt_line(free_batch->load_plaintxt(), free_batch->plaintxt_size(), num_lines, dpi_info_list, thread_id)) {
+            perf.batches++;
+            return free_batch;
         }
+        // only a host that ignores the batch budget gets here, none of the batch's rows are used
+        *free_batch->plaintxt_size() = 0;
     }
-    if (num_lines == -1) {
-        return nullptr;
-    }
-    //if (!strcmp(crypttxt, EOFSeperator)) return nullptr;
-    if (!free_batch) return nullptr;
-    *free_batch->plaintxt_size() = 0;
-    decrypt_line(free_batch->load_plaintxt(), free_batch->plaintxt_size(), num_lines, dpi_info_list, thread_id);
-    return free_batch;
 }
\ No newline at end of file
@@ -2,9 +2,12 @@
 // Licensed under the MIT License.
 
 #include "crypto.h"
+#include <mbedtls/platform_util.h>
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 void aes_decrypt_data(mbedtls_aes_context* aes_context, 
                       unsigned char* aes_iv, 
@@ -25,6 +28,44 @@ void aes_decrypt_data(mbedtls_aes_context* aes_context,
     }
 }
 
+bool hkdf_sha256(const unsigned char* secret, size_t secret_size,
+                 const unsigned char* salt, size_t salt_size,
+                 const unsigned char* info, size_t info_size,
+                 unsigned char* output, size_t output_size) {
+    const mbedtls_md_info_t* md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    const size_t hash_size = 32;
+    if (!md_info || output_size > 255 * hash_size) {
+        return false;
+    }
+
+    // Extract: PRK = HMAC(salt, secret)
+    unsigned char prk[hash_size];
+    if (mbedtls_md_hmac(md_info, salt, salt_size, secret, secret_size, prk) != 0) {
+        return false;
+    }
+
+    // Expand: T(i) = HMAC(PRK, T(i - 1) | info | i)
+    std::vector<unsigned char> block(hash_size + info_size + 1);
+    unsigned char t[hash_size];
+    size_t t_size = 0;
+    size_t written = 0;
+    for (unsigned char counter = 1; written < output_size; ++counter) {
+        memcpy(&block[0], t, t_size);
+        memcpy(&block[t_size], info, info_size);
+        block[t_size + info_size] = counter;
+        if (mbedtls_md_hmac(md_info, prk, hash_size, &block[0], t_size + info_size + 1, t) != 0) {
+            return false;
+        }
+        t_size = hash_size;
+        size_t copy_size = std::min(hash_size, output_size - written);
+        memcpy(output + written, t, copy_size);
+        written += copy_size;
+    }
+    mbedtls_platform_zeroize(prk, hash_size);
+    mbedtls_platform_zeroize(t, hash_size);
+    return true;
+}
+
 RSACrypto::RSACrypto() {
     m_initialized = false;
     int res = -1;
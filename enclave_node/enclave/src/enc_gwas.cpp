@@ -1,6 +1,8 @@
 #include "enc_gwas.h"
 #include "assert.h"
 #include "float.h"
+#include <string.h>
+#include <stdint.h>
 
 Row::Row(int _size, const std::vector<int>& sizes, int _num_dimensions, ImputePolicy _impute_policy) 
     : n(_size), impute_policy(_impute_policy), num_dimensions(_num_dimensions) {
@@ -184,43 +186,24 @@ void GWAS::print() const {
 /////////////////////////////////////////////////////////
 ////////////////   Covar    /////////////////////////////
 /////////////////////////////////////////////////////////
-int Covar::read(const char* input, int res_size) {
-    std::vector<std::string> parts;
-    if (res_size)
-        parts.reserve(res_size + 1);
-
-    split_delim(input, parts, '\t');
-
-    if (!res_size) {
-        res_size = parts.size() - 1;
-        std::cout << "n size " << res_size << std::endl;
-    }
-
-    name_str = parts[0];
-
-    int read_size = 0;
-    for (int i = 1; i < res_size + 1; ++i) {
-        data[covar_idx++][m] = std::stod(parts[i]);
-        read_size++;
+void Covar::read_binary(int column, int row_offset, const unsigned char* input, int count) {
+    for (int i = 0; i < count; ++i) {
+        uint64_t bits = 0;
+        for (int byte = sizeof(bits) - 1; byte >= 0; --byte) {
+            bits = (bits << 8) | input[i * sizeof(bits) + byte];
+        }
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        data[row_offset + i][column] = value;
     }
+}
 
-    if (read_size != res_size || read_size != n) {
-        //std::cout << "Covar size mismatch " << n << " " << read_size << " " << read_size << std::endl;
+void Covar::fill_column(int column, double value) {
+    for (std::vector<double>& row : data) {
+        row[column] = value;
     }
-
-    return read_size;
 }
 
 void Covar::reserve(int total_row_size) {
     //data.reserve(total_row_size);
 }
-
-void Covar::init_1_covar(int total_row_size) {
-    if (total_row_size != n) {
-        std::cout << "1 Covar size mismatch " << n << " " << total_row_size << std::endl;
-    }
-    
-    for (int i = 0; i < total_row_size; i++) {
-        data[covar_idx++][m] = 1;
-    }
-}
\ No newline at end of file
@@ -4,9 +4,15 @@
 #include <atomic>
 #include <condition_variable>
 #include <string.h>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <new>
 
 #include "buffer.h"
 #include "crypto.h"
+#include "perf.h"
+#include <mbedtls/platform_util.h>
 #include "mxcsr.h"
 
 #ifdef NON_OE
@@ -18,6 +24,13 @@
 std::vector<Buffer*> buffer_list;
 std::vector<DPIInfo> dpi_info_list;
 std::vector<int> dpi_y_size;
+std::vector<int> dpi_row_offset;
+std::vector<std::string> covariant_names;
+// [column][dpi][chunk], so a chunk the host replays or leaves out is caught
+std::vector<std::vector<std::vector<bool> > > phenotype_chunk_seen;
+// The phenotype ECALLs come from the untrusted host, which may call them in any order
+enum class PhenotypeState { SETUP, INGESTING, FINISHED };
+PhenotypeState phenotype_state = PhenotypeState::SETUP;
 int num_dpis;
 GWAS *gwas;
 
@@ -38,11 +51,50 @@ int total_row_size;
 std::condition_variable start_thread_cv;
 volatile bool start_thread = false;
 
+const volatile uint64_t* perf_host_ticks = nullptr;
+PerfCounters* perf_counters = nullptr;
+char* perf_counters_storage = nullptr;
+int perf_num_threads = 0;
+size_t perf_export_interval = 0;
+std::atomic<int> perf_threads_finished(0);
+
 
 void mark_eof(const int thread_id) {
     buffer_list[thread_id]->mark_eof();
 }
 
+void setup_perf_counters(const int num_threads, const uint64_t* host_ticks, size_t export_interval) {
+#ifndef NON_OE
+    // user_check pointer, make sure the host did not point us at our own memory
+    if (host_ticks && !oe_is_outside_enclave(host_ticks, sizeof(uint64_t))) {
+        std::cout << "Host tick counter is not in host memory" << std::endl;
+        exit(0);
+    }
+#endif
+    perf_host_ticks = host_ticks;
+    perf_num_threads = num_threads;
+    perf_export_interval = export_interval;
+
+    // new only promises 16 byte alignment before C++17, line the blocks up with the cache by hand
+    size_t space = num_threads * sizeof(PerfCounters) + PERF_CACHE_LINE;
+    perf_counters_storage = new char[space];
+    void* aligned = perf_counters_storage;
+    std::align(PERF_CACHE_LINE, num_threads * sizeof(PerfCounters), aligned, space);
+    perf_counters = static_cast<PerfCounters*>(aligned);
+    for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+        new (&perf_counters[thread_id]) PerfCounters();
+        perf_counters[thread_id].thread_id = thread_id;
+    }
+}
+
+// The last thread out hands every block to the host in one OCALL, by then no one writes them
+void finish_perf_counters(const int thread_id) {
+    perf_counters[thread_id].finished = 1;
+    if (perf_threads_finished.fetch_add(1) + 1 == perf_num_threads) {
+        exportcounters((const uint8_t*)perf_counters, perf_num_threads * sizeof(PerfCounters));
+    }
+}
+
 void setup_enclave_encryption(const int num_threads) {
     RSACrypto rsa = RSACrypto();
     if (!rsa.m_initialized) {
@@ -63,9 +115,11 @@ void setup_enclave_encryption(const int num_threads) {
 
     dpi_info_list.resize(num_dpis);
     dpi_y_size.resize(num_dpis);
+    dpi_row_offset.resize(num_dpis);
     buffer_list.resize(num_threads);
 
-    // We should store num_dpi number of aes keys/iv/contexts.
+    // We should store num_dpi number of aes keys/iv/contexts. Keys belong to streams (one per
+    // thread, so the count matches what the DPIs were told), not to the threads themselves.
     for (DPIInfo& dpi: dpi_info_list) {
         dpi.aes_list.resize(num_threads);
         for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
@@ -77,32 +131,46 @@ void setup_enclave_encryption(const int num_threads) {
     }
 
     try {
-        unsigned char enc_aes_key[256];
-        unsigned char enc_aes_iv[256];
-        size_t* aes_length = new size_t(AES_KEY_LENGTH);
+        // One RSA decryption per dpi, every stream key and iv is then derived from the
+        // session secret with HKDF so setup cost does not grow with the thread count.
+        unsigned char enc_session_secret[256];
+        unsigned char session_secret[SESSION_SECRET_LENGTH];
+        unsigned char key_and_iv[AES_KEY_LENGTH + AES_IV_LENGTH];
+        const std::string salt = SESSION_KEY_SALT;
         for (int dpi = 0; dpi < num_dpis; ++dpi) {
-            for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
-                bool rt = false;
-                while (!rt) {
-                    getaes(&rt, dpi, thread_id, enc_aes_key, enc_aes_iv);
+            bool rt = false;
+            while (!rt) {
+                getsessionsecret(&rt, dpi, enc_session_secret);
+            }
+            size_t session_secret_length = SESSION_SECRET_LENGTH;
+            if (!rsa.decrypt(enc_session_secret, 256, session_secret, &session_secret_length) ||
+                session_secret_length != SESSION_SECRET_LENGTH) {
+                throw ENC_ERROR("session secret from dpi " + std::to_string(dpi) + " could not be unwrapped");
+            }
+            for (int stream_id = 0; stream_id < num_threads; ++stream_id) {
+                const std::string info = SESSION_KEY_STREAM_INFO + std::to_string(stream_id);
+                if (!hkdf_sha256(session_secret, SESSION_SECRET_LENGTH,
+                                 (const unsigned char*)salt.data(), salt.length(),
+                                 (const unsigned char*)info.data(), info.length(),
+                                 key_and_iv, sizeof(key_and_iv))) {
+                    throw ENC_ERROR("key derivation failed for dpi " + std::to_string(dpi));
                 }
-                AESData& thread_aes_data = dpi_info_list[dpi].aes_list[thread_id];
-                rsa.decrypt(enc_aes_key, 256,
-                            (uint8_t*)&thread_aes_data.aes_key, aes_length);
-                rsa.decrypt(enc_aes_iv, 256, 
-                            (uint8_t*)&thread_aes_data.aes_iv, aes_length);
+                AESData& stream_aes_data = dpi_info_list[dpi].aes_list[stream_id];
+                memcpy(stream_aes_data.aes_key, key_and_iv, AES_KEY_LENGTH);
+                memcpy(stream_aes_data.aes_iv, key_and_iv + AES_KEY_LENGTH, AES_IV_LENGTH);
                 // Initialize AES context so that we can decrypt data coming into
                 // the enclave.
-                int ret = mbedtls_aes_setkey_dec(thread_aes_data.aes_context,
-                                                 thread_aes_data.aes_key,
+                int ret = mbedtls_aes_setkey_dec(stream_aes_data.aes_context,
+                                                 stream_aes_data.aes_key,
                                                  AES_KEY_LENGTH * 8);
                 if (ret != 0) {
                     std::cout << "Set key failed." << std::endl;
                     exit(0);
                 }
             }
+            mbedtls_platform_zeroize(session_secret, SESSION_SECRET_LENGTH);
         }
-        delete aes_length;
+        mbedtls_platform_zeroize(key_and_iv, sizeof(key_and_iv));
         std::cout << "AES KEY and IV loaded" << std::endl;
     } catch (ERROR_t& err) {
         std::cerr << "ERROR: fail to get AES KEY " << err.msg << std::endl;
@@ -134,35 +202,30 @@ void setup_num_patients() {
             throw e;
         }
         dpi_y_size[dpi] = dpi_num_patients;
+        dpi_row_offset[dpi] = total_row_size;
         dpi_info_list[dpi].size = (dpi_num_patients / 4) + (dpi_num_patients % 4 == 0 ? 0 : 1);
+        dpi_info_list[dpi].plaintxt_offset = dpi ? dpi_info_list[dpi - 1].plaintxt_offset + dpi_info_list[dpi - 1].size : 0;
         total_row_size += dpi_num_patients;
     }
 }
 
-void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type, ImputePolicy impute_policy) {
-    char* buffer_decrypt = new char[ENCLAVE_READ_BUFFER_SIZE];
-    char* phenotype_buffer = new char[ENCLAVE_READ_BUFFER_SIZE];
-
+void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type, 
+                              size_t heap_size, size_t batch_budget_override) {
+    if (phenotype_state != PhenotypeState::SETUP) {
+        std::cerr << "ERROR: enclave phenotypes already set up" << std::endl;
+        return;
+    }
     // Read in covariants from each institution
     char covl[ENCLAVE_SMALL_BUFFER_SIZE];
     getcovlist(covl);
     std::string covlist(covl);
-    std::vector<std::string> covariant_names;
     split_delim(covlist.c_str(), covariant_names);
 
     gwas = new GWAS(analysis_type, total_row_size, covariant_names.size() + 1);
 
-    try {
-        for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
-            // TODO: set buffer type accordingly
-            buffer_list[thread_id] = new Buffer(total_row_size, analysis_type, num_dpis, thread_id);
-        }
-    } catch (const std::exception &e) { 
-        std::cout << "Crash in buffer malloc with " << e.what() << std::endl;
-    }
-
-    /* set up encrypted size and max batch line */
+    /* set up encrypted size and batch budget */
     int total_crypto_size = 0;
+    size_t min_crypto_size = std::numeric_limits<size_t>::max();
     for (int dpi = 0; dpi < num_dpis; dpi++) {
         // Calculate compaction factor, ceil(plaintext size / 4) -> rounded up to nearest multiple of 16
         //int compacted_size = dpi_y_size[dpi];
@@ -172,92 +235,148 @@ void setup_enclave_phenotypes(const int num_threads, EncAnalysis analysis_type,
         // I should test this with more sizes - I assumed that if the compacted remainder was divisble by 16 we wouldn't need to add any padding... I guess not?
         compacted_size += 16 - compacted_remainder;
 
-        dpi_info_list[dpi].crypto_size = compacted_size + 1;
+        // Every line is prefixed with the IV it was encrypted under
+        dpi_info_list[dpi].crypto_size = AES_IV_LENGTH + compacted_size + 1;
 
         // Add 2 for the tab delimiter and null terminating char
-        total_crypto_size += compacted_size + 2;
+        total_crypto_size += AES_IV_LENGTH + compacted_size + 2;
+        min_crypto_size = std::min(min_crypto_size, dpi_info_list[dpi].crypto_size);
     }
-    // Add padding for Loci + Allele and list of dpis + 1 for new line at very end of sequence
-    total_crypto_size += MAX_LOCI_ALLELE_STR_SIZE + (num_dpis * 2) + 1;
-
-    int max_batch_lines = ENCLAVE_READ_BUFFER_SIZE / total_crypto_size;
-    if (!max_batch_lines) {
-        std::cerr << "Data is too long to fit into enclave read buffer" << std::endl;
-        exit(1);
+    // Add padding for Loci + Allele, the key stream id, the dpi presence bitmap + 1 for new line at very end of sequence
+    total_crypto_size += MAX_LOCI_ALLELE_STR_SIZE + std::to_string(num_threads).length() + 1 + PRESENCE_BITMAP_BYTES(num_dpis) + 1;
+
+    // Size batches in bytes from what is left of the heap once the covariant matrix is in,
+    // half of it goes to the per thread ciphertext, plaintext and output buffers. The
+    // shortest possible line (one dpi) bounds how many results a batch can produce, and
+    // how many rows it decrypts to.
+    size_t batch_budget = ENCLAVE_READ_BUFFER_SIZE;
+    const size_t row_plaintxt_size = dpi_info_list.back().plaintxt_offset + dpi_info_list.back().size;
+    const size_t output_per_crypto_byte = RESULT_RECORD_SIZE / min_crypto_size + 1;
+    const size_t plaintxt_per_crypto_byte = (row_plaintxt_size + 1) / min_crypto_size + 1;
+    if (batch_budget_override) {
+        batch_budget = batch_budget_override;
+    } else if (heap_size) {
+        const size_t covariant_matrix_size = total_row_size * 
+            (gwas->dim() * sizeof(double) + sizeof(std::vector<double>) + 2 * sizeof(size_t));
+        const size_t available = heap_size > covariant_matrix_size ? (heap_size - covariant_matrix_size) / 2 : 0;
+        batch_budget = std::min<size_t>(available / num_threads / (2 + plaintxt_per_crypto_byte + output_per_crypto_byte),
+                                        MAX_BATCH_BUDGET);
     }
-    setmaxbatchlines(max_batch_lines);
-
-    std::cout << "Init finished" << std::endl;
+    if (batch_budget < static_cast<size_t>(total_crypto_size)) {
+        std::cout << "Batch budget of " << batch_budget << " bytes raised to fit one line of " 
+                  << total_crypto_size << " bytes" << std::endl;
+        batch_budget = total_crypto_size;
+    }
+    const size_t output_size = (batch_budget / min_crypto_size + 1) * RESULT_RECORD_SIZE;
+    const size_t plaintxt_size = max_batch_plaintxt_size(batch_budget, min_crypto_size, row_plaintxt_size);
+    std::cout << "Batch budget " << batch_budget << " bytes, plaintext buffer " << plaintxt_size 
+              << " bytes, output buffer " << output_size << " bytes" << std::endl;
+    setbatchbudget(batch_budget);
 
-    // Read in y-vals from each institution
     try {
+        for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
+            // TODO: set buffer type accordingly
+            buffer_list[thread_id] = new Buffer(total_row_size, analysis_type, num_dpis, thread_id, 
+                                                batch_budget, plaintxt_size, output_size);
+        }
+    } catch (const std::exception &e) { 
+        std::cout << "Crash in buffer malloc with " << e.what() << std::endl;
+    }
+
+    // Every column but the "1" covariants arrives in chunks through ingest_phenotype_chunk
+    phenotype_chunk_seen.resize(gwas->dim());
+    for (std::vector<std::vector<bool> >& column : phenotype_chunk_seen) {
+        column.resize(num_dpis);
         for (int dpi = 0; dpi < num_dpis; ++dpi) {
-            int y_buffer_size = 0;
-            while (!y_buffer_size){
-                gety(&y_buffer_size, dpi, phenotype_buffer);
-            }
-            DPIInfo& info = dpi_info_list[dpi];
-            memset(buffer_decrypt, 0, ENCLAVE_READ_BUFFER_SIZE);
-            aes_decrypt_data(info.aes_list.front().aes_context,
-                             info.aes_list.front().aes_iv,
-                             (const unsigned char*) phenotype_buffer,
-                             y_buffer_size, 
-                             (unsigned char*) buffer_decrypt);
-            int read_size = gwas->phenotype_and_covars.read(buffer_decrypt, dpi_y_size[dpi]);
-            if (read_size != dpi_y_size[dpi]) {
-                throw ReadtsvERROR("y val size mismatch from dpi: " +
-                                    std::to_string(dpi) + " size expected: " + 
-                                    std::to_string(dpi_y_size[dpi]) + " got: " + 
-                                    std::to_string(read_size));
-            }
+            column[dpi].resize((dpi_y_size[dpi] + PHENOTYPE_CHUNK_VALUES - 1) / PHENOTYPE_CHUNK_VALUES, false);
         }
     }
-    catch (ERROR_t& err) {
-        std::cerr << "ERROR: fail to get correct y values " << err.msg << std::endl;
+
+    phenotype_state = PhenotypeState::INGESTING;
+    std::cout << "Init finished" << std::endl;
+}
+
+bool ingest_phenotype_chunk(const int dpi_num, const int column, const int chunk_idx,
+                            const unsigned char* chunk, size_t chunk_size) {
+    // Everything here comes from the untrusted host, check it before touching our buffers
+    if (phenotype_state != PhenotypeState::INGESTING) {
+        std::cerr << "ERROR: phenotype chunk outside of phenotype setup" << std::endl;
+        return false;
+    }
+    if (dpi_num < 0 || dpi_num >= num_dpis || column < 0 || column >= static_cast<int>(phenotype_chunk_seen.size()) ||
+        chunk_idx < 0 || chunk_idx >= static_cast<int>(phenotype_chunk_seen[column][dpi_num].size())) {
+        std::cerr << "ERROR: invalid phenotype chunk " << chunk_idx << " column " << column 
+                  << " dpi " << dpi_num << std::endl;
+        return false;
+    }
+    if (phenotype_chunk_seen[column][dpi_num][chunk_idx]) {
+        std::cerr << "ERROR: duplicate phenotype chunk " << chunk_idx << " column " << column 
+                  << " dpi " << dpi_num << std::endl;
+        return false;
     }
-    gwas->phenotype_and_covars.after_covar();
 
-    std::cout << "Y value loaded" << std::endl;
-    std::cout << "Starting Enclave: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
-    try{
-        for (int i = 0; i < covariant_names.size(); ++i) {
-            const std::string& cov_name = covariant_names[i];
-            if (cov_name == "1") {
-                gwas->phenotype_and_covars.init_1_covar(total_row_size);
-                gwas->phenotype_and_covars.after_covar();
+    const int first = chunk_idx * PHENOTYPE_CHUNK_VALUES;
+    const int count = std::min(PHENOTYPE_CHUNK_VALUES, dpi_y_size[dpi_num] - first);
+    // PKCS#7 always pads, so a multiple of 16 gains an extra full block
+    const size_t plaintxt_size = (count * sizeof(double) / AES_IV_LENGTH + 1) * AES_IV_LENGTH;
+    if (chunk_size != AES_IV_LENGTH + plaintxt_size) {
+        std::cerr << "ERROR: phenotype chunk size mismatch from dpi: " << dpi_num 
+                  << " size expected: " << AES_IV_LENGTH + plaintxt_size << " got: " << chunk_size << std::endl;
+        return false;
+    }
+
+    // Chunks carry their own IV, like genotype lines, and use the first stream's key
+    unsigned char chunk_iv[AES_IV_LENGTH];
+    memcpy(chunk_iv, chunk, AES_IV_LENGTH);
+    std::vector<unsigned char> plaintxt(plaintxt_size);
+    aes_decrypt_data(dpi_info_list[dpi_num].aes_list.front().aes_context,
+                     chunk_iv,
+                     chunk + AES_IV_LENGTH,
+                     plaintxt_size,
+                     &plaintxt[0]);
+    // the size fixes the padding, a chunk that doesn't end in it was not encrypted by the dpi
+    const size_t padding = plaintxt_size - count * sizeof(double);
+    for (size_t i = count * sizeof(double); i < plaintxt_size; ++i) {
+        if (plaintxt[i] != padding) {
+            std::cerr << "ERROR: bad padding in phenotype chunk " << chunk_idx << " column " << column 
+                      << " dpi " << dpi_num << std::endl;
+            return false;
+        }
+    }
+    gwas->phenotype_and_covars.read_binary(column, dpi_row_offset[dpi_num] + first, &plaintxt[0], count);
+    phenotype_chunk_seen[column][dpi_num][chunk_idx] = true;
+    return true;
+}
+
+void finish_enclave_phenotypes(const int num_threads, ImputePolicy impute_policy) {
+    if (phenotype_state != PhenotypeState::INGESTING) {
+        std::cerr << "ERROR: enclave phenotypes finished outside of phenotype setup" << std::endl;
+        return;
+    }
+    phenotype_state = PhenotypeState::FINISHED;
+    try {
+        for (int column = 0; column < gwas->dim(); ++column) {
+            // column 0 is y, column i + 1 is covariant i
+            if (column && covariant_names[column - 1] == "1") {
+                gwas->phenotype_and_covars.fill_column(column, 1);
                 continue;
             }
             for (int dpi = 0; dpi < num_dpis; ++dpi) {
-                int cov_buffer_size = 0;
-                while (!cov_buffer_size) {
-                    getcov(&cov_buffer_size, dpi, cov_name.c_str(), phenotype_buffer);
-                }
-                DPIInfo& info = dpi_info_list[dpi];
-                memset(buffer_decrypt, 0, ENCLAVE_READ_BUFFER_SIZE);
-                aes_decrypt_data(info.aes_list.front().aes_context,
-                                info.aes_list.front().aes_iv,
-                                (const unsigned char*) phenotype_buffer,
-                                cov_buffer_size, 
-                                (unsigned char*) buffer_decrypt);
-                int read_size = gwas->phenotype_and_covars.read(buffer_decrypt, dpi_y_size[dpi]);
-                if (read_size != dpi_y_size[dpi]) {
-                    throw ReadtsvERROR("covariant size mismatch from dpi: " +
-                                       std::to_string(dpi) + 
-                                       " size expected: " + std::to_string(dpi_y_size[dpi]) + 
-                                       " got: " + std::to_string(read_size));
+                for (bool seen : phenotype_chunk_seen[column][dpi]) {
+                    if (!seen) {
+                        throw ReadtsvERROR("missing " + (column ? "covariant " + covariant_names[column - 1] : std::string("y value")) + 
+                                           " chunk from dpi: " + std::to_string(dpi));
+                    }
                 }
             }
-            gwas->phenotype_and_covars.after_covar();
         }
     } catch (ERROR_t& err) {
-        std::cerr << "ERROR: fail to get correct covariant values: " << err.msg << std::endl;
-    } catch (const std::exception &e) { 
-        std::cout << "Crash in cov setup with " << e.what() << std::endl;
+        std::cerr << "ERROR: fail to get correct phenotype values: " << err.msg << std::endl;
     }
-    std::cout << "Cov loaded" << std::endl;
+    phenotype_chunk_seen.clear();
 
-    delete[] phenotype_buffer;
-    delete[] buffer_decrypt;
+    std::cout << "Y value and Cov loaded" << std::endl;
+    std::cout << "Starting Enclave: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
 
     // Padding to avoid false sharing - for some reason false sharing can still happen unless we make
     // this larger than a single cache block. Maybe prefetching/compiler optimizations cause invalidations?
@@ -288,15 +407,11 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
     
     if (!mxcsr.FTZ_and_DTZ_flags_set()) {
         std::cout << "FTZ or DTZ flag was not correctly set - machine at risk for subnormal sidechannel attack." << std::endl;
+        finish_perf_counters(thread_id);
         return;
     }
 
-    std::string output_string;
-    std::string loci_string;
-    std::string alleles_string;
-    output_string.reserve(50);
-    loci_string.reserve(50);
-    alleles_string.reserve(20);
+    ResultRecord record;
 
     std::mutex useless_lock;
     std::unique_lock<std::mutex> useless_lock_wrapper(useless_lock);
@@ -310,19 +425,21 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
     Buffer* buffer = buffer_list[thread_id];
     Batch* batch = nullptr;
     Row* row;
+    PerfCounters& perf = perf_counters[thread_id];
     /* process rows */
     while (true) {
-        //start_timer("input()");
         if (!batch || batch->st != Batch::Working) {
             batch = buffer->launch(dpi_info_list, thread_id);
+            if (batch && perf_export_interval && perf.batches % perf_export_interval == 0) {
+                exportcounters((const uint8_t*)&perf, sizeof(PerfCounters));
+            }
         }
         if (!batch) {
             // std::cout << "id " << thread_id << std::endl;
             buffer->clean_up();
             break;
         }
-        //stop_timer("input()");
-        // starting the get_row timer happens within the function because our code is written weirdly and we do our output
+        // get_row parses the next row, or writes the batch out once it has run out of rows
         try {
             switch(analysis_type) {
                 case EncAnalysis::linear_dummy:
@@ -340,6 +457,9 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
                 case EncAnalysis::logistic_oblivious:
                     if (!(row = static_cast<Oblivious_log_row*>(batch->get_row(buffer)))) continue;
                     break;
+                case EncAnalysis::null_kernel:
+                    if (!(row = static_cast<Null_row*>(batch->get_row(buffer)))) continue;
+                    break;
                 default:
                     throw std::runtime_error("Invalid analysis type");
             }
@@ -351,40 +471,44 @@ void regression(const int thread_id, EncAnalysis analysis_type) {
             std::cout << "Crash in get_row with " << e.what() << std::endl;
             exit(0);
         }
-        //stop_timer("parse_and_decrypt()");
+        perf.rows++;
         //  compute results
-        loci_to_str(row->getloci(), loci_string);
-        alleles_to_str(row->getalleles(), alleles_string);
-        output_string += loci_string + "\t" + alleles_string;
-        //start_timer("kernel()");
+        PerfTimer key_timer(perf, PERF_FORMAT);
+        record = ResultRecord();
+        record.variant_key = result_variant_key(row->getloci(), row->getalleles());
+        record.p_value = nan("");
+        key_timer.stop();
         bool converge;
         //std::cout << i++ << std::endl;
+        PerfTimer fit_timer(perf, PERF_FIT);
         try {
             converge = row->fit(thread_id);
-            row->get_outputs(thread_id, output_string);
+            row->get_outputs(thread_id, record);
+            fit_timer.stop();
+            perf.outcomes[PERF_FITTED]++;
 
             if (analysis_type == EncAnalysis::logistic || analysis_type == EncAnalysis::logistic_oblivious) {
-                output_string += + "\t" + std::to_string(row->get_iterations()) + "\t";
-                // wanted to use a ternary, but the compiler doesn't like it?
+                perf.newton_iterations[std::min(row->get_iterations(), PERF_ITERATION_BUCKETS - 1)]++;
+                record.flags |= RESULT_LOGISTIC;
+                record.iterations = row->get_iterations();
                 if (converge) {
-                    output_string += "true";
+                    record.flags |= RESULT_CONVERGED;
                 } else {
-                    output_string += "false";
+                    perf.convergence_failures++;
                 }
             }
-            output_string += "\n";
         } catch (MathError& err) {
-            output_string += "\tNA\tNA\tNA\t1\tfalse\n";
+            fit_timer.stop();
+            perf.outcomes[PERF_MATH_ERROR]++;
+            record.flags |= RESULT_MATH_ERROR;
             // cerr << "MathError while fiting " << ss.str() << ": " << err.msg
             //      << std::endl;
-            // ss << "\tNA\tNA\tNA" << std::endl;
         } catch (ERROR_t& err) {
             std::cerr << "ERROR " << err.msg << std::endl << std::flush;
-            // ss << "\tNA\tNA\tNA" << std::endl;
             exit(1);
         }
-        //stop_timer("kernel()");
-        batch->write(output_string);
-        output_string.clear();
+        PerfTimer write_timer(perf, PERF_FORMAT);
+        batch->write(record);
     }
+    finish_perf_counters(thread_id);
 }
\ No newline at end of file
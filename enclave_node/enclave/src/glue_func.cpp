@@ -3,9 +3,9 @@
 
 void getdpinum(int* _retval) { *_retval = getdpinum(); }
 
-void getaes(bool* _retval, const int dpi_num, const int thread_id,
-            unsigned char key[256], unsigned char iv[256]){
-    *_retval = getaes(dpi_num, thread_id, key, iv);
+void getsessionsecret(bool* _retval, const int dpi_num,
+                      unsigned char session_secret[256]){
+    *_retval = getsessionsecret(dpi_num, session_secret);
 }
 
 void get_num_patients(int* _retval, const int dpi_num, 
@@ -13,20 +13,9 @@ void get_num_patients(int* _retval, const int dpi_num,
     *_retval = get_num_patients(dpi_num, num_patients_buffer);
 }
 
-void gety(int* _retval, const int dpi_num, 
-    char y[ENCLAVE_READ_BUFFER_SIZE]){
-    *_retval = gety(dpi_num, y);
-}
-
-void getcov(int* _retval, const int dpi_num,
-            const char cov_name[MAX_DPINAME_LENGTH],
-            char cov[ENCLAVE_READ_BUFFER_SIZE]){
-    *_retval = getcov(dpi_num, cov_name, cov);
-}
-
-void getbatch(int* _retval, char batch[ENCLAVE_READ_BUFFER_SIZE],
+void getbatch(int* _retval, char* batch, size_t batch_size,
               const int thread_id){
-    *_retval = getbatch(batch, thread_id);
+    *_retval = getbatch(batch, batch_size, thread_id);
 }
 
 void mark_eof_wrapper(const int thread_id) {
@@ -174,9 +174,9 @@ double Lin_row_dummy::get_t_stat(int thread_id) {
     return (beta_g + (thread_id * get_padded_buffer_len(num_dimensions)))[0] / (beta_g + (thread_id * get_padded_buffer_len(num_dimensions)))[1];
 }
 
-void Lin_row_dummy::get_outputs(int thread_id, std::string& output_string) {
+void Lin_row_dummy::get_outputs(int thread_id, ResultRecord& record) {
     int offset = thread_id * get_padded_buffer_len(num_dimensions);
-    output_string += "\t" + std::to_string((beta_g + offset)[0]) +
-                     "\t" + std::to_string((beta_g + offset)[1]) +
-                     "\t" + std::to_string((beta_g + offset)[0] / (beta_g + offset)[1]);
+    record.beta = (beta_g + offset)[0];
+    record.standard_error = (beta_g + offset)[1];
+    record.t_stat = (beta_g + offset)[0] / (beta_g + offset)[1];
 }
\ No newline at end of file
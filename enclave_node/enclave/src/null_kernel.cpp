@@ -0,0 +1,17 @@
+#include "null_kernel.h"
+
+Null_row::Null_row(int _size, const std::vector<int>& sizes, GWAS* _gwas, ImputePolicy _impute_policy, int thread_id)
+    : Row(_size, sizes, _gwas->dim(), _impute_policy), checksum(0) {}
+
+bool Null_row::fit(int thread_id, int max_iteration, double sig) {
+    checksum = 0;
+    for (int i = 0; i < read_row_len; ++i) {
+        checksum += data[i];
+    }
+    return true;
+}
+
+void Null_row::get_outputs(int thread_id, ResultRecord& record) {
+    record.flags |= RESULT_CHECKSUM;
+    record.checksum = checksum;
+}
@@ -150,9 +150,9 @@ bool Oblivious_lin_row::fit(int thread_id, int max_iteration, double sig) {
     return true;
 }
 
-void Oblivious_lin_row::get_outputs(int thread_id, std::string& output_string) {
+void Oblivious_lin_row::get_outputs(int thread_id, ResultRecord& record) {
     int offset = thread_id * get_padded_buffer_len(num_dimensions);
-    output_string += "\t" + std::to_string((beta_g + offset)[0]) +
-                     "\t" + std::to_string((beta_g + offset)[1]) +
-                     "\t" + std::to_string((beta_g + offset)[0] / (beta_g + offset)[1]);
+    record.beta = (beta_g + offset)[0];
+    record.standard_error = (beta_g + offset)[1];
+    record.t_stat = (beta_g + offset)[0] / (beta_g + offset)[1];
 }
@@ -143,14 +143,14 @@ void Oblivious_log_row::update_upperH_and_Grad(double y_est, double x, const std
     }
 }
 
-void Oblivious_log_row::get_outputs(int thread_id, std::string& output_string) {
+void Oblivious_log_row::get_outputs(int thread_id, ResultRecord& record) {
     if (!fitted) {
-        output_string += "\tNA\tNA\tNA";
+        record.flags |= RESULT_NA;
         fitted = true;
         return;
     }
-    output_string += "\t" + std::to_string((beta_g + offset)[0]) +
-                     "\t" + std::to_string(standard_error) +
-                     "\t" + std::to_string((beta_g + offset)[0] / standard_error);
+    record.beta = (beta_g + offset)[0];
+    record.standard_error = standard_error;
+    record.t_stat = (beta_g + offset)[0] / standard_error;
 
 }
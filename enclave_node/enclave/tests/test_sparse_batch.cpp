@@ -0,0 +1,124 @@
+/*
+ * One dpi present out of many: every line decrypts to a whole row, almost all of it NA,
+ * which is more than the line's ciphertext. Checks the plaintext buffer is sized for that
+ * and that a batch which doesn't fit the buffer is refused rather than written past it.
+ *
+ * Build against the NON_OE enclave objects, this file stands in for the host's OCALLs.
+ */
+
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "enclave.h"
+#include "buffer.h"
+#include "perf.h"
+
+#define NUM_DPIS 64
+#define PATIENTS_PER_DPI 4
+#define NUM_LINES 100
+
+// batches getbatch hands out in order, -1 once they are gone
+static std::deque<std::string> batches;
+static std::deque<int> batch_lines;
+
+void getbatch(int* _retval, char* batch, size_t batch_size, const int thread_id) {
+    if (batches.empty()) {
+        *_retval = -1;
+        return;
+    }
+    memcpy(batch, batches.front().data(), std::min(batch_size, batches.front().size()));
+    *_retval = batch_lines.front();
+    batches.pop_front();
+    batch_lines.pop_front();
+}
+
+void writebatch(char* buffer, size_t buffer_size, const int thread_id) {}
+void exportcounters(const uint8_t* counters, size_t counters_size) {}
+void setrsapubkey(uint8_t enc_rsa_pub_key[RSA_PUB_KEY_SIZE]) {}
+void setbatchbudget(size_t batch_budget) {}
+void getdpinum(int* _retval) { *_retval = NUM_DPIS; }
+void get_num_patients(int* _retval, const int dpi_num, char num_patients_buffer[ENCLAVE_SMALL_BUFFER_SIZE]) { *_retval = 0; }
+void getcovlist(char covlist[ENCLAVE_READ_BUFFER_SIZE]) { covlist[0] = '\0'; }
+void getsessionsecret(bool* _retval, const int dpi_num, unsigned char session_secret[256]) { *_retval = false; }
+
+// decrypts to whatever it decrypts to, only the sizes matter here
+static std::string make_line(const DPIInfo& info, const int dpi) {
+    std::string line = "1:100\t[\"A\",\"G\"]\t0\t";
+    std::string bitmap(PRESENCE_BITMAP_BYTES(NUM_DPIS), '\0');
+    bitmap[dpi / 8] = static_cast<char>(1 << (dpi % 8));
+    return line + bitmap + std::string(info.crypto_size, 'x');
+}
+
+// true if launch hands back a batch of NUM_LINES sparse lines
+static bool decrypt_sparse_batch(std::vector<DPIInfo>& dpi_info_list, GWAS* gwas, size_t batch_budget,
+                                 size_t plaintxt_size, size_t& decrypted_size) {
+    std::string batch;
+    for (int line = 0; line < NUM_LINES; ++line) {
+        batch += make_line(dpi_info_list[NUM_DPIS / 2], NUM_DPIS / 2);
+    }
+    batches.push_back(batch);
+    batch_lines.push_back(NUM_LINES);
+
+    std::vector<int> sizes(NUM_DPIS, PATIENTS_PER_DPI);
+    Buffer buffer(NUM_DPIS * PATIENTS_PER_DPI, EncAnalysis::null_kernel, NUM_DPIS, 0, batch_budget, plaintxt_size,
+                  batch_budget * RESULT_RECORD_SIZE);
+    buffer.add_gwas(gwas, ImputePolicy::EPACTS, sizes);
+    Batch* decrypted = buffer.launch(dpi_info_list, 0);
+    decrypted_size = decrypted ? *decrypted->plaintxt_size() : 0;
+    return decrypted;
+}
+
+int main() {
+    bool ok = true;
+    setup_perf_counters(1, nullptr, 0);
+
+    unsigned char key[AES_KEY_LENGTH] = {0};
+    mbedtls_aes_context aes_context;
+    mbedtls_aes_init(&aes_context);
+    mbedtls_aes_setkey_dec(&aes_context, key, AES_KEY_LENGTH * 8);
+
+    // laid out like setup_enclave_phenotypes does
+    std::vector<DPIInfo> dpi_info_list(NUM_DPIS);
+    size_t min_crypto_size = 0;
+    for (int dpi = 0; dpi < NUM_DPIS; ++dpi) {
+        DPIInfo& info = dpi_info_list[dpi];
+        info.aes_list.resize(1);
+        info.aes_list[0].aes_context = &aes_context;
+        info.size = PATIENTS_PER_DPI / 4;
+        info.plaintxt_offset = dpi * info.size;
+        const int compacted_size = info.size + 16 - info.size % 16;
+        info.crypto_size = AES_IV_LENGTH + compacted_size + 1;
+        min_crypto_size = info.crypto_size;
+    }
+    const size_t row_plaintxt_size = NUM_DPIS * dpi_info_list[0].size;
+    const size_t line_size = make_line(dpi_info_list[0], 0).length();
+    const size_t batch_budget = NUM_LINES * line_size;
+    const size_t expected_size = NUM_LINES * (strlen("1:100\t[\"A\",\"G\"]\t") + row_plaintxt_size + 1);
+    if (expected_size <= batch_budget) {
+        std::cout << "the batch does not expand, nothing is tested" << std::endl;
+        ok = false;
+    }
+
+    GWAS gwas(EncAnalysis::null_kernel, NUM_DPIS * PATIENTS_PER_DPI, 2);
+    size_t decrypted_size = 0;
+
+    // sized for the worst case, the whole batch fits
+    const size_t plaintxt_size = max_batch_plaintxt_size(batch_budget, min_crypto_size, row_plaintxt_size);
+    if (!decrypt_sparse_batch(dpi_info_list, &gwas, batch_budget, plaintxt_size, decrypted_size) ||
+        decrypted_size != expected_size) {
+        std::cout << "sparse batch decrypted to " << decrypted_size << " bytes, expected " << expected_size << std::endl;
+        ok = false;
+    }
+
+    // the old sizing, as large as the ciphertext. The batch is refused before it overruns.
+    if (decrypt_sparse_batch(dpi_info_list, &gwas, batch_budget, batch_budget, decrypted_size)) {
+        std::cout << "sparse batch of " << expected_size << " bytes accepted into " << batch_budget + 1
+                  << " bytes" << std::endl;
+        ok = false;
+    }
+
+    mbedtls_aes_free(&aes_context);
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
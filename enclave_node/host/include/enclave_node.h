@@ -18,17 +18,26 @@
 #include <condition_variable>
 #include <unordered_set>
 #include <functional>
+#include <algorithm>
 #include <fstream>
 #include <atomic>
+#include <chrono>
 #include <boost/thread.hpp>
 
 #include "institution.h"
+#include "receive_buffer_pool.h"
 #include "output.h"
 #include "parser.h"
 #include "json.hpp"
 #include "aes-crypto.h"
 #include "buffer_size.h"
-#include "readerwriterqueue.h"
+#include "perf_counters.h"
+#include "slab_pool.h"
+#include "event_count.h"
+#include "thread_placement.h"
+#include "reactor.h"
+#include "socket_send.h"
+#include "concurrentqueue.h"
 
 enum EncMode { sgx, simulate, debug, NA };
 
@@ -39,8 +48,27 @@ class EnclaveNode {
     int port;
     int num_threads;
 
-    int global_id;
-    int max_batch_lines;
+    std::atomic<int> global_id;
+    // "matcher_threads" in the json config, loci are split between them by chromosome
+    int num_matchers;
+    std::atomic<int> matchers_finished;
+    std::atomic<bool> first_line_matched;
+    // "reorder_window" in the json config, see Institution::add_block_batch
+    int reorder_window;
+    // "data_credit_batches", "max_outstanding_blocks" and "data_credit_ms", see credit_granter
+    int data_credit_batches;
+    int64_t max_outstanding_blocks;
+    std::chrono::milliseconds data_credit_interval;
+    // lines handed to the enclave, how fast they go sets how much the host buffers
+    std::atomic<uint64_t> lines_consumed;
+    // bytes of ciphertext per enclave batch, set by the enclave once it knows the cohort size
+    size_t batch_budget;
+    // from NumHeapPages in the enclave config, 0 if it could not be read
+    size_t enclave_heap_size;
+    // "batch_budget_bytes" in the json config, 0 lets the enclave decide
+    size_t batch_budget_override;
+    // "perf_export_batches" in the json config, 0 only exports counters at the end of the run
+    size_t perf_export_interval;
 
     bool server_eof;
 
@@ -49,14 +77,23 @@ class EnclaveNode {
     ImputePolicy impute_policy;
 
     std::vector<bool> eof_read_list;
+    // a line that did not fit in a thread's last batch opens its next one
+    std::vector<std::string> carry_line_list;
 
     std::unordered_set<std::string> expected_institutions;
     std::unordered_set<std::string> expected_covariants;
-    std::vector<bool> seen_fds;
+    // REGISTER messages that arrived before GLOBAL_ID, answered once it does
+    std::vector<std::pair<std::string, std::string> > early_registrations;
+    std::mutex early_registrations_lock;
 
     std::vector<std::string> institution_list;
-    std::vector<moodycamel::ReaderWriterQueue<std::string>> allele_queue_list;
+    // Matched lines are tagged with their key stream rather than bound to a thread,
+    // so every enclave thread pulls from this one queue.
+    moodycamel::ConcurrentQueue<std::string> allele_queue;
     std::queue<std::string> output_queue;
+    // "output_flush_bytes" and "output_flush_ms" in the json config, see output_sender
+    size_t output_flush_bytes;
+    std::chrono::milliseconds output_flush_interval;
     std::string covariant_list;
     std::string y_val_name;
     char* encrypted_aes_key;
@@ -69,10 +106,16 @@ class EnclaveNode {
     AESCrypto encoder;
 
     std::unordered_map<std::string, Institution*> institutions;
+
+    ReceiveBufferPool receive_buffers;
   
-    std::unordered_map<std::string, std::chrono::system_clock::time_point> enclave_clocks;
-    std::unordered_map<std::string, unsigned long long> enclave_total_times;
-    std::unordered_map<std::string, unsigned long long> enclave_total_calls;
+    // nanoseconds since the ticker started, the enclave reads this to time its stages
+    volatile uint64_t perf_ticks;
+    volatile bool perf_ticking;
+    std::thread perf_ticker;
+    // latest counters exported by each enclave thread
+    std::vector<PerfCounters> perf_counters;
+    std::mutex perf_lock;
     
     std::unordered_map<std::string, std::string> covariant_dtype;
 
@@ -80,6 +123,16 @@ class EnclaveNode {
 
     std::mutex institutions_lock;
 
+    // "thread_placement" in the json config
+    ThreadPlacement placement;
+
+    // GLOBAL_ID and everything the enclave setup waits for: session secrets, patient counts, phenotypes
+    EventCount setup_event;
+    // a listener stored a batch, wakes the block router
+    EventCount batch_arrived;
+    // a matched line (or the EOFs) went into allele_queue
+    EventCount allele_queue_event;
+
     std::mutex output_queue_lock;
     std::condition_variable output_queue_cv;
 
@@ -90,26 +143,29 @@ class EnclaveNode {
     bool handle_message(int connFD, const std::string& name, EnclaveNodeMessageType mtype, std::string& msg);
 
     // construct response header, encrypt response body, and send
-    int send_msg(const std::string& name, const int mtype, const std::string& msg, int connFD=-1);
-    int send_msg(const std::string& hostname, const int port, const int mtype, const std::string& msg, int connFD=-1);
-    int send_msg_output(const std::string& msg, CoordinationServerMessageType msg_type, int connFD=-1);
+    void send_msg(const std::string& name, const int mtype, const std::string& msg, ConnectionChannel channel=CHANNEL_CONTROL);
+    void send_msg(const std::string& hostname, const int port, const int mtype, const std::string& msg, ConnectionChannel channel=CHANNEL_CONTROL);
+    void send_msg_output(const std::string& msg, CoordinationServerMessageType msg_type);
 
-    // start a thread that will handle a message and exit properly if it finds an error
-    bool start_thread(int connFD, char* body_buffer);
+    // reactor handler, parses DATA in place and calls handle_message.
+    // Returns false when the connection should be closed.
+    bool receive_message(int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload);
 
     void check_in(const std::string& name);
 
     void data_requester();
 
-    void data_listener(int connFD);
+    void credit_granter();
 
-    void allele_matcher();
+    void block_router();
+
+    void allele_matcher(const int partition);
 
     void output_sender();
 
-    void parse_header_enclave_node_header(const std::string& header, std::string& msg,
-                                            std::string& dpi_name, EnclaveNodeMessageType& mtype,
-                                            int connFD);
+    // adds the DATA blocks to their institution as views into payload
+    void parse_data_message(const std::string& dpi_name, const std::shared_ptr<char>& payload,
+                            const size_t payload_length);
 
   public:
 
@@ -122,11 +178,17 @@ class EnclaveNode {
 
     static EnclaveNode* get_instance(const std::string& config_file="");
 
-    static void start_timer(const std::string& func_name);
+    static void start_perf_ticker();
+
+    static void stop_perf_ticker();
+
+    static const uint64_t* get_perf_ticks();
 
-    static void stop_timer(const std::string& func_name);
+    static size_t get_perf_export_interval();
 
-    static void print_timings();
+    static void set_perf_counters(const uint8_t* counters, const size_t counters_size);
+
+    static void print_perf_counters();
 
     static EncMode get_mode();
 
@@ -136,7 +198,11 @@ class EnclaveNode {
 
     static void finish_setup();
 
-    static void set_max_batch_lines(unsigned int lines);
+    static void set_batch_budget(size_t budget);
+
+    static size_t get_enclave_heap_size();
+
+    static size_t get_batch_budget_override();
 
     static uint8_t* get_rsa_pub_key();
 
@@ -148,23 +214,28 @@ class EnclaveNode {
 
     static std::string get_covariants();
 
-    static std::string get_aes_key(const int institution_num, const int thread_id);
-
-    static std::string get_aes_iv(const int institution_num, const int thread_id);
+    static std::string get_session_secret(const int institution_num);
 
     static std::string get_num_patients(const int institution_num);
 
-    static std::string get_y_data(const int institution_num);
+    static bool get_y_chunks(const int institution_num, std::vector<std::string>& chunks);
 
-    static std::string get_covariant_data(const int institution_num, const std::string& covariant_name);
+    static bool get_covariant_chunks(const int institution_num, const std::string& covariant_name, 
+                                     std::vector<std::string>& chunks);
     
     static int get_encrypted_allele_size(const int institution_num);
 
-    static int get_allele_data(char* batch_data, const int thread_id);
+    static int get_allele_data(char* batch_data, const size_t batch_size, const int thread_id);
 
-    static void write_allele_data(char* output_data, const int buffer_size, const int thread_id);
+    static void write_allele_data(char* output_data, const size_t buffer_size, const int thread_id);
 
     static void cleanup_output();
+
+    // pin the calling thread to its role's cores, see ThreadPlacement
+    static void place_thread(const std::string& role, const int index=-1);
+
+    // block until check returns true, check is retried whenever institution setup data arrives
+    static void await_setup(const std::function<bool()>& check);
 };
 
 #endif /* _SERVER_H_ */
@@ -10,81 +10,107 @@
 #include <queue>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include "parser.h"
+#include "gwas.h"
+#include "slab_pool.h"
+#include "event_count.h"
 #include "readerwriterqueue.h"
 #include "concurrentqueue.h"
 
-struct BlockPointerBatchGT {
-  inline bool operator()(const DataBlockBatch* a, const DataBlockBatch* b) const {
-    return a->pos > b->pos;
-  }
+// Encrypted phenotype/covariant chunks, indexed by chunk number since they may arrive out of order
+struct PhenotypeChunks {
+    std::vector<std::string> chunks;
+    unsigned int received = 0;
 };
 
 class Institution {
   private:
     std::mutex num_patients_lock;
-    std::mutex blocks_lock;
-    std::mutex eligible_blocks_lock;
     std::mutex covariant_data_lock;
     std::mutex y_val_data_lock;
-    std::mutex aes_key_iv_lock;
-    moodycamel::ConcurrentQueue<DataBlockBatch*> unsorted_blocks;
-    std::priority_queue<DataBlockBatch*, std::vector<DataBlockBatch* >, BlockPointerBatchGT > blocks;
-    moodycamel::ReaderWriterQueue<DataBlock*> eligible_blocks;
-    // std::queue<DataBlock*> eligible_blocks;
-    std::unordered_map<std::string, std::string> covariant_data;
-    std::string y_val_data;
+    std::mutex session_secret_lock;
+    // Batches can arrive out of order, each one waits in slot pos % reorder_capacity until every
+    // batch before it has been routed. A batch reorder_capacity or more ahead is rejected by
+    // add_block_batch, the DPI's credits keep it from sending one.
+    std::unique_ptr<std::atomic<DataBlockBatch*>[]> reorder_window;
+    int reorder_capacity;
+    // next batch to route, only transfer_eligible_blocks moves it forward
+    std::atomic<int> current_pos;
+
+    std::atomic<int64_t> blocks_outstanding;
+
+    // shared by every institution, notified whenever a batch is stored in a reorder window
+    EventCount& batch_arrived;
+    // in order blocks, split by chromosome so each matcher thread merges its own partition
+    std::vector<moodycamel::ReaderWriterQueue<DataBlock*>*> eligible_blocks_list;
+    std::unordered_map<std::string, PhenotypeChunks> covariant_data;
+    PhenotypeChunks y_val_data;
     std::string num_patients_encrypted;
 
-    std::vector<std::string> aes_encrypted_key_list;
-    std::vector<std::string> aes_encrypted_iv_list;
+    // RSA wrapped session secret, every AES stream key is derived from it inside the enclave
+    std::string session_secret_encrypted;
 
     int id;
 
   public:
-    Institution(std::string hostname, int port, int id, const int num_threads);
+    Institution(std::string hostname, int port, int id, int num_partitions, int reorder_capacity,
+                EventCount& batch_arrived);
     ~Institution();
 
-    void set_key_and_iv(std::string aes_key, std::string aes_iv, const int thread_id);
+    void set_session_secret(const std::string& session_secret);
 
+    // throws if block_batch was already routed or is a full window ahead of current_pos
     void add_block_batch(DataBlockBatch* block_batch);
 
-    void transfer_eligible_blocks();
+    // move blocks that are next in order to their partition, returns false if none were
+    bool transfer_eligible_blocks();
 
-    void set_num_patients(const std::string& num_patients);
+    // the next batch in order is waiting to be transferred
+    bool has_eligible_batch();
+
+    // notified by transfer_eligible_blocks, matchers wait on it for new heads
+    EventCount routed;
 
-    void set_y_data(std::string& y_data);
+    void set_num_patients(const std::string& num_patients);
 
-    void set_covariant_data(const std::string& covariant_name, const std::string& data);
+    void add_y_chunk(const int chunk_idx, const int num_chunks, const std::string& chunk);
 
-    std::string get_aes_key(const int thread_id);
+    void add_covariant_chunk(const std::string& covariant_name, const int chunk_idx, 
+                             const int num_chunks, const std::string& chunk);
 
-    std::string get_aes_iv(const int thread_id);
+    std::string get_session_secret();
 
     std::string get_num_patients();
 
-    std::string get_y_data();
+    // copy out every chunk once all of them have arrived, returns false until then
+    bool get_y_chunks(std::vector<std::string>& chunks);
 
-    std::string get_covariant_data(const std::string& covariant_name);
+    bool get_covariant_chunks(const std::string& covariant_name, std::vector<std::string>& chunks);
 
     int get_id();
 
-    int get_blocks_size();
-
     int get_covariant_size();
 
-    DataBlock* get_top_block();
+    DataBlock* get_top_block(const int partition);
+
+    DataBlock* pop_top_block(const int partition);
+
+    // every batch below this has been routed, what the credit granter bases the next credit on.
+    // A DPI's streams deliver out of order, crediting past this could overrun the reorder window.
+    int get_routed_pos();
 
-    DataBlock* pop_top_block();
+    // blocks received that no matcher has popped yet
+    int64_t get_blocks_outstanding();
 
     AESCrypto decoder;
     int port;
-    int request_conn;
+    // the DPI may send batches with pos below this, only the credit granter changes it after check in
+    int credit_granted;
 
-    int current_pos;
     bool requested_for_data;
     bool listener_running;
-    bool all_data_received;
 
     std::string hostname;
     
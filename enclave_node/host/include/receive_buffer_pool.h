@@ -0,0 +1,27 @@
+/*
+ * Header file for the pool of buffers incoming messages are received into.
+ */
+
+#ifndef _RECEIVE_BUFFER_POOL_H_
+#define _RECEIVE_BUFFER_POOL_H_
+
+#include <memory>
+#include "concurrentqueue.h"
+
+// The DPI keeps DATA messages under 1 << 16 bytes, so that is the size we pool
+const size_t RECEIVE_BUFFER_SIZE = 1 << 16;
+
+class ReceiveBufferPool {
+  private:
+    moodycamel::ConcurrentQueue<char*> free_buffers;
+
+  public:
+    ~ReceiveBufferPool();
+
+    // A buffer of at least size bytes, not zeroed. It goes back to the pool once the last
+    // reference to it is dropped, that is the message itself or a DataBlock parsed out of it.
+    // Bodies larger than RECEIVE_BUFFER_SIZE get a buffer of their own that is freed instead.
+    std::shared_ptr<char> acquire(size_t size);
+};
+
+#endif /* _RECEIVE_BUFFER_POOL_H_ */
@@ -10,6 +10,7 @@
 #include <string>
 #include <thread>
 #include <vector>
+#include <functional>
 #include <stdio.h>
 #include <boost/thread.hpp>
 #include "enclave_node.h"
@@ -40,16 +41,12 @@ void setevidence(uint8_t evidence[MAX_EVIDENCE_SIZE], const int size) {
 }
 
 
-void setmaxbatchlines(int lines) {
-    EnclaveNode::set_max_batch_lines(lines);
+void setbatchbudget(size_t batch_budget) {
+    EnclaveNode::set_batch_budget(batch_budget);
 }
 
-void start_timer(const char func_name[MAX_DPINAME_LENGTH]) {
-    EnclaveNode::start_timer(func_name);
-}
-
-void stop_timer(const char func_name[MAX_DPINAME_LENGTH]) {
-    EnclaveNode::stop_timer(func_name);
+void exportcounters(const uint8_t* counters, size_t counters_size) {
+    EnclaveNode::set_perf_counters(counters, counters_size);
 }
 
 int getdpinum() {
@@ -61,67 +58,62 @@ void getcovlist(char covlist[ENCLAVE_SMALL_BUFFER_SIZE]) {
     strcpy(covlist, EnclaveNode::get_covariants().c_str());
 }
 
-bool getaes(const int dpi_num,
-            const int thread_id,
-            unsigned char key[256],
-            unsigned char iv[256]) {
-    std::string encrypted_aes_key = EnclaveNode::get_aes_key(dpi_num, thread_id);
-    std::string encrypted_aes_iv = EnclaveNode::get_aes_iv(dpi_num, thread_id);
-    if (!encrypted_aes_key.length() || !encrypted_aes_iv.length()) {
-        return false;
-    }
-    std::memcpy(key, &encrypted_aes_key[0], 256);
-    std::memcpy(iv, &encrypted_aes_iv[0], 256);
+// The enclave retries these two until they return data, block here until there is some so it doesn't spin
+bool getsessionsecret(const int dpi_num,
+                      unsigned char session_secret[256]) {
+    std::string encrypted_session_secret;
+    EnclaveNode::await_setup([dpi_num, &encrypted_session_secret]() {
+        encrypted_session_secret = EnclaveNode::get_session_secret(dpi_num);
+        return encrypted_session_secret.length() > 0;
+    });
+    std::memcpy(session_secret, &encrypted_session_secret[0], 256);
     return true;
 }
 
 int get_num_patients(const int dpi_num, char num_patients_buffer[ENCLAVE_SMALL_BUFFER_SIZE]) {
-    std::string num_patients_encrypted = EnclaveNode::get_num_patients(dpi_num);
-    if (!num_patients_encrypted.length()) {
-        return 0;
-    }
+    std::string num_patients_encrypted;
+    EnclaveNode::await_setup([dpi_num, &num_patients_encrypted]() {
+        num_patients_encrypted = EnclaveNode::get_num_patients(dpi_num);
+        return num_patients_encrypted.length() > 0;
+    });
     std::memset(num_patients_buffer, 0, ENCLAVE_SMALL_BUFFER_SIZE);
     std::memcpy(num_patients_buffer, &num_patients_encrypted[0], num_patients_encrypted.length());
     return num_patients_encrypted.length();
 }
 
-int gety(const int dpi_num, char y[ENCLAVE_READ_BUFFER_SIZE]) {
-    std::string y_data = EnclaveNode::get_y_data(dpi_num);
-    if (!y_data.length()) {
-        return 0;
-    }
-    std::memset(y, 0, ENCLAVE_READ_BUFFER_SIZE);
-    std::memcpy(y, &y_data[0], y_data.length());
-    return y_data.length();
-}
-
-int getcov(const int dpi_num,
-           const char cov_name[MAX_DPINAME_LENGTH],
-           char cov[ENCLAVE_READ_BUFFER_SIZE]) {
-    if (strcmp(cov_name, "1") == 0) {
-        std::memset(cov, 0, ENCLAVE_READ_BUFFER_SIZE);
-        strcpy(cov, "1");
-        return 1;
-    }
-    std::string cov_data = EnclaveNode::get_covariant_data(dpi_num, cov_name);
-    if (!cov_data.length()) {
-        return 0;
-    }
-    std::memset(cov, 0, ENCLAVE_READ_BUFFER_SIZE);
-    if (cov_data.length() > ENCLAVE_READ_BUFFER_SIZE) {
-        std::cout << "cov data length " << ENCLAVE_READ_BUFFER_SIZE << std::endl;
+// Stream every y value and covariant chunk into the enclave. y is column 0 and covariant i is
+// column i + 1, in config order. The "1" covariant is never sent, the enclave fills it in itself.
+// Blocks until all chunks of each institution have arrived.
+void ingest_phenotypes(const std::function<bool(int, int, int, const std::string&)>& ingest) {
+    std::vector<std::string> covariants;
+    Parser::split(covariants, EnclaveNode::get_covariants(), '\t');
+
+    std::vector<std::string> chunks;
+    for (int column = 0; column <= static_cast<int>(covariants.size()); ++column) {
+        if (column && covariants[column - 1] == "1") {
+            continue;
+        }
+        for (int dpi = 0; dpi < EnclaveNode::get_num_institutions(); ++dpi) {
+            EnclaveNode::await_setup([column, dpi, &covariants, &chunks]() {
+                return column ? EnclaveNode::get_covariant_chunks(dpi, covariants[column - 1], chunks) 
+                              : EnclaveNode::get_y_chunks(dpi, chunks);
+            });
+            for (int chunk_idx = 0; chunk_idx < static_cast<int>(chunks.size()); ++chunk_idx) {
+                if (!ingest(dpi, column, chunk_idx, chunks[chunk_idx])) {
+                    throw ReadtsvERROR("enclave rejected phenotype chunk " + std::to_string(chunk_idx) + 
+                                       " of column " + std::to_string(column) + " from dpi " + std::to_string(dpi));
+                }
+            }
+        }
     }
-    std::memcpy(cov, &cov_data[0], cov_data.length());
-
-    return cov_data.length();
 }
 
-int getbatch(char batch[ENCLAVE_READ_BUFFER_SIZE], const int thread_id) {
-    int res = EnclaveNode::get_allele_data(batch, thread_id);
+int getbatch(char* batch, size_t batch_size, const int thread_id) {
+    int res = EnclaveNode::get_allele_data(batch, batch_size, thread_id);
     return res;
 }
 
-void writebatch(char buffer[ENCLAVE_READ_BUFFER_SIZE], const int buffer_size, const int thread_id) {
+void writebatch(char* buffer, size_t buffer_size, const int thread_id) {
     EnclaveNode::write_allele_data(buffer, buffer_size, thread_id);
 }
 
@@ -184,7 +176,11 @@ int start_enclave() {
         int num_threads = EnclaveNode::get_num_threads();
         boost::thread_group thread_group;
         for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
-            boost::thread* enclave_thread = new boost::thread(regression, enclave, thread_id, enc_analysis_type);
+            boost::thread* enclave_thread = new boost::thread([thread_id, enc_analysis_type]() {
+                // pinned before the first ECALL, so everything the thread allocates is local to its core
+                EnclaveNode::place_thread(PLACEMENT_ENCLAVE_WORKERS, thread_id);
+                regression(enclave, thread_id, enc_analysis_type);
+            });
             thread_group.add_thread(enclave_thread);
         }
 
@@ -196,6 +192,16 @@ int start_enclave() {
             goto exit;
         }
         
+        EnclaveNode::start_perf_ticker();
+        result = setup_perf_counters(enclave, num_threads, EnclaveNode::get_perf_ticks(), 
+                                     EnclaveNode::get_perf_export_interval());
+        if (result != OE_OK) {
+            fprintf(stderr,
+                    "calling into enclave_gwas failed: result=%u (%s)\n",
+                    result, oe_result_str(result));
+            goto exit;
+        }
+
         result = setup_num_patients(enclave);
         if (result != OE_OK) {
             fprintf(stderr,
@@ -204,7 +210,28 @@ int start_enclave() {
             goto exit;
         }
 
-        result = setup_enclave_phenotypes(enclave, num_threads, enc_analysis_type, EnclaveNode::get_impute_policy());
+        result = setup_enclave_phenotypes(enclave, num_threads, enc_analysis_type, 
+                                          EnclaveNode::get_enclave_heap_size(), EnclaveNode::get_batch_budget_override());
+        if (result != OE_OK) {
+            fprintf(stderr,
+                    "calling into enclave_gwas failed: result=%u (%s)\n",
+                    result, oe_result_str(result));
+            goto exit;
+        }
+
+        ingest_phenotypes([](int dpi, int column, int chunk_idx, const std::string& chunk) {
+            bool accepted = false;
+            oe_result_t ingest_result = ingest_phenotype_chunk(enclave, &accepted, dpi, column, chunk_idx,
+                                                               (const unsigned char*)chunk.data(), chunk.length());
+            if (ingest_result != OE_OK) {
+                fprintf(stderr,
+                        "calling into enclave_gwas failed: result=%u (%s)\n",
+                        ingest_result, oe_result_str(ingest_result));
+            }
+            return ingest_result == OE_OK && accepted;
+        });
+
+        result = finish_enclave_phenotypes(enclave, num_threads, EnclaveNode::get_impute_policy());
         if (result != OE_OK) {
             fprintf(stderr,
                     "calling into enclave_gwas failed: result=%u (%s)\n",
@@ -219,7 +246,8 @@ int start_enclave() {
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
         std::cout << "Enclave time total: " << duration.count() << std::endl;
 
-        EnclaveNode::print_timings();
+        EnclaveNode::stop_perf_ticker();
+        EnclaveNode::print_perf_counters();
         EnclaveNode::cleanup_output();
     } catch (ERROR_t& err) {
         std::cerr << "ERROR: " << err.msg << std::endl << std::flush;
@@ -228,6 +256,7 @@ int start_enclave() {
     ret = 0;
 
 exit:
+    EnclaveNode::stop_perf_ticker();
     // Clean up the enclave if we created one
     if (enclave) oe_terminate_enclave(enclave);
 
@@ -248,20 +277,31 @@ int start_enclave() {
         boost::thread_group thread_group;
 
         for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
-            boost::thread* enclave_thread = new boost::thread(regression, thread_id, enc_analysis_type);
+            boost::thread* enclave_thread = new boost::thread([thread_id, enc_analysis_type]() {
+                EnclaveNode::place_thread(PLACEMENT_ENCLAVE_WORKERS, thread_id);
+                regression(thread_id, enc_analysis_type);
+            });
             thread_group.add_thread(enclave_thread);
         }
 
         setup_enclave_encryption(num_threads);
+        EnclaveNode::start_perf_ticker();
+        setup_perf_counters(num_threads, EnclaveNode::get_perf_ticks(), EnclaveNode::get_perf_export_interval());
         setup_num_patients();
-        setup_enclave_phenotypes(num_threads, enc_analysis_type, EnclaveNode::get_impute_policy());
+        setup_enclave_phenotypes(num_threads, enc_analysis_type, 
+                                 EnclaveNode::get_enclave_heap_size(), EnclaveNode::get_batch_budget_override());
+        ingest_phenotypes([](int dpi, int column, int chunk_idx, const std::string& chunk) {
+            return ingest_phenotype_chunk(dpi, column, chunk_idx, (const unsigned char*)chunk.data(), chunk.length());
+        });
+        finish_enclave_phenotypes(num_threads, EnclaveNode::get_impute_policy());
         auto start = std::chrono::high_resolution_clock::now();
         thread_group.join_all();
         auto stop = std::chrono::high_resolution_clock::now();
 
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
         std::cout << "Enclave time total: " << duration.count() << std::endl;
-        EnclaveNode::print_timings();
+        EnclaveNode::stop_perf_ticker();
+        EnclaveNode::print_perf_counters();
         EnclaveNode::cleanup_output();
     } catch (ERROR_t& err) {
         std::cerr << "ERROR: " << err.msg << std::endl << std::flush;
@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <stdexcept>
 #include <chrono>
+#include <cstring>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -17,18 +18,16 @@
 #include "enclave.h"
 #include "hashing.h"
 #include "errno.h"
-
-#ifdef NON_OE
-#define AVERAGE_OCALL_OVERHEAD_MICROSECONDS 0.00003534999965
-#else
-#define AVERAGE_OCALL_OVERHEAD_MICROSECONDS 5.00908909
-#endif
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
 
 std::mutex cout_lock;
 
 bool terminating = false;
+// the matched line queue may always hold this many lines, however slow the enclave is
+const size_t MIN_MATCHED_LINE_TARGET = 1024;
 
-const int MIN_BLOCK_COUNT = 50;
 
 EnclaveNode::EnclaveNode(const std::string& config_file) {
     init(config_file);
@@ -88,6 +87,8 @@ void EnclaveNode::init(const std::string& config_file) {
         enc_analysis = EncAnalysis::linear_oblivious;
     } else if (enclave_config["analysis_type"] == "logistic-oblivious") {
         enc_analysis = EncAnalysis::logistic_oblivious;
+    } else if (enclave_config["analysis_type"] == "null") {
+        enc_analysis = EncAnalysis::null_kernel;
     } else {
         throw std::runtime_error("Invalid enclave analysis selected.");
     }
@@ -104,168 +105,148 @@ void EnclaveNode::init(const std::string& config_file) {
     }
 
     server_eof = false;
-    max_batch_lines = 0;
-    global_id = -1;
+    batch_budget = 0;
+
+    // The enclave sizes its batches from its heap, so read it from the config the enclave was signed with
+    enclave_heap_size = 0;
+    std::string enclave_conf_name = "../enclave/gwas_enc.conf";
+    if (enclave_config.count("enclave_conf")) {
+        enclave_conf_name = enclave_config["enclave_conf"];
+    }
+    std::ifstream enclave_conf(enclave_conf_name);
+    std::string conf_line;
+    while (std::getline(enclave_conf, conf_line)) {
+        if (conf_line.compare(0, 13, "NumHeapPages=") == 0) {
+            enclave_heap_size = std::stoull(conf_line.substr(13)) * ENCLAVE_PAGE_SIZE;
+        }
+    }
+    if (!enclave_heap_size) {
+        std::cout << "Could not read NumHeapPages from " << enclave_conf_name << ", using default batch size" << std::endl;
+    }
+
+    batch_budget_override = 0;
+    if (enclave_config.count("batch_budget_bytes")) {
+        batch_budget_override = enclave_config["batch_budget_bytes"];
+    }
+
+    // Loci are merged per chromosome partition, one matcher thread each
+    num_matchers = 4;
+    if (enclave_config.count("matcher_threads")) {
+        num_matchers = enclave_config["matcher_threads"];
+    }
+    if (num_matchers < 1) {
+        throw std::runtime_error("Config \"matcher_threads\" must be at least 1.");
+    }
+    matchers_finished = 0;
+    first_line_matched = false;
+
+    // How many batches past the next expected one we buffer per institution before
+    // we stop reading its data connection
+    reorder_window = 256;
+    if (enclave_config.count("reorder_window")) {
+        reorder_window = enclave_config["reorder_window"];
+    }
+    if (reorder_window < 1) {
+        throw std::runtime_error("Config \"reorder_window\" must be at least 1.");
+    }
 
-    // Make a bucket for each possible port number. This is not very space
-    // efficient but I couldn't find a good lock free unordered_set
-    // so this will do just fine. All race conditions are basically benign.
-    seen_fds.resize(65354);
-    std::fill(seen_fds.begin(), seen_fds.end(), false);
+    // Results are sent to the coordination server in chunks of at least this many bytes,
+    // or whatever has been waiting for output_flush_ms
+    output_flush_bytes = 1 << 20;
+    if (enclave_config.count("output_flush_bytes")) {
+        output_flush_bytes = enclave_config["output_flush_bytes"];
+    }
+    // a chunk can overshoot by one enclave batch, keep the message under the limit
+    if (!output_flush_bytes || output_flush_bytes > MAX_MESSAGE_SIZE / 2) {
+        throw std::runtime_error("Config \"output_flush_bytes\" must be between 1 and " + std::to_string(MAX_MESSAGE_SIZE / 2) + ".");
+    }
+    output_flush_interval = std::chrono::milliseconds(50);
+    if (enclave_config.count("output_flush_ms")) {
+        output_flush_interval = std::chrono::milliseconds(enclave_config["output_flush_ms"].get<int>());
+    }
+
+    // Credit based flow control, see credit_granter. A DPI never sends a batch more than
+    // data_credit_batches past the routed position, and its EOF comes right after its last batch,
+    // so both always fit in the reorder window.
+    data_credit_batches = 64;
+    if (enclave_config.count("data_credit_batches")) {
+        data_credit_batches = enclave_config["data_credit_batches"];
+    }
+    if (data_credit_batches < 1 || data_credit_batches >= reorder_window) {
+        throw std::runtime_error("Config \"data_credit_batches\" must be at least 1 and less than \"reorder_window\".");
+    }
+    max_outstanding_blocks = 1 << 16;
+    if (enclave_config.count("max_outstanding_blocks")) {
+        max_outstanding_blocks = enclave_config["max_outstanding_blocks"];
+    }
+    data_credit_interval = std::chrono::milliseconds(5);
+    if (enclave_config.count("data_credit_ms")) {
+        data_credit_interval = std::chrono::milliseconds(enclave_config["data_credit_ms"].get<int>());
+    }
+    lines_consumed = 0;
+
+    perf_export_interval = 0;
+    if (enclave_config.count("perf_export_batches")) {
+        perf_export_interval = enclave_config["perf_export_batches"];
+    }
+    perf_ticks = 0;
+    perf_ticking = false;
+    global_id = -1;
 
-    allele_queue_list.resize(num_threads);
     eof_read_list.resize(num_threads);
+    carry_line_list.resize(num_threads);
 
     for (int id = 0; id < num_threads; ++id) {
         eof_read_list[id] = false;
     }
 
+    placement.load(enclave_config, {PLACEMENT_ENCLAVE_WORKERS, PLACEMENT_MATCHERS, PLACEMENT_NETWORK});
+    guarded_cout(placement.report(), cout_lock);
+
     // Also start the enclave thread.
     boost::thread enclave_thread(start_enclave);
     enclave_thread.detach();
 }
 
 void EnclaveNode::run() {
-    // set up the server to do nothing when it receives a broken pipe error
-    //signal(SIGPIPE, signal_handler);
-    // create a master socket to listen for requests on
-    // (1) Create socket
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    // (2) Set the "reuse port" socket option
-	int yesval = 1;
-	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval));
-
-    // (3) Create a sockaddr_in struct for the proper port and bind() to it.
-	struct sockaddr_in addr;
-    socklen_t addrSize = sizeof(addr);
-    memset(&addr, 0, addrSize);
-
-    // specify socket family (Internet)
-	addr.sin_family = AF_INET;
-
-	// specify socket hostname
-	// The socket will be a server, so it will only be listening.
-	// Let the OS map it to the correct address.
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    // bind to our given port, or randomly get one if port = 0
-	if (bind(sockfd, (struct sockaddr*) &addr, addrSize) < 0) {
-        guarded_cout("bind failure: " + std::to_string(errno), cout_lock);
-    }
-
-    // update our member variable to the port we just assigned
-    if (getsockname(sockfd, (struct sockaddr*) &addr, &addrSize) < 0) {
-        guarded_cout("getsockname failure: " + std::to_string(errno), cout_lock);
-    }
-
-    // (4) Begin listening for incoming connections.
-	if (listen(sockfd, 4096) < 0) {
-        guarded_cout("listen: " + std::to_string(errno), cout_lock);
+    // the reactor's threads are started from this one and inherit its cores
+    placement.pin_current(PLACEMENT_NETWORK);
+    // DATA blocks are parsed as views into the payload, a pooled buffer is only reused once they are all matched
+    Reactor reactor(enclave_config,
+                    [this](int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload) {
+                        return receive_message(connFD, header, payload);
+                    },
+                    [this](size_t payload_length) { return receive_buffers.acquire(payload_length); });
+    port = reactor.listen(port);
+    std::string own_hostname;
+    std::ifstream ipfile("ip.txt");
+    std::getline(ipfile, own_hostname);
+    std::string own_path;
+    bool shared_memory;
+    // ip.txt may name a socket file of our own, see parse_local_endpoint
+    if (parse_local_endpoint(own_hostname, own_path, shared_memory) && !own_path.empty()) {
+        reactor.listen_local(own_path);
     }
-
-    port = ntohs(addr.sin_port);
     guarded_cout("\n Running on port " + std::to_string(port), cout_lock);
 
+    reactor.run();
+}
 
-    // (5) Serve incoming connections one by one forever (a lonely fate).
-	while (true) {
-        // accept connection from dpi
-        int connFD = accept(sockfd, (struct sockaddr*) &addr, &addrSize);
-
-        // spin up a new thread to handle this message
-        boost::thread msg_thread(&EnclaveNode::start_thread, this, connFD, nullptr);
-        msg_thread.detach();
-    }
-}
-
-bool EnclaveNode::start_thread(int connFD, char* body_buffer) {
-    // if we catch any errors we will throw an error to catch and close the connection
-    bool buffer_given = body_buffer != nullptr;
-    if (!buffer_given) {
-        body_buffer = new char[MAX_MESSAGE_SIZE]();
-    }
-    try {
-        char header_buffer[128];
-        // receive header, byte by byte until we hit deliminating char
-        memset(header_buffer, 0, sizeof(header_buffer));
-
-        int header_size = 0;
-        bool found_delim = false;
-        while (header_size < 128) {
-            // Receive exactly one byte
-            int rval = recv(connFD, header_buffer + header_size, 1, MSG_WAITALL);
-            if (rval == -1) {
-                char buffer[ 256 ];
-                char * errorMsg = strerror_r( errno, buffer, 256 ); // GNU-specific version, Linux default
-                printf("Error %s\n", errorMsg); //return value has to be used since buffer might not be modified
-                throw std::runtime_error("Socket recv failed\n");
-            } else if (rval == 0) {
-                std::cout << "rval was 0" << std::endl;
-                return false;
-            }
-            // Stop if we received a deliminating character
-            if (header_buffer[header_size] == '\n') {
-                found_delim = true;
-                break;
-            }
-            header_size++;
-        }
-        if (!found_delim) {
-            std::cout << "Recieved message without null terminating char" << std::endl;
-            std::cout << header_buffer << std::endl;
-            return true;
-            //throw std::runtime_error("Didn't read in a null terminating char");
-        }
-        std::string header(header_buffer, header_size);
-        if (header.find("GET / HTTP/1.1") != std::string::npos) {
-            std::cout << "Strange get request? Ignoring for now." << std::endl;
-            delete[] body_buffer;
-            return true;
-        }
-
-        unsigned int body_size;
-        try {
-            body_size = std::stoi(header);
-        } catch(const std::invalid_argument& e) {
-            std::cout << "Failed to read in body size" << std::endl;
-            std::cout << header << std::endl;
-            return true;
-        }
-        if (body_size != 0) {
-            // read in encrypted body
-            int rval = recv(connFD, body_buffer, body_size, MSG_WAITALL);
-            if (rval == -1) {
-                throw std::runtime_error("Error reading request body");
-            }
-        }
-        std::string body(body_buffer, body_size);
-
-        std::string msg;
-        std::string dpi_name;
-        EnclaveNodeMessageType mtype = DATA;
-        if (!body.length()) {
-            std::cout << "No body? " << header << " ! " << body << std::endl;
-            return true;
-        }
-        parse_header_enclave_node_header(body, msg, dpi_name, mtype, connFD);
+bool EnclaveNode::receive_message(int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload) {
+    std::string msg;
+    const std::string dpi_name = frame_sender(header);
+    const EnclaveNodeMessageType mtype = static_cast<EnclaveNodeMessageType>(header.mtype);
+    if (mtype == DATA) {
+        parse_data_message(dpi_name, payload, header.payload_length);
+    } else if (header.payload_length) {
+        msg.assign(payload.get(), header.payload_length);
+    }
 
-        // if (mtype != EnclaveNodeMessageType::DATA) {
-        //     guarded_cout("Msg type: " + std::to_string(mtype) + " dpi: " + dpi_name, cout_lock);
-        // }
+    // if (mtype != EnclaveNodeMessageType::DATA) {
+    //     guarded_cout("Msg type: " + std::to_string(mtype) + " dpi: " + dpi_name, cout_lock);
+    // }
 
-        handle_message(connFD, dpi_name, mtype, msg);
-    }
-    catch (const std::runtime_error e)  {
-        guarded_cout("Exception " + std::string(e.what()) + "\n", cout_lock);
-        close(connFD);
-        return false;
-    }
-    if (!buffer_given) {
-        delete[] body_buffer;
-    }
-    return true;
+    return handle_message(connFD, dpi_name, mtype, msg);
 }
 
 bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNodeMessageType mtype, std::string& msg) {
@@ -274,13 +255,30 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
     switch (mtype) {
         case GLOBAL_ID:
         {   
-            global_id = std::stoi(msg);
+            std::vector<std::pair<std::string, std::string> > registrations;
+            {
+                std::lock_guard<std::mutex> raii(early_registrations_lock);
+                global_id = std::stoi(msg);
+                registrations.swap(early_registrations);
+            }
+            setup_event.notify_all();
+            // answer the DPIs that registered before we knew our id
+            for (std::pair<std::string, std::string>& registration : registrations) {
+                handle_message(connFD, registration.first, REGISTER, registration.second);
+            }
             break;
         }
         case REGISTER:
         {
-            // Wait until we have a global id!
-            while (get_instance()->global_id < 0) { std::this_thread::yield(); }
+            // Our replies carry the global id, park the registration until it arrives rather
+            // than hold a handler thread that the GLOBAL_ID message may need
+            {
+                std::lock_guard<std::mutex> raii(early_registrations_lock);
+                if (global_id < 0) {
+                    early_registrations.emplace_back(name, msg);
+                    return true;
+                }
+            }
             std::lock_guard<std::mutex> raii(institutions_lock);
 
             if (institutions.count(name)) {
@@ -300,7 +298,9 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
                     institutions[name] = new Institution(hostname_and_port[0], 
                                                          std::stoi(hostname_and_port[1]),
                                                          id,
-                                                         num_threads);
+                                                         num_matchers,
+                                                         reorder_window,
+                                                         batch_arrived);
                 }
             }
             if (!found) {
@@ -318,20 +318,12 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
         }
         case AES_KEY:
         {
-            std::vector<std::string> aes_info;
-            Parser::split(aes_info, msg, '\t');
-
-            int thread_id = std::stoi(aes_info[2]);
-            // We only want 1 "check in"
-            if (thread_id == 0) {
-                check_in(name);
-            }
+            // One wrapped session secret per institution, the enclave derives the stream keys
             institutions_lock.lock();
-            institutions[name]->set_key_and_iv(
-                                    aes_info[0], // encrypted key
-                                    aes_info[1], // encrypted iv
-                                    thread_id); // thread id    
+            institutions[name]->set_session_secret(msg);
             institutions_lock.unlock();
+            setup_event.notify_all();
+            check_in(name);
             break;
         }
         case PATIENT_COUNT:
@@ -339,39 +331,63 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
             institutions_lock.lock();
             institutions[name]->set_num_patients(msg);
             institutions_lock.unlock();
+            setup_event.notify_all();
             break;
         }
         case Y_VAL:
         {
-            institutions[name]->set_y_data(msg);
+            // msg format: chunk index, chunk count, encrypted chunk (space delimited)
+            std::vector<std::string> chunk_split;
+            Parser::split(chunk_split, msg, ' ', 2);
+            if (chunk_split.size() != 3) {
+                throw std::runtime_error("Invalid y value chunk.");
+            }
+            institutions[name]->add_y_chunk(std::stoi(chunk_split[0]), std::stoi(chunk_split[1]), chunk_split[2]);
+            setup_event.notify_all();
             break;
         }
         case COVARIANT:
         {
-            std::vector<std::string> name_data_split;
-            Parser::split(name_data_split, msg, ' ', 1);
-            std::string covariant_name = name_data_split.front();
+            // msg format: covariant name, chunk index, chunk count, encrypted chunk (space delimited)
+            std::vector<std::string> chunk_split;
+            Parser::split(chunk_split, msg, ' ', 3);
+            if (chunk_split.size() != 4) {
+                throw std::runtime_error("Invalid covariant chunk.");
+            }
+            const std::string& covariant_name = chunk_split[0];
 
             if (!expected_covariants.count(covariant_name)) {
                 throw std::runtime_error("Unexpected covariant received.");
             }
-            institutions[name]->set_covariant_data(covariant_name, name_data_split.back());
+            institutions[name]->add_covariant_chunk(covariant_name, std::stoi(chunk_split[1]), 
+                                                    std::stoi(chunk_split[2]), chunk_split[3]);
+            setup_event.notify_all();
             break;
         }
         case EOF_DATA:
         {
-            DataBlockBatch* batch = new DataBlockBatch;
+            DataBlockBatch* batch = SlabPool<DataBlockBatch>::instance().create();
             batch->pos = std::stoi(msg);
-            DataBlock* block = new DataBlock;
+            DataBlock* block = SlabPool<DataBlock>::instance().create();
 
             block->locus = EOFSeperator;
+            block->locus_length = strlen(EOFSeperator);
             block->data = EOFSeperator;
+            block->data_length = strlen(EOFSeperator);
+            block->key = VARIANT_KEY_EOF;
 
             batch->blocks_batch.push_back(block);
             institutions[name]->add_block_batch(batch);
             //institutions[name]->transfer_eligible_blocks();
             break;
         }
+        case DATA_ERROR:
+        {
+            // the DPI's data stops short, no output from this run is complete
+            guarded_cout("ERROR: " + name + " failed to send its data: " + msg, cout_lock);
+            send_msg_output(name + ": " + msg, RUN_FAILED);
+            exit(1);
+        }
         case DATA:
         {
             // Added optimization to handle this within in the parser... might undo in the future.
@@ -389,40 +405,35 @@ bool EnclaveNode::handle_message(int connFD, const std::string& name, EnclaveNod
     if (response.length()) {
         send_msg(name, response_mtype, response);
     }
-    if (mtype != DATA && mtype != EOF_DATA) {
-        // cool, well handled!
-        //guarded_cout("\nClosing connection", cout_lock);
-        close(connFD);
-        //guarded_cout("\n--------------", cout_lock);
-        return false;
-    } 
-    return true;  
+    // senders keep their connections in a pool, they stay open until the sender closes them
+    return true;
 }
 
-int EnclaveNode::send_msg(const std::string& hostname, const int port, const int mtype, const std::string& msg, int connFD) {
-    std::string message = std::to_string(global_id) + " " + std::to_string(mtype) + " ";
-    message = std::to_string(message.length() + msg.length()) + "\n" + message + msg;
-    return send_message(hostname.c_str(), 
-                        port, 
-                        message.c_str(), 
-                        message.length(), 
-                        connFD);
+void EnclaveNode::send_msg(const std::string& hostname, const int port, const int mtype, const std::string& msg, ConnectionChannel channel) {
+    ConnectionPool::instance().send(hostname, 
+                                    port, 
+                                    channel, 
+                                    std::to_string(global_id), 
+                                    mtype, 
+                                    msg.data(), 
+                                    msg.length());
 }
 
-int EnclaveNode::send_msg(const std::string& name, const int mtype, const std::string& msg, int connFD) {
-    return send_msg(institutions[name]->hostname, 
-                    institutions[name]->port, 
-                    mtype, 
-                    msg, 
-                    connFD);
+void EnclaveNode::send_msg(const std::string& name, const int mtype, const std::string& msg, ConnectionChannel channel) {
+    send_msg(institutions[name]->hostname, 
+             institutions[name]->port, 
+             mtype, 
+             msg, 
+             channel);
 }
 
-int EnclaveNode::send_msg_output(const std::string& msg, CoordinationServerMessageType msg_type, int connFD) {
-    return send_msg(enclave_config["coordination_server_info"]["hostname"], 
-                    enclave_config["coordination_server_info"]["port"],
-                    msg_type,
-                    msg,
-                    connFD);
+void EnclaveNode::send_msg_output(const std::string& msg, CoordinationServerMessageType msg_type) {
+    // OUTPUT and EOF_OUTPUT share a connection, so the EOF arrives after every chunk
+    send_msg(enclave_config["coordination_server_info"]["hostname"], 
+             enclave_config["coordination_server_info"]["port"],
+             msg_type,
+             msg,
+             CHANNEL_OUTPUT);
 }
 
 void EnclaveNode::check_in(const std::string& name) {
@@ -438,13 +449,21 @@ void EnclaveNode::check_in(const std::string& name) {
         for (const auto& it : institutions) {
             send_msg(it.first, Y_AND_COV, covariant_list + y_val_name);
 
-            institutions[it.first]->request_conn = send_msg(it.first, DATA_REQUEST, std::to_string(MIN_BLOCK_COUNT), institutions[it.first]->request_conn);
+            // the request carries the first credit, the DPI sends nothing past it
+            institutions[it.first]->credit_granted = data_credit_batches;
+            send_msg(it.first, DATA_REQUEST, std::to_string(data_credit_batches), CHANNEL_CREDIT);
         }
+        boost::thread credit_thread(&EnclaveNode::credit_granter, this);
+        credit_thread.detach();
 
 
-        // Now that all institutions are registered, start up the allele matching thread.
-        boost::thread msg_thread(&EnclaveNode::allele_matcher, this);
-        msg_thread.detach();
+        // Now that all institutions are registered, start up the allele matching threads.
+        boost::thread router_thread(&EnclaveNode::block_router, this);
+        router_thread.detach();
+        for (int partition = 0; partition < num_matchers; ++partition) {
+            boost::thread matcher_thread(&EnclaveNode::allele_matcher, this, partition);
+            matcher_thread.detach();
+        }
 
         // And now start up the thread to send out our results to the register server.
         boost::thread output_thread(&EnclaveNode::output_sender, this);
@@ -452,230 +471,249 @@ void EnclaveNode::check_in(const std::string& name) {
     }
 }
 
-void EnclaveNode::data_listener(int connFD) {
-    // We need a serial listener for this agreed upon connection!
-    char* body_buffer = new char[MAX_MESSAGE_SIZE]();
-    while(start_thread(connFD, body_buffer)) {}
-    delete[] body_buffer;
+void EnclaveNode::credit_granter() {
+    placement.pin_current(PLACEMENT_MATCHERS);
+    // Every interval, give each DPI another data_credit_batches batches past what has been routed,
+    // unless the host is already holding enough. The matched line queue should hold about two
+    // intervals of what the enclave gets through, and an institution may have at most
+    // max_outstanding_blocks blocks received but not yet matched.
+    uint64_t last_consumed = 0;
+    while (matchers_finished != num_matchers) {
+        std::this_thread::sleep_for(data_credit_interval);
+        const uint64_t consumed = lines_consumed.load(std::memory_order_relaxed);
+        const size_t queue_target = std::max<uint64_t>(MIN_MATCHED_LINE_TARGET, 2 * (consumed - last_consumed));
+        last_consumed = consumed;
+        if (allele_queue.size_approx() >= queue_target) {
+            continue;
+        }
+        for (const auto& it : institutions) {
+            Institution* institution = it.second;
+            if (institution->get_blocks_outstanding() >= max_outstanding_blocks) {
+                continue;
+            }
+            const int credit = institution->get_routed_pos() + data_credit_batches;
+            if (credit > institution->credit_granted) {
+                institution->credit_granted = credit;
+                // credits follow the DATA_REQUEST on its connection
+                send_msg(it.first, DATA_CREDIT, std::to_string(credit), CHANNEL_CREDIT);
+            }
+        }
+    }
 }
 
-void EnclaveNode::allele_matcher() {
-    //auto start = std::chrono::high_resolution_clock::now();
-
-    bool first = true;
-    while(true) {
-    loop_start:
-        // transfer all blocks to eligible queue, making sure they are in order
+void EnclaveNode::block_router() {
+    placement.pin_current(PLACEMENT_MATCHERS);
+    // Institutions only release blocks in the order their DPI sent them, and only this thread
+    // releases them, so every partition queue has a single producer.
+    while (matchers_finished != num_matchers) {
         for (const auto& it : institutions) {
-            Institution* inst = it.second;
-            inst->transfer_eligible_blocks();
+            it.second->transfer_eligible_blocks();
         }
-        // match as many alleles together as possible
-        while(true) {
-            // arbitary "high" string, all real loci should be smaller than this string.
-            std::string min_locus = "~";
-            for (const auto& it : institutions) {
-                Institution* inst = it.second;
-                DataBlock* block = inst->get_top_block();
-                // check if the institution has data
-                if (!block) {
-                    // if we've already received an <EOF> notice and emptied the blocks pq, skip this block
-                    if (inst->all_data_received && !inst->get_blocks_size()) {
-                        continue;
-                    }
-                    // otherwise, we need to wait for all institutions to send their data!
-                    else {
-                        std::this_thread::yield();
-                        goto loop_start;
-                    }
-                }
-                // test if block->locus < min_locus
-                if (min_locus.compare(block->locus) > 0) {
-                    min_locus = block->locus;
-                }
+        // sleep until a listener stores a batch some institution can release
+        batch_arrived.await([this]() {
+            if (matchers_finished == num_matchers) {
+                return true;
             }
-            // if we did not find a min locus, all data has been received and we have processed all of it.
-            // enqueue EOF for all enclave threads then shut down the matcher, its work is done.
-            if (min_locus == "~") {
-                std::cout << "received last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
-                for (int thread_id = 0; thread_id < num_threads; ++thread_id) {
-                    allele_queue_list[thread_id].enqueue(EOFSeperator);
+            for (const auto& it : institutions) {
+                if (it.second->has_eligible_batch()) {
+                    return true;
                 }
-                // auto stop = std::chrono::high_resolution_clock::now();
-                // auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-                // guarded_cout("Matcher time total: " + std::to_string(duration.count()), cout_lock);
-                return;
             }
+            return false;
+        });
+    }
+}
 
-            std::string allele_line = min_locus + "\t";
-            std::string data;
-
-            int locus_hash_thread = hash_string(allele_line, num_threads, true); 
+void EnclaveNode::allele_matcher(const int partition) {
+    placement.pin_current(PLACEMENT_MATCHERS, partition);
+    typedef std::pair<uint64_t, int> InstitutionHead;
 
-            for (int institutions_idx = 0; institutions_idx < institution_list.size(); ++institutions_idx) {
-                Institution* inst = institutions[institution_list[institutions_idx]];
-                DataBlock* block = inst->get_top_block();
-                // if this institution is <EOF>, skip it.
-                if (!block) continue;
+    std::vector<Institution*> institution_heads;
+    std::vector<int> refill;
+    for (size_t id = 0; id < institution_list.size(); ++id) {
+        institution_heads.push_back(institutions[institution_list[id]]);
+        refill.push_back(id);
+    }
+    const size_t bitmap_bytes = PRESENCE_BITMAP_BYTES(institution_list.size());
 
-                if (block->locus == min_locus) {
-                    block = inst->pop_top_block();
-                    allele_line.append(std::to_string(inst->get_id()) + "\t");
-                    data.append(block->data);
-                    delete block;
-                }
+    // k-way merge on variant keys, each institution has exactly one entry: the key of its head block
+    std::priority_queue<InstitutionHead, std::vector<InstitutionHead>, std::greater<InstitutionHead> > heads;
+    std::vector<int> matched;
+    while(true) {
+        // only the institutions whose head we just used have to be waited on
+        for (int id : refill) {
+            Institution* institution = institution_heads[id];
+            DataBlock* block = institution->get_top_block(partition);
+            if (!block) {
+                institution->routed.await([institution, partition, &block]() {
+                    return (block = institution->get_top_block(partition)) != nullptr;
+                });
             }
-            // replace last tab with a space so that we know where the data starts
-            allele_line.pop_back();
-            allele_line.push_back(' ');
+            heads.push(InstitutionHead(block->key, id));
+        }
+        refill.clear();
 
-            allele_line.append(data);
+        // once the smallest head is EOF, every institution has sent all of this partition
+        const uint64_t min_key = heads.top().first;
+        if (min_key == VARIANT_KEY_EOF) {
+            break;
+        }
+        while (!heads.empty() && heads.top().first == min_key) {
+            matched.push_back(heads.top().second);
+            heads.pop();
+        }
+        // the enclave expects the data in institution id order
+        std::sort(matched.begin(), matched.end());
+
+        // the genotype bytes are copied exactly once on the host, from the receive buffer into this line
+        DataBlock* head = institution_heads[matched.front()]->get_top_block(partition);
+        size_t line_length = head->locus_length + bitmap_bytes + 16;
+        for (int id : matched) {
+            line_length += institution_heads[id]->get_top_block(partition)->data_length;
+        }
+        std::string allele_line;
+        allele_line.reserve(line_length);
+        allele_line.append(head->locus, head->locus_length);
+        allele_line.push_back('\t');
+
+        // The DPIs picked the key stream with this same hash, tell the enclave which one it is
+        int locus_hash_stream = hash_string(allele_line, num_threads, true); 
+        allele_line.append(std::to_string(locus_hash_stream) + "\t");
+
+        // one bit per institution, set for the institutions that have this locus
+        const size_t bitmap_start = allele_line.length();
+        allele_line.append(bitmap_bytes, '\0');
+        for (int id : matched) {
+            DataBlock* block = institution_heads[id]->pop_top_block(partition);
+            allele_line[bitmap_start + id / 8] |= 1 << (id % 8);
+            allele_line.append(block->data, block->data_length);
+            SlabPool<DataBlock>::instance().destroy(block);
+        }
+        refill.swap(matched);
 
-            // For the first line we want to calculate the max number of lines per batch
-            if (first) {
-                std::cout << "received first message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
-                // start = std::chrono::high_resolution_clock::now();
-                first = false;
-            }
-            
-            // thread-safe enqueue
-            allele_queue_list[locus_hash_thread].enqueue(allele_line);
+        if (!first_line_matched.exchange(true)) {
+            std::cout << "received first message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
         }
+        
+        // thread-safe enqueue, whichever enclave thread is free picks it up
+        allele_queue.enqueue(allele_line);
+        allele_queue_event.notify_all();
+    }
+
+    // The queue is only FIFO per producer, so an EOF enqueued here could overtake another
+    // matcher's lines. The enclave threads instead stop once every matcher has finished and
+    // the queue is empty.
+    if (matchers_finished.fetch_add(1) + 1 == num_matchers) {
+        std::cout << "received last message: "  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << std::endl;
     }
+    // wakes enclave threads waiting on an empty queue
+    allele_queue_event.notify_all();
+    // lets the router see that every matcher is done
+    batch_arrived.notify_all();
 }
 
 void EnclaveNode::output_sender() {
-    std::string output_str;
-    std::unique_lock<std::mutex> lk(get_instance()->output_queue_lock);
-    bool eof_sent = false;
-    while(!terminating || output_queue.size()) {
+    // Everything goes over one pooled connection to the coordination server. Results are coalesced
+    // into chunks of output_flush_bytes, a chunk that has been waiting output_flush_interval
+    // is sent early. The last chunk is sent as EOF_OUTPUT, which also ends the stream.
+    std::string chunk;
+    std::string sending;
+    chunk.reserve(output_flush_bytes);
+    std::chrono::steady_clock::time_point chunk_started;
+    std::unique_lock<std::mutex> lk(output_queue_lock);
+    while (true) {
         // This wait -> signal system seriously improves performance as it reduces busy waiting
-        if (!terminating && !output_queue.size())
-            output_queue_cv.wait(lk);
-
-        while (output_queue.size()) {
-            output_str = output_queue.front();
-            output_queue.pop();
-            if (terminating && !output_queue.size()) {
-                get_instance()->send_msg_output(output_str, CoordinationServerMessageType::EOF_OUTPUT);
-                eof_sent = true;
+        if (!terminating && output_queue.empty()) {
+            if (chunk.empty()) {
+                output_queue_cv.wait(lk);
             } else {
-                get_instance()->send_msg_output(output_str, CoordinationServerMessageType::OUTPUT);
+                output_queue_cv.wait_until(lk, chunk_started + output_flush_interval);
             }
-            
         }
-    }
-    lk.unlock();
-    if (!eof_sent) {
-        get_instance()->send_msg_output(EOFSeperator, EOF_OUTPUT);
-    }
-} 
-
-void EnclaveNode::parse_header_enclave_node_header(const std::string& header, std::string& msg, 
-                                                       std::string& dpi_name, EnclaveNodeMessageType& mtype,
-                                                       int connFD) {
-    int header_idx = 0;
-    // Parse dpi name
-    while(header[header_idx] != ' ') {
-        dpi_name.push_back(header[header_idx++]);
-        if (header_idx >= header.length()) {
-            std::cout << "1 Invalid header? " << header << std::endl;
+        while (!output_queue.empty() && chunk.length() < output_flush_bytes) {
+            if (chunk.empty()) {
+                chunk_started = std::chrono::steady_clock::now();
+            }
+            chunk.append(output_queue.front());
+            output_queue.pop();
         }
-    }
-    header_idx++;
-    // Parse mtype
-    std::string mtype_str;
 
-    while(header[header_idx] != ' ') {
-        mtype_str.push_back(header[header_idx++]);
-        if (header_idx >= header.length()) {
-            std::cout << "2 Invalid header? " << header << std::endl;
+        const bool done = terminating && output_queue.empty();
+        const bool due = chunk.length() >= output_flush_bytes || 
+                         (chunk.length() && std::chrono::steady_clock::now() >= chunk_started + output_flush_interval);
+        if (!done && !due) {
+            continue;
         }
-    }
-    header_idx++;
-    try {
-        mtype = static_cast<EnclaveNodeMessageType>(std::stoi(mtype_str));
-    } catch(const std::invalid_argument& e) {
-        std::cout << "Failed to read in mtype" << std::endl;
-        std::cout << "header " << header << "\n msg " << msg << std::endl;
-        return;
-    }
-
-    if (mtype != EnclaveNodeMessageType::DATA) {
-        for (; header_idx < header.length(); ++header_idx) {
-            msg.push_back(header[header_idx]);
+        sending.swap(chunk);
+        lk.unlock();
+        if (done) {
+            send_msg_output(sending.length() ? sending : EOFSeperator, EOF_OUTPUT);
+            break;
         }
-        return;
+        send_msg_output(sending, OUTPUT);
+        sending.clear();
+        lk.lock();
     }
+} 
 
-    if (connFD > 65353 || connFD < 0) {
-        throw std::runtime_error("ConnFD out of range " + std::to_string(connFD));
-    }
-    if (!seen_fds[connFD]) {
-        seen_fds[connFD] = true;
-        boost::thread data_listener_thread(&EnclaveNode::data_listener, this, connFD);
-        data_listener_thread.detach();
+void EnclaveNode::parse_data_message(const std::string& dpi_name, const std::shared_ptr<char>& payload,
+                                     const size_t payload_length) {
+    const char* header = payload.get();
+    size_t header_idx = 0;
+    if (!payload_length) {
+        throw std::runtime_error("Empty DATA message");
     }
 
-    DataBlockBatch* batch = new DataBlockBatch;
-    std::string pos_str;
-    // Parse batch position
-    while(header[header_idx++] != '\t') {
-        pos_str.push_back(header[header_idx - 1]);
-        if (header_idx > header.length()) {
-            std::cout << "3 Invalid header? " << header << std::endl;
-        }
+    // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
+    const char* header_end = static_cast<const char*>(memchr(header, '\n', payload_length));
+    if (!header_end) {
+        throw std::runtime_error("3 Invalid header? DATA message without a terminating char");
     }
-
-    try {
-        batch->pos = std::stoi(pos_str);
-    } catch(const std::invalid_argument& e) {
-        std::cout << "Failed to read in pos" << std::endl;
-        std::cout << "header " << header << "\n msg " << msg << std::endl;
-        return;
+    const char* field = header + header_idx;
+    char* field_end;
+    // Parse batch position
+    const long pos = strtol(field, &field_end, 10);
+    if (field_end == field || field_end > header_end) {
+        throw std::runtime_error("Failed to read in pos");
     }
 
-    
-
-    // msg format: blocks sent \t lengths (tab delimited) \n (terminating char) blocks of data w no delimiters
-    std::vector<int> lengths;
-    std::string length_str;
-    try {
-        while(header[header_idx++] != '\n') {
-            if (header[header_idx - 1] == '\t') {
-                lengths.push_back(std::stoi(length_str));
-                length_str.clear();
-                continue;
-            }
-            length_str.push_back(header[header_idx - 1]);
-            if (header_idx > header.length()) {
-                std::cout << "4 Invalid header? " << header << std::endl;
-            }
+    std::vector<uint32_t> lengths;
+    while (field_end < header_end) {
+        if (*field_end != '\t') {
+            throw std::runtime_error("4 Invalid header? Bad block length list");
+        }
+        field = field_end + 1;
+        lengths.push_back(strtoul(field, &field_end, 10));
+        if (field_end == field || field_end > header_end) {
+            throw std::runtime_error("4 Invalid header? Bad block length list");
         }
-        lengths.push_back(std::stoi(length_str));
-    } catch (const std::exception& e) {
-        std::cout << "Failed header parse with error " << e.what() << std::endl;
     }
 
-    for (int length : lengths) {
-        const std::string substr = header.substr(header_idx, length);
+    DataBlockBatch* batch = SlabPool<DataBlockBatch>::instance().create();
+    batch->pos = pos;
+    header_idx = header_end + 1 - header;
+    for (uint32_t length : lengths) {
+        if (header_idx + length > payload_length) {
+            throw std::runtime_error("DATA block runs past the end of the message");
+        }
+        const char* block_start = header + header_idx;
+        const char* block_end = block_start + length;
         header_idx += length;
-        int num_delims = 0;
-        DataBlock* block = new DataBlock;
-
-        for (char c : substr) {
-            if (c == '\t') {
-                // Throw out this tab char!
-                if (++num_delims == 2) {
-                    continue;
-                }
-            }
-            if (num_delims < 2) {
-                    block->locus.push_back(c);
-            } else {
-                block->data.push_back(c);
-            }
+
+        // chrom:pos \t alleles \t data, only the tab in front of the data is thrown out
+        const char* locus_tab = static_cast<const char*>(memchr(block_start, '\t', length));
+        const char* data_tab = locus_tab ? static_cast<const char*>(memchr(locus_tab + 1, '\t', block_end - locus_tab - 1)) : nullptr;
+        if (!data_tab) {
+            throw std::runtime_error("DATA block without a locus");
         }
+
+        DataBlock* block = SlabPool<DataBlock>::instance().create();
+        block->buffer = payload;
+        block->locus = block_start;
+        block->locus_length = data_tab - block_start;
+        block->data = data_tab + 1;
+        block->data_length = block_end - block->data;
+        block->key = Parser::parse_variant_key(block->locus, block->locus_length);
         batch->blocks_batch.push_back(block);
     }
 
@@ -712,29 +750,127 @@ void EnclaveNode::finish_setup() {
                             msg);
 }
 
-void EnclaveNode::start_timer(const std::string& func_name) {
-    get_instance()->enclave_clocks[func_name] = std::chrono::high_resolution_clock::now();
+void EnclaveNode::start_perf_ticker() {
+    EnclaveNode* inst = get_instance();
+    inst->perf_counters.resize(inst->num_threads);
+    inst->perf_ticking = true;
+    // Reading a host clock from inside the enclave would cost an OCALL per timer, instead we
+    // keep publishing the time to memory the enclave can see. Its resolution is the tick period,
+    // stages shorter than that are sampled rather than timed, which evens out over thousands of
+    // batches. A finer tick would wake this thread so often it takes a core from the workers.
+    inst->perf_ticker = std::thread([inst]() {
+        auto start = std::chrono::steady_clock::now();
+        while (inst->perf_ticking) {
+            inst->perf_ticks = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            std::this_thread::sleep_for(std::chrono::milliseconds(PERF_TICK_MILLISECONDS));
+        }
+    });
+}
+
+void EnclaveNode::stop_perf_ticker() {
+    EnclaveNode* inst = get_instance();
+    inst->perf_ticking = false;
+    if (inst->perf_ticker.joinable()) {
+        inst->perf_ticker.join();
+    }
+}
+
+const uint64_t* EnclaveNode::get_perf_ticks() {
+    return const_cast<const uint64_t*>(&get_instance()->perf_ticks);
+}
+
+size_t EnclaveNode::get_perf_export_interval() {
+    return get_instance()->perf_export_interval;
 }
 
-void EnclaveNode::stop_timer(const std::string& func_name) {
+void EnclaveNode::set_perf_counters(const uint8_t* counters, const size_t counters_size) {
     EnclaveNode* inst = get_instance();
-    if (!inst->enclave_total_times.count(func_name)) {
-        inst->enclave_total_times[func_name] = 0;
-        inst->enclave_total_calls[func_name] = 0;
+    if (counters_size % sizeof(PerfCounters)) {
+        throw std::runtime_error("Enclave exported a partial counter block.");
+    }
+    std::lock_guard<std::mutex> perf_guard(inst->perf_lock);
+    for (size_t offset = 0; offset < counters_size; offset += sizeof(PerfCounters)) {
+        PerfCounters block;
+        std::memcpy(&block, counters + offset, sizeof(PerfCounters));
+        if (block.thread_id < 0 || block.thread_id >= static_cast<int>(inst->perf_counters.size())) {
+            throw std::runtime_error("Enclave exported counters for unknown thread " + std::to_string(block.thread_id));
+        }
+        inst->perf_counters[block.thread_id] = block;
+        if (!block.finished) {
+            guarded_cout("Enclave thread " + std::to_string(block.thread_id) + ": " + std::to_string(block.batches) + 
+                         " batches, " + std::to_string(block.rows) + " rows", cout_lock);
+        }
     }
-    inst->enclave_total_times[func_name] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - inst->enclave_clocks[func_name]).count();
-    inst->enclave_total_calls[func_name] += 1;
 }
 
-void EnclaveNode::print_timings() {
+void EnclaveNode::print_perf_counters() {
     EnclaveNode* inst = get_instance();
-    for (auto it : inst->enclave_total_times) {
-        guarded_cout(it.first + "\t" + std::to_string(it.second - (inst->enclave_total_calls[it.first] * AVERAGE_OCALL_OVERHEAD_MICROSECONDS)), cout_lock);
+    std::lock_guard<std::mutex> perf_guard(inst->perf_lock);
+    PerfCounters total = PerfCounters();
+    for (const PerfCounters& block : inst->perf_counters) {
+        total.batches += block.batches;
+        total.rows += block.rows;
+        total.bytes_decrypted += block.bytes_decrypted;
+        total.convergence_failures += block.convergence_failures;
+        for (int outcome = 0; outcome < NUM_PERF_OUTCOMES; ++outcome) {
+            total.outcomes[outcome] += block.outcomes[outcome];
+        }
+        for (int bucket = 0; bucket < PERF_ITERATION_BUCKETS; ++bucket) {
+            total.newton_iterations[bucket] += block.newton_iterations[bucket];
+        }
+        for (int stage = 0; stage < NUM_PERF_STAGES; ++stage) {
+            total.stage_ticks[stage] += block.stage_ticks[stage];
+        }
     }
+    uint64_t total_ticks = 0;
+    for (int stage = 0; stage < NUM_PERF_STAGES; ++stage) {
+        total_ticks += total.stage_ticks[stage];
+    }
+
+    // stage times are summed over threads, so they add up to threads * wall time at most
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(3);
+    ss << "Enclave stages (thread seconds):\n";
+    for (int stage = 0; stage < NUM_PERF_STAGES; ++stage) {
+        ss << PERF_STAGE_NAMES[stage] << "\t" << total.stage_ticks[stage] / 1e9 << "\t"
+           << (total_ticks ? 100.0 * total.stage_ticks[stage] / total_ticks : 0.0) << "%\n";
+    }
+    ss << "batches\t" << total.batches << "\nrows\t" << total.rows 
+       << "\nbytes decrypted\t" << total.bytes_decrypted << "\n";
+    for (int outcome = 0; outcome < NUM_PERF_OUTCOMES; ++outcome) {
+        ss << PERF_OUTCOME_NAMES[outcome] << "\t" << total.outcomes[outcome] << "\n";
+    }
+    if (inst->enc_analysis == EncAnalysis::logistic || inst->enc_analysis == EncAnalysis::logistic_oblivious) {
+        ss << "convergence failures\t" << total.convergence_failures << "\nnewton iterations";
+        for (int bucket = 0; bucket < PERF_ITERATION_BUCKETS; ++bucket) {
+            if (total.newton_iterations[bucket]) {
+                ss << "\t" << bucket << (bucket == PERF_ITERATION_BUCKETS - 1 ? "+" : "") << ":" << total.newton_iterations[bucket];
+            }
+        }
+        ss << "\n";
+    }
+    for (const PerfCounters& block : inst->perf_counters) {
+        if (!block.finished) {
+            ss << "thread " << block.thread_id << " never reported its final counters\n";
+        }
+    }
+    ss << "event count spins\t" << event_count_spins().load() << "\n";
+    ss << slab_pool_stats_to_str<DataBlock>("DataBlock") << "\n"
+       << slab_pool_stats_to_str<DataBlockBatch>("DataBlockBatch") << "\n";
+    guarded_cout(ss.str(), cout_lock);
 }
 
-void EnclaveNode::set_max_batch_lines(unsigned int lines) {
-    get_instance()->max_batch_lines = lines;
+void EnclaveNode::set_batch_budget(size_t budget) {
+    get_instance()->batch_budget = budget;
+}
+
+size_t EnclaveNode::get_enclave_heap_size() {
+    return get_instance()->enclave_heap_size;
+}
+
+size_t EnclaveNode::get_batch_budget_override() {
+    return get_instance()->batch_budget_override;
 }
 
 uint8_t* EnclaveNode::get_rsa_pub_key() {
@@ -764,24 +900,14 @@ std::string EnclaveNode::get_covariants() {
     return cov_list;
 }
 
-std::string EnclaveNode::get_aes_key(const int institution_num, const int thread_id) {
+std::string EnclaveNode::get_session_secret(const int institution_num) {
     const std::string institution_name = get_instance()->institution_list[institution_num];
     std::lock_guard<std::mutex> raii(get_instance()->institutions_lock);
     if (!get_instance()->institutions.count(institution_name)) {
         return "";
     }
 
-    return get_instance()->institutions[institution_name]->get_aes_key(thread_id);
-}
-
-std::string EnclaveNode::get_aes_iv(const int institution_num, const int thread_id) {
-    const std::string institution_name = get_instance()->institution_list[institution_num];
-    std::lock_guard<std::mutex> raii(get_instance()->institutions_lock);
-    if (!get_instance()->institutions.count(institution_name)) {
-        return "";
-    }
-
-    return get_instance()->institutions[institution_name]->get_aes_iv(thread_id);
+    return get_instance()->institutions[institution_name]->get_session_secret();
 }
 
 std::string EnclaveNode::get_num_patients(const int institution_num) {
@@ -794,27 +920,28 @@ std::string EnclaveNode::get_num_patients(const int institution_num) {
     return get_instance()->institutions[institution_name]->get_num_patients();;
 }
 
-std::string EnclaveNode::get_y_data(const int institution_num) {
+bool EnclaveNode::get_y_chunks(const int institution_num, std::vector<std::string>& chunks) {
     const std::string institution_name = get_instance()->institution_list[institution_num];
+    std::lock_guard<std::mutex> raii(get_instance()->institutions_lock);
     if (!get_instance()->institutions.count(institution_name)) {
-        return "";
+        return false;
     }
 
-    std::string y_vals = get_instance()->institutions[institution_name]->get_y_data();
-    return y_vals;
+    return get_instance()->institutions[institution_name]->get_y_chunks(chunks);
 }
 
-std::string EnclaveNode::get_covariant_data(const int institution_num, const std::string& covariant_name) {
+bool EnclaveNode::get_covariant_chunks(const int institution_num, const std::string& covariant_name, 
+                                       std::vector<std::string>& chunks) {
     const std::string institution_name = get_instance()->institution_list[institution_num];
+    std::lock_guard<std::mutex> raii(get_instance()->institutions_lock);
     if (!get_instance()->institutions.count(institution_name)) {
-        return "";
+        return false;
     }
 
-    std::string cov_vals = get_instance()->institutions[institution_name]->get_covariant_data(covariant_name);
-    return cov_vals;
+    return get_instance()->institutions[institution_name]->get_covariant_chunks(covariant_name, chunks);
 }
 
-int EnclaveNode::get_allele_data(char* batch_data, const int thread_id) {
+int EnclaveNode::get_allele_data(char* batch_data, const size_t batch_size, const int thread_id) {
     std::string batch_data_str;
     std::string tmp;
     // Currently the enclave expects the ~EOF~ to be by itself (not in a batch).
@@ -827,34 +954,64 @@ int EnclaveNode::get_allele_data(char* batch_data, const int thread_id) {
         return -1;
     }
 
+    // Fill the batch by bytes, keep 1 byte of the enclave's buffer for the null terminator
+    const size_t budget = get_instance()->batch_budget;
+    if (budget >= batch_size) {
+        throw std::runtime_error("Batch budget larger than buffer");
+    }
+    batch_data_str.reserve(budget);
+
     int num_lines = 0;
-    moodycamel::ReaderWriterQueue<std::string>& allele_queue = get_instance()->allele_queue_list[thread_id];
-    while (num_lines < get_instance()->max_batch_lines && allele_queue.try_dequeue(tmp)) {
-        if (strcmp(EOFSeperator, tmp.c_str()) == 0) {
-            get_instance()->eof_read_list[thread_id] = true;
+    std::string& carry_line = get_instance()->carry_line_list[thread_id];
+    if (carry_line.length()) {
+        batch_data_str.swap(carry_line);
+        carry_line.clear();
+        num_lines++;
+    }
+    EnclaveNode* node = get_instance();
+    moodycamel::ConcurrentQueue<std::string>& allele_queue = node->allele_queue;
+    // sleep in the OCALL rather than have the enclave thread spin on empty batches
+    if (!num_lines) {
+        node->allele_queue_event.await([node, &allele_queue]() {
+            return allele_queue.size_approx() > 0 || node->matchers_finished == node->num_matchers;
+        });
+    }
+    // read before dequeuing, every line was enqueued before its matcher counted itself finished
+    const bool matching_done = node->matchers_finished == node->num_matchers;
+    while (batch_data_str.length() < budget && allele_queue.try_dequeue(tmp)) {
+        if (batch_data_str.length() + tmp.length() > budget) {
+            carry_line.swap(tmp);
             break;
         }
         num_lines++;
         batch_data_str += tmp;
     }
     if (num_lines) {
-        if (batch_data_str.length() > ENCLAVE_READ_BUFFER_SIZE) {
-            throw std::runtime_error("Batch larger than buffer");
-        }
-        memset(batch_data, 0, ENCLAVE_READ_BUFFER_SIZE);
         memcpy(batch_data, &batch_data_str[0], batch_data_str.length());
         batch_data[batch_data_str.length()] = '\0';
+        get_instance()->lines_consumed.fetch_add(num_lines, std::memory_order_relaxed);
+    } else if (matching_done) {
+        // nothing left and nothing more coming, the next call marks this thread's EOF
+        node->eof_read_list[thread_id] = true;
     }
     return num_lines;
 }
 
-void EnclaveNode::write_allele_data(char* output_data, const int buffer_size, const int thread_id) {
+void EnclaveNode::write_allele_data(char* output_data, const size_t buffer_size, const int thread_id) {
     std::unique_lock<std::mutex> lk(get_instance()->output_queue_lock);
-    get_instance()->output_queue.push(std::string(output_data));
+    get_instance()->output_queue.push(std::string(output_data, buffer_size));
     lk.unlock();
     get_instance()->output_queue_cv.notify_all();
 }
 
+void EnclaveNode::place_thread(const std::string& role, const int index) {
+    get_instance()->placement.pin_current(role, index);
+}
+
+void EnclaveNode::await_setup(const std::function<bool()>& check) {
+    get_instance()->setup_event.await(check);
+}
+
 void EnclaveNode::cleanup_output() {
     std::unique_lock<std::mutex> lk(get_instance()->output_queue_lock);
     terminating = true;
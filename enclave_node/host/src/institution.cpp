@@ -5,29 +5,42 @@
 
 #include "institution.h"
 
-Institution::Institution(std::string hostname, int port, int id, const int num_threads) 
-        : hostname(hostname), port(port), requested_for_data(false), listener_running(false), 
-          request_conn(-1), current_pos(0), all_data_received(false), id(id) {
-    aes_encrypted_key_list.resize(num_threads);
-    aes_encrypted_iv_list.resize(num_threads);
-    for (int i = 0; i < num_threads; ++i) {
-        aes_encrypted_key_list[i] = "";
-        aes_encrypted_iv_list[i] = "";
+Institution::Institution(std::string hostname, int port, int id, int num_partitions, int reorder_capacity,
+                         EventCount& batch_arrived) 
+        : reorder_window(new std::atomic<DataBlockBatch*>[reorder_capacity]), reorder_capacity(reorder_capacity), 
+          current_pos(0), blocks_outstanding(0), batch_arrived(batch_arrived), id(id), port(port), 
+          credit_granted(0), requested_for_data(false), listener_running(false), hostname(hostname) {
+    session_secret_encrypted = "";
+    for (int slot = 0; slot < reorder_capacity; ++slot) {
+        reorder_window[slot].store(nullptr, std::memory_order_relaxed);
+    }
+    for (int partition = 0; partition < num_partitions; ++partition) {
+        eligible_blocks_list.push_back(new moodycamel::ReaderWriterQueue<DataBlock*>());
     }
 }
 
 Institution::~Institution() {
-
+    for (moodycamel::ReaderWriterQueue<DataBlock*>* eligible_blocks : eligible_blocks_list) {
+        delete eligible_blocks;
+    }
 }
 
 void Institution::add_block_batch(DataBlockBatch* block_batch) {
-    // std::lock_guard<std::mutex> raii(blocks_lock);
-    // blocks.push(block_batch);
-    unsorted_blocks.enqueue(block_batch);
-}
-
-int Institution::get_blocks_size() {
-    return blocks.size();
+    const int pos = block_batch->pos;
+    if (pos < current_pos.load(std::memory_order_acquire)) {
+        throw std::runtime_error("Block batch " + std::to_string(pos) + " was already routed.");
+    }
+    // Its slot is still in use by an earlier batch. Waiting for the router here would park a
+    // reactor handler on another connection's batches, and credits keep an honest DPI in the window.
+    if (pos - current_pos.load(std::memory_order_acquire) >= reorder_capacity) {
+        throw std::runtime_error("Block batch " + std::to_string(pos) + " is past the reorder window.");
+    }
+    blocks_outstanding.fetch_add(block_batch->blocks_batch.size(), std::memory_order_relaxed);
+    DataBlockBatch* empty = nullptr;
+    if (!reorder_window[pos % reorder_capacity].compare_exchange_strong(empty, block_batch, std::memory_order_release)) {
+        throw std::runtime_error("Duplicate block batch " + std::to_string(pos) + " received.");
+    }
+    batch_arrived.notify_all();
 }
 
 int Institution::get_covariant_size() {
@@ -39,10 +52,9 @@ int Institution::get_id() {
     return id;
 }
 
-void Institution::set_key_and_iv(std::string aes_key, std::string aes_iv, const int thread_id) {
-    std::lock_guard<std::mutex> raii(aes_key_iv_lock);
-    aes_encrypted_key_list[thread_id] = decoder.decode(aes_key);
-    aes_encrypted_iv_list[thread_id] = decoder.decode(aes_iv);
+void Institution::set_session_secret(const std::string& session_secret) {
+    std::lock_guard<std::mutex> raii(session_secret_lock);
+    session_secret_encrypted = decoder.decode(session_secret);
 }
 
 void Institution::set_num_patients(const std::string& num_patients) {
@@ -50,30 +62,35 @@ void Institution::set_num_patients(const std::string& num_patients) {
     num_patients_encrypted = num_patients;
 }
 
-void Institution::set_y_data(std::string& y_data) {
-    std::lock_guard<std::mutex> raii(y_val_data_lock);
-    y_val_data = y_data;
-}
-
-void Institution::set_covariant_data(const std::string& covariant_name, const std::string& data) {
-    std::lock_guard<std::mutex> raii(covariant_data_lock);
-    if (covariant_data.count(covariant_name)) {
-        throw std::runtime_error("Duplicate covariant received.");
+void add_phenotype_chunk(PhenotypeChunks& phenotype, const int chunk_idx, 
+                         const int num_chunks, const std::string& chunk) {
+    if (!phenotype.chunks.size()) {
+        phenotype.chunks.resize(num_chunks);
+    }
+    if (num_chunks != static_cast<int>(phenotype.chunks.size()) || chunk_idx < 0 || chunk_idx >= num_chunks) {
+        throw std::runtime_error("Invalid phenotype chunk " + std::to_string(chunk_idx) + " of " + std::to_string(num_chunks));
     }
-    if (data.length() >= ENCLAVE_READ_BUFFER_SIZE) {
-        throw std::runtime_error("Covariant too large for enclave: " + std::to_string(data.length()));
+    if (phenotype.chunks[chunk_idx].length()) {
+        throw std::runtime_error("Duplicate phenotype chunk received.");
     }
-    covariant_data[covariant_name] = data;
+    phenotype.chunks[chunk_idx] = chunk;
+    phenotype.received++;
+}
+
+void Institution::add_y_chunk(const int chunk_idx, const int num_chunks, const std::string& chunk) {
+    std::lock_guard<std::mutex> raii(y_val_data_lock);
+    add_phenotype_chunk(y_val_data, chunk_idx, num_chunks, chunk);
 }
 
-std::string Institution::get_aes_key(const int thread_id) {
-    std::lock_guard<std::mutex> raii(aes_key_iv_lock);
-    return aes_encrypted_key_list[thread_id];
+void Institution::add_covariant_chunk(const std::string& covariant_name, const int chunk_idx, 
+                                      const int num_chunks, const std::string& chunk) {
+    std::lock_guard<std::mutex> raii(covariant_data_lock);
+    add_phenotype_chunk(covariant_data[covariant_name], chunk_idx, num_chunks, chunk);
 }
 
-std::string Institution::get_aes_iv(const int thread_id) {
-    std::lock_guard<std::mutex> raii(aes_key_iv_lock);
-    return aes_encrypted_iv_list[thread_id];
+std::string Institution::get_session_secret() {
+    std::lock_guard<std::mutex> raii(session_secret_lock);
+    return session_secret_encrypted;
 }
 
 std::string Institution::get_num_patients() {
@@ -81,62 +98,84 @@ std::string Institution::get_num_patients() {
     return num_patients_encrypted;
 }
 
-std::string Institution::get_y_data() {
+bool Institution::get_y_chunks(std::vector<std::string>& chunks) {
     std::lock_guard<std::mutex> raii(y_val_data_lock);
-    return y_val_data;
+    if (!y_val_data.received || y_val_data.received != y_val_data.chunks.size()) {
+        return false;
+    }
+    chunks = y_val_data.chunks;
+    return true;
 }
 
-std::string Institution::get_covariant_data(const std::string& covariant_name) {
+bool Institution::get_covariant_chunks(const std::string& covariant_name, std::vector<std::string>& chunks) {
     std::lock_guard<std::mutex> raii(covariant_data_lock);
     if (!covariant_data.count(covariant_name)) {
-        return "";
+        return false;
     }
-    std::string data = covariant_data[covariant_name];
-    return data;
-}
-
-void Institution::transfer_eligible_blocks() {
-    // std::lock_guard<std::mutex> raii(blocks_lock);
-    DataBlockBatch *unsorted_batch;
-    while (unsorted_blocks.try_dequeue(unsorted_batch)) {
-        blocks.push(unsorted_batch);
+    const PhenotypeChunks& covariant = covariant_data[covariant_name];
+    if (covariant.received != covariant.chunks.size()) {
+        return false;
     }
-    while (!blocks.empty()) {
-        DataBlockBatch* batch = blocks.top();
-        if (batch->pos != current_pos) {
-            return;
+    chunks = covariant.chunks;
+    return true;
+}
+
+bool Institution::transfer_eligible_blocks() {
+    bool transferred = false;
+    int pos = current_pos.load(std::memory_order_relaxed);
+    while (true) {
+        std::atomic<DataBlockBatch*>& slot = reorder_window[pos % reorder_capacity];
+        DataBlockBatch* batch = slot.load(std::memory_order_acquire);
+        if (!batch) {
+            break;
         }
-        blocks.pop();
+        slot.store(nullptr, std::memory_order_relaxed);
 
-        // std::lock_guard<std::mutex> raii2(eligible_blocks_lock);
         for (DataBlock* parsed_block : batch->blocks_batch) {
-            eligible_blocks.enqueue(parsed_block);
+            if (parsed_block->key == VARIANT_KEY_EOF) {
+                // every partition needs to see the end of this institution's data
+                for (moodycamel::ReaderWriterQueue<DataBlock*>* eligible_blocks : eligible_blocks_list) {
+                    eligible_blocks->enqueue(SlabPool<DataBlock>::instance().create(*parsed_block));
+                }
+                SlabPool<DataBlock>::instance().destroy(parsed_block);
+                continue;
+            }
+            const int partition = variant_key_chrom(parsed_block->key) % eligible_blocks_list.size();
+            eligible_blocks_list[partition]->enqueue(parsed_block);
         }
         // Clean up block batch!
-        delete batch;
-        current_pos++;
+        SlabPool<DataBlockBatch>::instance().destroy(batch);
+        // frees the slot for the batch a full window ahead
+        current_pos.store(++pos, std::memory_order_release);
+        transferred = true;
+    }
+    if (transferred) {
+        routed.notify_all();
     }
+    return transferred;
 }
 
-DataBlock* Institution::get_top_block() {
-    //std::lock_guard<std::mutex> raii(eligible_blocks_lock);
-    // DataBlock *ret;
-    // bool success = eligible_blocks.try_dequeue(ret);
-    // if (!success) {
-    //     return nullptr;
-    // }
-    // return ret;
-    // if (eligible_blocks.empty()) return nullptr;
-    // return eligible_blocks.front();
-    DataBlock **ret = eligible_blocks.peek();
+bool Institution::has_eligible_batch() {
+    return reorder_window[current_pos.load(std::memory_order_relaxed) % reorder_capacity].load(std::memory_order_acquire) != nullptr;
+}
+
+DataBlock* Institution::get_top_block(const int partition) {
+    DataBlock **ret = eligible_blocks_list[partition]->peek();
     if (!ret) return nullptr;
     return *ret;
 }
 
-DataBlock* Institution::pop_top_block() {
-    //std::lock_guard<std::mutex> raii(eligible_blocks_lock);
-    // eligible_blocks.pop();
+DataBlock* Institution::pop_top_block(const int partition) {
     DataBlock *ret;
-    eligible_blocks.try_dequeue(ret);
+    eligible_blocks_list[partition]->try_dequeue(ret);
+    blocks_outstanding.fetch_sub(1, std::memory_order_relaxed);
     return ret;
-}
\ No newline at end of file
+}
+
+int Institution::get_routed_pos() {
+    return current_pos.load(std::memory_order_relaxed);
+}
+
+int64_t Institution::get_blocks_outstanding() {
+    return blocks_outstanding.load(std::memory_order_relaxed);
+}
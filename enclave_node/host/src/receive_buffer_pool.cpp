@@ -0,0 +1,25 @@
+/*
+ * Implementation of the receive buffer pool.
+ */
+
+#include "receive_buffer_pool.h"
+
+ReceiveBufferPool::~ReceiveBufferPool() {
+    char* buffer;
+    while (free_buffers.try_dequeue(buffer)) {
+        delete[] buffer;
+    }
+}
+
+std::shared_ptr<char> ReceiveBufferPool::acquire(size_t size) {
+    if (size > RECEIVE_BUFFER_SIZE) {
+        return std::shared_ptr<char>(new char[size], std::default_delete<char[]>());
+    }
+    char* buffer;
+    if (!free_buffers.try_dequeue(buffer)) {
+        buffer = new char[RECEIVE_BUFFER_SIZE];
+    }
+    return std::shared_ptr<char>(buffer, [this](char* released) {
+        free_buffers.enqueue(released);
+    });
+}
@@ -8,22 +8,33 @@
 #include <cryptopp/osrng.h>
 #include <cryptopp/base64.h>
 #include <cryptopp/rsa.h>
+#include <cryptopp/sha.h>
+#include <cryptopp/hkdf.h>
 
 #include <iostream>
 #include <string>
+#include <vector>
+
+#include "buffer_size.h"
 
 class AESCrypto {
     public:
         AESCrypto();
 
+        // Replace the random key and IV, used for keys derived from a session secret
+        void set_key_and_iv(const byte* new_key, const byte* new_iv);
+
         std::string encrypt_line(const byte* line, int line_size);
 
+        // Encrypts a genotype line under a fresh random IV and returns IV || ciphertext.
+        // Since every line carries its own IV, any enclave thread that holds this stream's
+        // key can decrypt it, in any order.
+        std::string encrypt_line_with_iv(const byte* line, int line_size);
+
         std::string encode(const byte* data, int data_size);
 
         std::string decode(const std::string& encoded_data);
 
-        std::string get_key_and_iv(CryptoPP::RSAES<CryptoPP::OAEP<CryptoPP::SHA256> >::Encryptor& rsa_encryptor);
-
         //std::string rsa_encrypt(std::string& input, CryptoPP::RSAES<CryptoPP::OAEP<CryptoPP::SHA256> >::Encryptor& rsa_encryptor);
 
     private:
@@ -31,7 +42,26 @@ class AESCrypto {
         CryptoPP::SecByteBlock key;
         CryptoPP::SecByteBlock iv;
         CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption encryptor;
+        // Separate cipher for per-line IVs so the chained IV used for setup data is untouched
+        CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption line_encryptor;
 };
 
 
+// One random secret per enclave node. Only the secret is RSA wrapped and sent, the key and
+// IV of every stream are derived from it with HKDF on both ends.
+class SessionSecret {
+    public:
+        SessionSecret();
+
+        // Rekey aes_list[i] with the key and IV derived for stream i
+        void derive_stream_encryptors(std::vector<AESCrypto>& aes_list);
+
+        // RSA-OAEP wrapped secret, base64 encoded
+        std::string wrap(CryptoPP::RSAES<CryptoPP::OAEP<CryptoPP::SHA256> >::Encryptor& rsa_encryptor);
+
+    private:
+        CryptoPP::AutoSeededRandomPool prng;
+        CryptoPP::SecByteBlock secret;
+};
+
 #endif
\ No newline at end of file
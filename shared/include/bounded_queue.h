@@ -0,0 +1,65 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/*
+A FIFO between two pipeline stages holding at most capacity items. push blocks while it
+is full, so a fast producer waits for a slow consumer instead of buffering everything.
+The producer calls close once it is done, pop then drains what is left and returns false.
+
+Host side only.
+*/
+
+template <typename T>
+class BoundedQueue {
+  private:
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+  public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    void push(T item) {
+        {
+            std::unique_lock<std::mutex> raii(lock);
+            not_full.wait(raii, [this]() { return items.size() < capacity; });
+            items.push_back(std::move(item));
+        }
+        not_empty.notify_one();
+    }
+
+    // false once the queue is closed and empty
+    bool pop(T& item) {
+        {
+            std::unique_lock<std::mutex> raii(lock);
+            not_empty.wait(raii, [this]() { return !items.empty() || closed; });
+            if (items.empty()) {
+                return false;
+            }
+            item = std::move(items.front());
+            items.pop_front();
+        }
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> raii(lock);
+            closed = true;
+        }
+        not_empty.notify_all();
+    }
+};
+
+#endif
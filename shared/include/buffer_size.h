@@ -6,16 +6,26 @@ Only modify the buffer size header file in the shared directory!
 The Makefile will copy that header to another location for the build process.
 */
 
-#define ENCLAVE_READ_BUFFER 2000    // in KB
+#define ENCLAVE_READ_BUFFER 2000    // in KB, batch budget when the enclave heap size is unknown
 #define ENCLAVE_SMALL_BUFFER 10 // in KB
 #define MAX_DPINAME_LENGTH 30
 #define AES_KEY_LENGTH 16 // 128 bit enc
 #define AES_IV_LENGTH 16 // 128 bit enc
+#define SESSION_SECRET_LENGTH 32 // RSA wrapped secret that all AES stream keys are derived from
+
+// HKDF-SHA256 labels, the DPI and the enclave must agree on these
+#define SESSION_KEY_SALT "SECRET-GWAS"
+#define SESSION_KEY_STREAM_INFO "SECRET-GWAS stream "
 
 #define ENCLAVE_READ_BUFFER_SIZE ENCLAVE_READ_BUFFER * 1024  // in B
 
 #define ENCLAVE_SMALL_BUFFER_SIZE ENCLAVE_SMALL_BUFFER * 1024
 
+/* Runtime batch sizing, see setup_enclave_phenotypes */
+#define ENCLAVE_PAGE_SIZE 4096
+#define MAX_BATCH_BUDGET (16 * 1024 * 1024) // bytes of ciphertext per batch, OCALL copies grow with it
+#define RESULT_RECORD_SIZE 48 // binary result of one variant, see result_record.h
+
 #define RSA_PUB_KEY_SIZE 512
 
 #define MAX_EVIDENCE_SIZE 20000 // Picked based on vibes - I have no idea how big the evidence can be!
@@ -24,9 +34,14 @@ The Makefile will copy that header to another location for the build process.
 
 #define MAX_LOCI_ALLELE_STR_SIZE 28
 
+#define PRESENCE_BITMAP_BYTES(num_dpis) (((num_dpis) + 7) / 8) // one bit per dpi in front of each matched line
+
+#define PHENOTYPE_CHUNK_VALUES 65536 // little-endian doubles per encrypted phenotype/covariant chunk (512 KB)
+
 #define EOFSeperator "~EOF~" // mark end of dataset
 
-enum EncAnalysis { linear_dummy, linear, logistic, linear_oblivious, logistic_oblivious };
+// null_kernel only checksums the genotypes, it measures the pipeline without any regression
+enum EncAnalysis { linear_dummy, linear, logistic, linear_oblivious, logistic_oblivious, null_kernel };
 enum ImputePolicy { EPACTS, Hail };
 
 #endif
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <stdint.h>
 
 enum DPIMessageType {
   DPI_INFO,
@@ -11,6 +13,7 @@ enum DPIMessageType {
   RSA_PUB_KEY,
   Y_AND_COV,
   DATA_REQUEST,
+  DATA_CREDIT,
   DPI_SYNC,
   END_DPI
 };
@@ -24,6 +27,8 @@ enum EnclaveNodeMessageType {
   Y_VAL,
   DATA,
   EOF_DATA,
+  // sent instead of EOF_DATA when a DPI can't send all of its data, the run fails
+  DATA_ERROR,
   END_ENCLAVE
 };
 
@@ -31,18 +36,46 @@ enum CoordinationServerMessageType {
   ENCLAVE_REGISTER,
   DPI_REGISTER,
   OUTPUT,
-  EOF_OUTPUT
+  EOF_OUTPUT,
+  // an enclave node can't produce its output, every component is stopped
+  RUN_FAILED
 };
 
+#define FRAME_MAGIC 0x53475753 // "SGWS" on the wire
+#define FRAME_VERSION 1
+#define FRAME_SENDER_SIZE 32
+// carries no message, hands the receiver a ShmRing the following frames arrive through
+#define FRAME_FLAG_SHM_ATTACH 0x1
+
+// Every message is this header followed by payload_length bytes of payload. All machines
+// involved are x86, so fields are little-endian. See send_frame and Reactor.
+struct FrameHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t mtype;  // DPIMessageType, EnclaveNodeMessageType or CoordinationServerMessageType
+  uint32_t payload_length;
+  uint32_t flags;  // FRAME_FLAG_*, 0 for an ordinary message
+  // DPI name, enclave node global id or "-1rs" for the coordination server, NUL padded
+  char sender[FRAME_SENDER_SIZE];
+};
+
+static_assert(sizeof(FrameHeader) == 48, "FrameHeader layout changed, every component has to agree on it");
+
 struct ConnectionInfo {
   std::string hostname;
   unsigned int port;
   unsigned int num_threads; // only for enclave node
 };
 
+// One locus of a DATA message. locus and data point into the buffer the message was
+// received into, which the block keeps alive until it is deleted.
 struct DataBlock {
-  std::string locus;
-  std::string data;
+  std::shared_ptr<const char> buffer;
+  const char* locus; // chrom:pos\talleles
+  uint32_t locus_length;
+  const char* data;  // IV||cipher||'\n'
+  uint32_t data_length;
+  uint64_t key; // pack_variant_key of locus, what the enclave node merges on
 };
 
 struct DataBlockBatch {
@@ -0,0 +1,76 @@
+#ifndef EVENT_COUNT_H
+#define EVENT_COUNT_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <atomic>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+Wait for a condition on shared state without spinning and without a mutex around
+that state. A producer changes the state and then calls notify_all. A consumer calls
+await with a predicate over the state and sleeps on a futex until a notify makes the
+predicate true. notify_all is an atomic add plus a load when nobody waits, so it is
+cheap enough to call on every enqueue.
+
+Host side only, the enclave can't make the futex syscall.
+*/
+
+// Every time a waiter wakes up and finds its condition still false. Stays near zero
+// unless a notify is sent for state that does not concern the waiter.
+inline std::atomic<uint64_t>& event_count_spins() {
+    static std::atomic<uint64_t> spins(0);
+    return spins;
+}
+
+class EventCount {
+  private:
+    std::atomic<uint32_t> epoch;
+    std::atomic<uint32_t> waiters;
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int), "futex needs a plain 32 bit word");
+
+    int* futex_word() {
+        return reinterpret_cast<int*>(&epoch);
+    }
+
+  public:
+    EventCount() : epoch(0), waiters(0) {}
+    EventCount(const EventCount&) = delete;
+    EventCount& operator=(const EventCount&) = delete;
+
+    void notify_all() {
+        // the seq_cst pair of epoch here and waiters in await makes sure either the waiter
+        // sees the new epoch or we see the waiter
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_seq_cst)) {
+            syscall(SYS_futex, futex_word(), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    template <typename Condition>
+    void await(Condition condition) {
+        if (condition()) {
+            return;
+        }
+        while (true) {
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            const uint32_t key = epoch.load(std::memory_order_seq_cst);
+            if (condition()) {
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            // returns straight away if a notify already moved the epoch past key
+            syscall(SYS_futex, futex_word(), FUTEX_WAIT_PRIVATE, static_cast<int>(key), nullptr, nullptr, 0);
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+            if (condition()) {
+                return;
+            }
+            event_count_spins().fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef GENOTYPE_TOKENIZER_H
+#define GENOTYPE_TOKENIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdexcept>
+#include <string>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+/*
+Packs the genotype columns of an allele line, tab separated "0", "1", "2" or "NA", straight
+into the 2-bit values the enclave unpacks: four to a byte, the first in the low bits, NA
+as 3. Runs of one-digit genotypes are checked and packed 32 bytes (16 genotypes) at a
+time with AVX2 if the CPU has it. An NA, the end of the line or anything that doesn't
+fit is handled one token at a time, which is also where errors are reported.
+
+Host side only, the enclave can't ask the CPU what it supports.
+*/
+
+namespace genotype_tokenizer {
+
+[[noreturn]] inline void fail(const std::string& what, size_t column) {
+    throw std::runtime_error("Invalid alleles file! " + what + " at byte " + std::to_string(column) + " of the line");
+}
+
+inline void put(uint8_t* packed, size_t index, uint8_t value) {
+    if (index % 4 == 0) {
+        packed[index / 4] = value;
+    } else {
+        packed[index / 4] |= value << (2 * (index % 4));
+    }
+}
+
+#ifdef __x86_64__
+// Pack whole 32 byte blocks of "d\t" pairs, at most max_blocks of them, stopping at the
+// first block that holds anything else. Returns the number of blocks packed.
+__attribute__((target("avx2")))
+inline size_t pack_blocks_avx2(const char* text, size_t length, uint8_t* packed, size_t max_blocks) {
+    const __m256i zero_char = _mm256_set1_epi8('0');
+    const __m256i two = _mm256_set1_epi8(2);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    // genotypes sit in the even bytes, their tabs in the odd ones
+    const __m256i odd = _mm256_set1_epi16(static_cast<short>(0xff00));
+    // byte 0 and 8 of each 128 bit half
+    const __m256i gather = _mm256_setr_epi8(0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t blocks = 0;
+    while (blocks < max_blocks && 32 * (blocks + 1) <= length) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + 32 * blocks));
+        const __m256i values = _mm256_sub_epi8(bytes, zero_char);
+        // '0' to '2' wrap to 0..2, everything else to more than 2
+        const __m256i is_value = _mm256_cmpeq_epi8(_mm256_min_epu8(values, two), values);
+        const __m256i is_tab = _mm256_cmpeq_epi8(bytes, tab);
+        if (_mm256_movemask_epi8(_mm256_blendv_epi8(is_value, is_tab, odd)) != -1) {
+            break;
+        }
+        // one genotype per 16 bit lane, then pairs per 32 bit lane, then four in the low
+        // byte of each 64 bit lane, what is above that byte is ignored
+        __m256i lanes = _mm256_andnot_si256(odd, values);
+        lanes = _mm256_or_si256(lanes, _mm256_srli_epi32(lanes, 14));
+        lanes = _mm256_or_si256(lanes, _mm256_srli_epi64(lanes, 28));
+        const __m256i gathered = _mm256_shuffle_epi8(lanes, gather);
+        const uint32_t word = static_cast<uint16_t>(_mm256_extract_epi16(gathered, 0)) |
+                              static_cast<uint32_t>(static_cast<uint16_t>(_mm256_extract_epi16(gathered, 8))) << 16;
+        memcpy(packed + 4 * blocks, &word, sizeof(word));
+        ++blocks;
+    }
+    return blocks;
+}
+#endif
+
+/**
+ * Pack the genotypes in line[start, end) into packed, which has room for count of them.
+ * Throws naming the first byte that doesn't fit, or if there are more or fewer than count.
+ */
+inline void pack(const char* line, size_t start, size_t end, uint8_t* packed, size_t count) {
+#ifdef __x86_64__
+    static const bool use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    size_t pos = start;
+    size_t index = 0;
+    if (pos == end) {
+        fail("No genotypes", pos);
+    }
+    while (true) {
+#ifdef __x86_64__
+        // blocks fill whole bytes, so they only start on a multiple of four genotypes
+        if (use_avx2 && index % 4 == 0) {
+            const size_t blocks = pack_blocks_avx2(line + pos, end - pos, packed + index / 4, (count - index) / 16);
+            pos += 32 * blocks;
+            index += 16 * blocks;
+        }
+#endif
+        if (pos == end) {
+            fail("Missing genotype after a tab", pos);
+        }
+        if (index == count) {
+            fail("More genotypes than patients", pos);
+        }
+        uint8_t value;
+        if (line[pos] >= '0' && line[pos] <= '2') {
+            value = line[pos] - '0';
+            pos += 1;
+        } else if (line[pos] == 'N' && pos + 1 < end && line[pos + 1] == 'A') {
+            value = 3;
+            pos += 2;
+        } else {
+            fail("Unexpected genotype '" + std::string(1, line[pos]) + "'", pos + (line[pos] == 'N' ? 1 : 0));
+        }
+        put(packed, index++, value);
+        if (pos == end) {
+            break;
+        }
+        if (line[pos] != '\t') {
+            fail("Expected a tab", pos);
+        }
+        ++pos;
+    }
+    if (index != count) {
+        fail("Fewer genotypes than patients (" + std::to_string(index) + " of " + std::to_string(count) + ")", end);
+    }
+}
+
+}
+
+#endif
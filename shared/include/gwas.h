@@ -4,12 +4,26 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <stdint.h>
 #include "buffer_size.h"
 #include "gwas_error.h"
 //#include "parser.h"
 
 
 #define LOCI_X 23
+#define VARIANT_KEY_EOF UINT64_MAX // sorts after every real variant
+
+// chrom << 48 | pos << 16 | allele 1 << 8 | allele 2, so ordering by key orders by locus
+inline uint64_t pack_variant_key(int chrom, uint32_t pos, char a1, char a2) {
+    return (static_cast<uint64_t>(chrom & 0xFFFF) << 48) |
+           (static_cast<uint64_t>(pos) << 16) |
+           (static_cast<uint64_t>(static_cast<uint8_t>(a1)) << 8) |
+           static_cast<uint64_t>(static_cast<uint8_t>(a2));
+}
+
+inline int variant_key_chrom(uint64_t key) {
+    return static_cast<int>(key >> 48);
+}
 
 enum Regression_T { Logistic, Linear };
 enum ALLELE : char { A = 'A', T = 'T', C = 'C', G = 'G', NaN = 'N' };
@@ -18,9 +18,6 @@
 #include "communication.h"
 
 class Parser {
-  private:
-    static void two_bit_compress(uint8_t* input, uint8_t* compressed, unsigned int size);
-
   public:
     Parser(/* args */);
     ~Parser();
@@ -36,14 +33,15 @@ class Parser {
 
     static int parse_nth_int(const std::string& str, const int n, const char delim='\t');
 
-    // parse message body into the relevant arguments we need
-    static void parse_data_body(std::vector<DataBlock*>& blocks, const std::string& message_body, AESCrypto& decoder);
-
     static int parse_hash(const std::string& line, const int encryptor_list_size);
 
-    // Returns the enclave node we should send this allele to
+    // pack "chrom:pos\talleles" into a variant key, throws on a malformed locus
+    static uint64_t parse_variant_key(const char* locus, const size_t length);
+
+    // Replace line with its locus and alleles followed by the encrypted, 2-bit packed genotypes.
+    // compressed_vals has room for num_patients genotypes, throws on a malformed line.
     static void parse_allele_line(std::string& line, 
-                                  std::vector<uint8_t>& vals, 
+                                  const int num_patients, 
                                   std::vector<uint8_t>& compressed_vals, 
                                   std::vector<std::vector<AESCrypto> >& encryptor_list, 
                                   const int enclave_node_hash);
@@ -0,0 +1,46 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+/*
+Per-thread enclave counters. The enclave and the host both include this header,
+the host reads the blocks straight out of the exportcounters OCALL buffer, so
+keep the layout plain (no pointers, fixed width fields).
+*/
+
+#define PERF_CACHE_LINE 64
+#define PERF_ITERATION_BUCKETS 16 // newton iterations 0..14, the last bucket is 15 or more
+#define PERF_TICK_MILLISECONDS 1 // how often the host ticker publishes a new time
+
+// where a worker spends its time, in the order a batch moves through them
+enum PerfStage { PERF_FETCH, PERF_DECRYPT, PERF_PARSE, PERF_FIT, PERF_FORMAT, PERF_OUTPUT, NUM_PERF_STAGES };
+
+// what was written for a row, math_error rows are output as NA
+enum PerfOutcome { PERF_FITTED, PERF_MATH_ERROR, NUM_PERF_OUTCOMES };
+
+static const char* const PERF_STAGE_NAMES[NUM_PERF_STAGES] = {
+    "fetch", "decrypt", "parse", "fit", "format", "output"
+};
+
+static const char* const PERF_OUTCOME_NAMES[NUM_PERF_OUTCOMES] = {
+    "fitted", "math_error"
+};
+
+// One block per enclave thread, written only by that thread. Aligned to a cache
+// line so neighbouring threads never invalidate each other's counters.
+struct alignas(PERF_CACHE_LINE) PerfCounters {
+    int32_t thread_id;
+    int32_t finished;  // set once the thread has left its regression loop
+    uint64_t batches;
+    uint64_t rows;
+    uint64_t bytes_decrypted;
+    uint64_t outcomes[NUM_PERF_OUTCOMES];
+    // logistic kernels only, convergence failures are still fitted rows
+    uint64_t newton_iterations[PERF_ITERATION_BUCKETS];
+    uint64_t convergence_failures;
+    // nanoseconds of host ticks, see setup_perf_counters
+    uint64_t stage_ticks[NUM_PERF_STAGES];
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Header file for the epoll reactor every component serves its listening port with.
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "json.hpp"
+#include "communication.h"
+#include "shm_ring.h"
+
+/*
+Config format, every key is optional:
+    "reactor": {
+        "io_threads": 2,
+        "handler_threads": 8,
+        "max_queued_messages": 64
+    }
+Connections are spread round robin over the I/O threads. Each I/O thread owns an epoll set
+and reads its connections edge triggered without ever blocking: the FrameHeader in one recv,
+then the payload straight into its buffer. Complete messages go to a fixed pool of handler
+threads. The messages of one connection are handled one at a time and in the order they
+arrived, different connections are handled in parallel. Once max_queued_messages of a connection are waiting for a handler
+the reactor stops reading it, so a slow handler pushes back on its sender through TCP.
+
+Next to its TCP port every reactor listens on a Unix socket named after the port (see
+local_socket_path), co-located senders connect there instead, or use TCP if another user's
+process holds the socket. A reactor closes Unix connections from other users. A sender may
+hand over a ShmRing on such a connection, its frames then come through the ring and are
+treated exactly like frames read off the socket. The socket stays open to tell either side the other left.
+
+Handlers must not block on a message that has to come in over another connection, every
+handler thread could end up waiting. Long running work (a whole DATA stream) belongs on a
+thread of its own.
+*/
+
+class Reactor {
+  public:
+    // payload holds header.payload_length bytes, it is null for an empty payload. Returning
+    // false closes the connection, messages it still had queued are dropped.
+    typedef std::function<bool(int connFD, const FrameHeader& header, const std::shared_ptr<char>& payload)> Handler;
+    // where payloads are read into, defaults to a new buffer of exactly payload_length
+    typedef std::function<std::shared_ptr<char>(size_t payload_length)> Allocator;
+
+  private:
+    struct Message {
+        FrameHeader header;
+        std::shared_ptr<char> payload;
+    };
+
+    class IoThread;
+
+    struct Connection {
+        int fd;
+        IoThread* owner;
+
+        // read state, only touched by the owning I/O thread
+        FrameHeader header;
+        size_t header_read;
+        bool reading_payload;
+        std::shared_ptr<char> payload;
+        size_t payload_read;
+        // fds passed along with the header being read
+        std::vector<int> passed_fds;
+        std::unique_ptr<ShmRing> ring;
+
+        // everything below is guarded by lock
+        std::mutex lock;
+        std::deque<Message> pending;
+        // a handler thread owns the connection's messages
+        bool scheduled;
+        // pending is full, the I/O thread stopped reading
+        bool paused;
+        bool peer_closed;
+        bool close_requested;
+        bool finalized;
+
+        Connection(int fd, IoThread* owner);
+    };
+
+    class IoThread {
+      private:
+        Reactor* reactor;
+        int epoll_fd;
+        int wake_fd;
+        // connections handed over by the acceptor or the handler threads
+        std::mutex posted_lock;
+        std::vector<std::shared_ptr<Connection> > posted;
+        std::unordered_map<int, std::shared_ptr<Connection> > connections;
+        std::thread thread;
+
+        void loop();
+        void service(const std::shared_ptr<Connection>& conn);
+        ssize_t receive_header(const std::shared_ptr<Connection>& conn, char* target, size_t wanted);
+        void read_connection(const std::shared_ptr<Connection>& conn);
+        void read_ring(const std::shared_ptr<Connection>& conn);
+        bool attach_ring(const std::shared_ptr<Connection>& conn);
+        void deliver(const std::shared_ptr<Connection>& conn, Message message);
+        void finalize(const std::shared_ptr<Connection>& conn);
+
+      public:
+        explicit IoThread(Reactor* reactor);
+        ~IoThread();
+
+        void start();
+        // run conn on this thread, adopting it first if it is new
+        void post(const std::shared_ptr<Connection>& conn);
+    };
+
+    Handler handler;
+    Allocator allocator;
+    int num_io_threads;
+    int num_handler_threads;
+    size_t max_queued_messages;
+
+    std::vector<int> listen_fds;
+    std::vector<std::unique_ptr<IoThread> > io_threads;
+
+    std::mutex ready_lock;
+    std::condition_variable ready_condition;
+    std::deque<std::shared_ptr<Connection> > ready;
+
+    void schedule(const std::shared_ptr<Connection>& conn);
+    void handler_loop();
+    void handle_ready(const std::shared_ptr<Connection>& conn);
+
+  public:
+    // reads "reactor" out of config, throws on a count below one
+    Reactor(const nlohmann::json& config, Handler handler, Allocator allocator=Allocator());
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    // bind and listen on port, 0 lets the OS pick, and on its local_socket_path. Returns the
+    // bound port, throws on failure.
+    unsigned int listen(unsigned int port);
+
+    // also listen on the Unix socket at path, for a "unix:" or "shm:" endpoint naming one
+    void listen_local(const std::string& path);
+
+    // start the I/O and handler threads, then accept connections on the calling thread forever
+    void run();
+};
+
+#endif /* _REACTOR_H_ */
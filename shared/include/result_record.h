@@ -0,0 +1,80 @@
+#ifndef RESULT_RECORD_H
+#define RESULT_RECORD_H
+
+#include <stdint.h>
+#include <cmath>
+#include <string>
+#include "buffer_size.h"
+#include "gwas.h"
+
+/*
+One variant's result as the enclave writes it. Records go through the enclave node
+host untouched and are only turned into text by the coordination server when it
+writes the output file. All machines involved are x86, so fields are little-endian.
+*/
+
+enum ResultFlag : uint16_t {
+    RESULT_NA = 1 << 0,          // kernel could not fit the row, beta/se/t are NA
+    RESULT_MATH_ERROR = 1 << 1,  // fit threw a MathError
+    RESULT_LOGISTIC = 1 << 2,    // iterations and convergence are part of the output
+    RESULT_CONVERGED = 1 << 3,
+    RESULT_HAS_P = 1 << 4,
+    RESULT_CHECKSUM = 1 << 5     // null kernel, only the genotype checksum is output
+};
+
+struct ResultRecord {
+    // see pack_variant_key
+    uint64_t variant_key;
+    double beta;
+    double standard_error;
+    double t_stat;
+    double p_value;
+    uint16_t iterations;
+    uint16_t flags;
+    uint32_t checksum;  // null kernel only
+};
+
+static_assert(sizeof(ResultRecord) == RESULT_RECORD_SIZE, "ResultRecord layout changed, update RESULT_RECORD_SIZE");
+
+inline uint64_t result_variant_key(const Loci &loci, const Alleles &alleles) {
+    return pack_variant_key(loci.chrom, static_cast<uint32_t>(loci.loc), alleles.a1, alleles.a2);
+}
+
+inline void result_record_to_str(const ResultRecord &record, std::string& output_string) {
+    Loci loci;
+    Alleles alleles;
+    loci.chrom = variant_key_chrom(record.variant_key);
+    loci.loc = static_cast<int>((record.variant_key >> 16) & 0xFFFFFFFF);
+    alleles.a1 = static_cast<ALLELE>((record.variant_key >> 8) & 0xFF);
+    alleles.a2 = static_cast<ALLELE>(record.variant_key & 0xFF);
+
+    std::string alleles_string;
+    loci_to_str(loci, output_string);
+    alleles_to_str(alleles, alleles_string);
+    output_string += "\t" + alleles_string;
+
+    if (record.flags & RESULT_CHECKSUM) {
+        output_string += "\t" + std::to_string(record.checksum);
+        return;
+    }
+    if (record.flags & RESULT_MATH_ERROR) {
+        output_string += "\tNA\tNA\tNA\t1\tfalse";
+        return;
+    }
+    if (record.flags & RESULT_NA) {
+        output_string += "\tNA\tNA\tNA";
+    } else {
+        output_string += "\t" + std::to_string(record.beta) +
+                         "\t" + std::to_string(record.standard_error) +
+                         "\t" + std::to_string(record.t_stat);
+    }
+    if (record.flags & RESULT_HAS_P) {
+        output_string += "\t" + std::to_string(record.p_value);
+    }
+    if (record.flags & RESULT_LOGISTIC) {
+        output_string += "\t" + std::to_string(record.iterations) + "\t";
+        output_string += (record.flags & RESULT_CONVERGED) ? "true" : "false";
+    }
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Header file for the shared memory ring frames are streamed through between co-located components.
+ */
+
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "communication.h"
+
+/*
+A single producer, single consumer byte ring in a memfd, holding whole frames (FrameHeader
+then payload) back to back. The producer creates it and hands the memfd and an eventfd to
+the receiving reactor over a Unix socket (see ConnectionPool). Frames are published whole,
+so the consumer never sees part of one.
+
+The consumer sleeps in epoll on the eventfd, the producer only writes it when the consumer
+said it is about to sleep. A producer facing a full ring waits on a futex in the ring.
+*/
+
+// one frame of any size always fits, see MAX_MESSAGE_SIZE
+#define SHM_RING_CAPACITY (1 << 23)
+
+struct ShmRingControl {
+    std::atomic<uint64_t> head;  // bytes published, only the producer moves it
+    char head_pad[56];
+    std::atomic<uint64_t> tail;  // bytes consumed, only the consumer moves it
+    char tail_pad[56];
+    std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+    // futex word, bumped by the consumer when it frees space for a waiting producer
+    std::atomic<uint32_t> space_epoch;
+    uint32_t capacity;
+};
+
+class ShmRing {
+  private:
+    int memfd;
+    int notify_fd;
+    void* mapping;
+    size_t mapping_size;
+    ShmRingControl* control;
+    char* data;
+    uint32_t capacity;
+
+    ShmRing(int memfd, int notify_fd);
+
+    void copy_in(uint64_t pos, const char* source, size_t length);
+    void copy_out(uint64_t pos, char* target, size_t length) const;
+    // throws if the control block doesn't add up
+    uint64_t filled() const;
+
+  public:
+    ~ShmRing();
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+    // producer side, throws if the memfd or eventfd can't be set up
+    static std::unique_ptr<ShmRing> create();
+    // consumer side, takes ownership of both fds. Throws unless memfd is a sealed ring of the right size.
+    static std::unique_ptr<ShmRing> attach(int memfd, int notify_fd);
+
+    int get_memfd() const { return memfd; }
+    int get_notify_fd() const { return notify_fd; }
+
+    // Producer: publish one frame, waiting while the ring is full. check_peer is called
+    // every few milliseconds while waiting and may throw to give up.
+    void write(const FrameHeader& header, const struct iovec* payload, int payload_count,
+               const std::function<void()>& check_peer);
+
+    // Consumer: copy the next frame's header out, false if there is none.
+    bool peek(FrameHeader& header) const;
+    // Consumer: copy the payload of the frame peek returned into target and release it.
+    // Throws if the payload is larger than target_size or than what the ring holds.
+    void consume(const FrameHeader& header, char* target, size_t target_size);
+    // Consumer: about to sleep on the eventfd. False if a frame arrived meanwhile, keep reading.
+    bool arm();
+    bool empty() const;
+};
+
+#endif /* _SHM_RING_H_ */
@@ -0,0 +1,144 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "concurrentqueue.h"
+
+/*
+Typed object pools for the structures the pipeline creates once per variant
+(DataBlock and DataBlockBatch on the enclave node host).
+Objects are carved out of slabs that are never handed back to malloc, and freed
+objects are kept in a per-thread cache. A thread that frees more than it creates
+(the matcher freeing what the data listeners created) spills half its cache into a
+shared free list that the creating threads refill from, a batch at a time.
+*/
+
+#define SLAB_POOL_OBJECTS_PER_SLAB 1024
+#define SLAB_POOL_THREAD_CACHE 256 // spill half the cache once it holds this many
+
+// only bumped on the slow paths, so reading them costs the fast path nothing
+struct SlabPoolStats {
+    uint64_t slabs;
+    uint64_t objects;  // objects carved out of those slabs, in use or free
+    uint64_t refills;  // thread cache refilled from the shared free list
+    uint64_t spills;   // thread cache spilled into the shared free list
+};
+
+template <typename T>
+class SlabPool {
+  private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+    struct ThreadCache {
+        SlabPool* pool;
+        std::vector<T*> free_objects;
+
+        explicit ThreadCache(SlabPool* pool) : pool(pool) {
+            free_objects.reserve(SLAB_POOL_THREAD_CACHE);
+        }
+        // whatever a finished thread held is still usable by the others
+        ~ThreadCache() {
+            if (free_objects.size()) {
+                pool->free_list.enqueue_bulk(free_objects.data(), free_objects.size());
+            }
+        }
+    };
+
+    std::mutex slabs_lock;
+    std::vector<std::unique_ptr<Storage[]> > slabs;
+    moodycamel::ConcurrentQueue<T*> free_list;
+
+    std::atomic<uint64_t> num_slabs;
+    std::atomic<uint64_t> num_objects;
+    std::atomic<uint64_t> num_refills;
+    std::atomic<uint64_t> num_spills;
+
+    SlabPool() : num_slabs(0), num_objects(0), num_refills(0), num_spills(0) {}
+
+    ThreadCache& thread_cache() {
+        static thread_local ThreadCache cache(this);
+        return cache;
+    }
+
+    void refill(ThreadCache& cache) {
+        T* refilled[SLAB_POOL_THREAD_CACHE / 2];
+        size_t count = free_list.try_dequeue_bulk(refilled, SLAB_POOL_THREAD_CACHE / 2);
+        if (count) {
+            cache.free_objects.insert(cache.free_objects.end(), refilled, refilled + count);
+            num_refills.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Storage* slab = new Storage[SLAB_POOL_OBJECTS_PER_SLAB];
+        {
+            std::lock_guard<std::mutex> raii(slabs_lock);
+            slabs.emplace_back(slab);
+        }
+        for (int idx = SLAB_POOL_OBJECTS_PER_SLAB - 1; idx >= 0; --idx) {
+            cache.free_objects.push_back(reinterpret_cast<T*>(&slab[idx]));
+        }
+        num_slabs.fetch_add(1, std::memory_order_relaxed);
+        num_objects.fetch_add(SLAB_POOL_OBJECTS_PER_SLAB, std::memory_order_relaxed);
+    }
+
+  public:
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    // one pool per type, shared by every thread in the process
+    static SlabPool& instance() {
+        static SlabPool pool;
+        return pool;
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        ThreadCache& cache = thread_cache();
+        if (cache.free_objects.empty()) {
+            refill(cache);
+        }
+        T* object = cache.free_objects.back();
+        cache.free_objects.pop_back();
+        return new (object) T(std::forward<Args>(args)...);
+    }
+
+    // any thread may destroy an object, not just the one that created it
+    void destroy(T* object) {
+        if (!object) return;
+        object->~T();
+        ThreadCache& cache = thread_cache();
+        cache.free_objects.push_back(object);
+        if (cache.free_objects.size() >= SLAB_POOL_THREAD_CACHE) {
+            const size_t spilled = SLAB_POOL_THREAD_CACHE / 2;
+            free_list.enqueue_bulk(cache.free_objects.end() - spilled, spilled);
+            cache.free_objects.resize(cache.free_objects.size() - spilled);
+            num_spills.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    SlabPoolStats stats() const {
+        SlabPoolStats stats;
+        stats.slabs = num_slabs.load(std::memory_order_relaxed);
+        stats.objects = num_objects.load(std::memory_order_relaxed);
+        stats.refills = num_refills.load(std::memory_order_relaxed);
+        stats.spills = num_spills.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+
+template <typename T>
+inline std::string slab_pool_stats_to_str(const std::string& name) {
+    SlabPoolStats stats = SlabPool<T>::instance().stats();
+    return name + " pool: " + std::to_string(stats.slabs) + " slabs, " +
+           std::to_string(stats.objects) + " objects, " +
+           std::to_string(stats.refills) + " refills, " +
+           std::to_string(stats.spills) + " spills";
+}
+
+#endif
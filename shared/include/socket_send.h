@@ -5,12 +5,22 @@
 #include <string.h>		// memcpy()
 #include <sys/socket.h>		// getsockname()
 #include <unistd.h>		// stderr
+#include <sys/uio.h>		// struct iovec
+#include <sys/un.h>		// struct sockaddr_un
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <tuple>
+#include "communication.h"
+#include "shm_ring.h"
 
 #ifndef _HELPERS_H_
 #define _HELPERS_H_
 
 const int MAX_MESSAGE_SIZE = 1 << 22;
+// send and receive buffer asked for on every connection
+const int SOCKET_BUFFER_SIZE = 1 << 22;
 
 /**
  * Make a server sockaddr given a port.
@@ -51,16 +61,121 @@ int make_client_sockaddr(struct sockaddr_in *addr, const char *hostname, int por
  int get_port_number(int sockfd);
 
  /**
- * Sends a string message to the server.
+ * Sends one frame, a FrameHeader followed by the payload, to the server. The header and
+ * payload go out in a single sendmsg straight from the caller's buffers, partial writes
+ * are continued until everything is sent.
  *
  * Parameters:
  *		hostname: 	Remote hostname of the server.
  *		port: 		Remote port of the server.
- * 		message: 	The message to send, as a C-string.
+ *		sender: 	Who the receiver sees the message as coming from, under FRAME_SENDER_SIZE bytes.
+ *		mtype: 		Message type of the receiving component.
+ * 		payload: 	The payload, gathered from payload_count buffers.
+ *		sock: 		A connection from an earlier call to reuse, -1 opens a new one.
  * Returns:
- *		0 on success, -1 on failure.
+ *		The connection the frame was sent on, throws on failure.
+ */
+int send_frame(const char *hostname, int port, const std::string& sender, int mtype,
+               const struct iovec *payload, int payload_count, int sock = -1);
+
+// Same, for a payload in one buffer. payload may be null if payload_length is 0.
+int send_frame(const char *hostname, int port, const std::string& sender, int mtype,
+               const char *payload, size_t payload_length, int sock = -1);
+
+/**
+ * Set TCP_NODELAY, keep-alive and SOCKET_BUFFER_SIZE buffers on a socket. Accepted
+ * sockets inherit the buffer sizes from their listening socket.
+ */
+void tune_socket(int sock);
+
+/**
+ * The Unix socket every Reactor listens on next to TCP port, an abstract name so nothing
+ * is left behind on disk. Any local process can bind or connect to it, see local_peer_trusted.
+ */
+std::string local_socket_path(int port);
+
+/**
+ * False if sock is a Unix socket whose other end runs as another user, or its credentials
+ * can't be read. Frames and rings are only exchanged with our own user's processes.
+ */
+bool local_peer_trusted(int sock);
+
+/**
+ * Fill in a sockaddr_un for path, a leading NUL makes it an abstract name.
+ * Returns the address length to bind or connect with, throws if path doesn't fit.
  */
-int send_message(const char *hostname, int port, const char *message, const int message_length, int sock = -1);
+socklen_t make_unix_sockaddr(struct sockaddr_un *addr, const std::string& path);
+
+/**
+ * Hostnames may name a co-located component directly:
+ *		unix:[path] 	control and data frames over a Unix socket
+ *		shm:[path] 	control frames over a Unix socket, DATA and OUTPUT through a ShmRing
+ * path defaults to the local_socket_path of the port. Returns false for a network
+ * hostname, otherwise sets path (empty for the default) and whether a ring is wanted.
+ */
+bool parse_local_endpoint(const std::string& hostname, std::string& path, bool& shared_memory);
+
+// Pooled connections are kept apart by channel, so a long stream never holds up the
+// control messages to the same host. CHANNEL_DATA stays last: stream k of a DATA
+// transfer is sent on channel CHANNEL_DATA + k.
+enum ConnectionChannel {
+  CHANNEL_CONTROL,
+  CHANNEL_CREDIT,
+  CHANNEL_OUTPUT,
+  CHANNEL_DATA
+};
+
+/*
+One long-lived connection per (host, port, channel), opened on first use and shared by
+every thread of the process. Frames on one connection arrive in the order they were sent.
+A connection the receiver closed before a frame is replaced transparently, resolved addresses are cached.
+Receivers must keep pooled connections open, see Reactor::Handler.
+
+A network hostname that resolves to this machine is reached like shm: (see
+parse_local_endpoint), falling back to TCP if the receiver has no Unix socket, e.g. it runs
+in another network namespace. CHANNEL_OUTPUT and the DATA channels then go through a
+ShmRing, the smaller control and credit messages stay on the socket.
+*/
+class ConnectionPool {
+  private:
+    struct PooledConnection {
+        std::mutex lock;
+        int sock;
+        // frames go here instead of sock once set, sock only tells us the receiver left
+        std::unique_ptr<ShmRing> ring;
+        PooledConnection() : sock(-1) {}
+        void reset();
+    };
+
+    std::mutex connections_lock;
+    std::map<std::tuple<std::string, int, int>, std::unique_ptr<PooledConnection> > connections;
+
+    ConnectionPool() {}
+    PooledConnection& get(const std::string& hostname, int port, int channel);
+    static void open(PooledConnection& conn, const std::string& hostname, int port, int channel);
+    static void write(PooledConnection& conn, const std::string& hostname, const FrameHeader& header,
+                      const struct iovec *payload, int payload_count, bool& started);
+
+  public:
+    ~ConnectionPool();
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    static ConnectionPool& instance();
+
+    // Send one frame, throws if it can't be delivered. It is only sent again on a new
+    // connection if none of it reached the old one, the caller decides about the rest.
+    void send(const std::string& hostname, int port, int channel,
+              const std::string& sender, int mtype, const struct iovec *payload, int payload_count);
+    void send(const std::string& hostname, int port, int channel,
+              const std::string& sender, int mtype, const char *payload, size_t payload_length);
+};
+
+// Throws if the header is not one send_frame would produce.
+void check_frame_header(const FrameHeader& header);
+
+// The sender field without its padding.
+std::string frame_sender(const FrameHeader& header);
 
 std::string get_hostname_str();
 
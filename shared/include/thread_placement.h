@@ -0,0 +1,55 @@
+/*
+ * Header file for pinning each component's threads to the cores given in its config.
+ */
+
+#ifndef _THREAD_PLACEMENT_H_
+#define _THREAD_PLACEMENT_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "json.hpp"
+
+// Roles a "thread_placement" config may list cores for
+#define PLACEMENT_ENCLAVE_WORKERS "enclave_workers"
+#define PLACEMENT_MATCHERS "matchers"
+#define PLACEMENT_DPI_HELPERS "helpers"
+#define PLACEMENT_DPI_PACKERS "packers"
+#define PLACEMENT_NETWORK "network"
+
+/*
+Config format, every key is optional:
+    "thread_placement": {
+        "enclave_workers": [0, 1, 2, 3],
+        "network": [14, 15],
+        "isolate_network": true
+    }
+Workers with an index are pinned to one core of their role, round robin. Network threads
+float over all of their role's cores. With "isolate_network" the network cores are taken
+away from every other role, and roles without a core list get every other core.
+
+There is no explicit NUMA allocation. Per-thread buffers are allocated by the thread that
+uses them after it is pinned, so the kernel's first-touch policy already puts them on that
+core's node. The report lists the node of every core so this can be checked.
+*/
+class ThreadPlacement {
+  private:
+    std::vector<std::string> roles;
+    std::unordered_map<std::string, std::vector<int> > role_cores;
+    bool isolate_network;
+
+  public:
+    ThreadPlacement();
+
+    // reads "thread_placement" out of config, throws on an unknown role or a core that isn't online
+    void load(const nlohmann::json& config, const std::vector<std::string>& component_roles);
+
+    // pin the calling thread, index -1 allows every core of the role. Returns false if the
+    // role is unpinned or the kernel refused.
+    bool pin_current(const std::string& role, const int index=-1) const;
+
+    // one line per role, for the startup log
+    std::string report() const;
+};
+
+#endif /* _THREAD_PLACEMENT_H_ */
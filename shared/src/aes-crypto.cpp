@@ -1,5 +1,7 @@
 #include "aes-crypto.h"
 
+#include <cstring>
+
 AESCrypto::AESCrypto() {
     key = CryptoPP::SecByteBlock(CryptoPP::AES::DEFAULT_KEYLENGTH);
     iv = CryptoPP::SecByteBlock(CryptoPP::AES::BLOCKSIZE);
@@ -7,6 +9,15 @@ AESCrypto::AESCrypto() {
     prng.GenerateBlock(iv, CryptoPP::AES::BLOCKSIZE);
 
     encryptor.SetKeyWithIV(key, key.size(), iv);
+    line_encryptor.SetKeyWithIV(key, key.size(), iv);
+}
+
+void AESCrypto::set_key_and_iv(const byte* new_key, const byte* new_iv) {
+    std::memcpy(key, new_key, key.size());
+    std::memcpy(iv, new_iv, iv.size());
+
+    encryptor.SetKeyWithIV(key, key.size(), iv);
+    line_encryptor.SetKeyWithIV(key, key.size(), iv);
 }
 
 std::string AESCrypto::encrypt_line(const byte* line, int line_size) {
@@ -20,6 +31,21 @@ std::string AESCrypto::encrypt_line(const byte* line, int line_size) {
     return cipher;//encode((const byte*)&cipher[0], cipher.size());
 }
 
+std::string AESCrypto::encrypt_line_with_iv(const byte* line, int line_size) {
+    byte line_iv[CryptoPP::AES::BLOCKSIZE];
+    prng.GenerateBlock(line_iv, CryptoPP::AES::BLOCKSIZE);
+    line_encryptor.Resynchronize(line_iv);
+
+    // The IV goes in front of the ciphertext, StringSink appends after it
+    std::string cipher((const char*)line_iv, CryptoPP::AES::BLOCKSIZE);
+    CryptoPP::StringSource ss(line, line_size, true /*pumpAll*/, 
+                    new CryptoPP::StreamTransformationFilter(line_encryptor,
+                        new CryptoPP::StringSink(cipher)
+                    ) // StreamTransformationFilter
+                );
+    return cipher;
+}
+
 std::string AESCrypto::encode(const byte* data, int data_size) {
     CryptoPP::Base64Encoder encoder;
     std::string encoded;
@@ -43,19 +69,36 @@ std::string AESCrypto::decode(const std::string& encoded_line) {
     return decoded;
 }
 
-std::string AESCrypto::get_key_and_iv(CryptoPP::RSAES<CryptoPP::OAEP<CryptoPP::SHA256> >::Encryptor& rsa_encryptor) {
-    std::string enc_key;
-    std::string enc_iv;
-    CryptoPP::ArraySource keysource(key, key.size(), true, /* pump all data */
-        new CryptoPP::PK_EncryptorFilter(prng, rsa_encryptor,
-            new CryptoPP::StringSink(enc_key)
-        )
-    );
+SessionSecret::SessionSecret() {
+    secret = CryptoPP::SecByteBlock(SESSION_SECRET_LENGTH);
+    prng.GenerateBlock(secret, SESSION_SECRET_LENGTH);
+}
 
-    CryptoPP::ArraySource ivsource(iv, iv.size(), true, /* pump all data */
+void SessionSecret::derive_stream_encryptors(std::vector<AESCrypto>& aes_list) {
+    const std::string salt = SESSION_KEY_SALT;
+    CryptoPP::HKDF<CryptoPP::SHA256> hkdf;
+    byte key_and_iv[AES_KEY_LENGTH + AES_IV_LENGTH];
+    for (std::size_t stream_id = 0; stream_id < aes_list.size(); ++stream_id) {
+        const std::string info = SESSION_KEY_STREAM_INFO + std::to_string(stream_id);
+        hkdf.DeriveKey(key_and_iv, sizeof(key_and_iv),
+                       secret, secret.size(),
+                       (const byte*)salt.data(), salt.size(),
+                       (const byte*)info.data(), info.size());
+        aes_list[stream_id].set_key_and_iv(key_and_iv, key_and_iv + AES_KEY_LENGTH);
+    }
+}
+
+std::string SessionSecret::wrap(CryptoPP::RSAES<CryptoPP::OAEP<CryptoPP::SHA256> >::Encryptor& rsa_encryptor) {
+    std::string enc_secret;
+    CryptoPP::ArraySource secret_source(secret, secret.size(), true, /* pump all data */
         new CryptoPP::PK_EncryptorFilter(prng, rsa_encryptor,
-            new CryptoPP::StringSink(enc_iv)
+            new CryptoPP::StringSink(enc_secret)
         )
     );
-    return encode((const byte*)enc_key.data(), enc_key.size()) + '\t' + encode((const byte*)enc_iv.data(), enc_iv.size());
+    CryptoPP::Base64Encoder encoder(nullptr, false /* no line breaks */);
+    std::string encoded;
+    encoder.Attach(new CryptoPP::StringSink(encoded));
+    encoder.Put((const byte*)enc_secret.data(), enc_secret.size());
+    encoder.MessageEnd();
+    return encoded;
 }
@@ -4,6 +4,8 @@
 
 #include "parser.h"
 #include "hashing.h"
+#include "gwas.h"
+#include "genotype_tokenizer.h"
 
 #include <iostream>
 
@@ -69,69 +71,65 @@ int Parser::parse_nth_int(const std::string& str, const int n, const char delim)
     return std::stoi(parsed_int);
 }
 
-void Parser::parse_data_body(std::vector<DataBlock*>& blocks, const std::string& message_body, AESCrypto& decoder) {
-    // TODO: optimize this... super inefficient currently
-
-    std::vector<std::string> split_msg;
-    Parser::split(split_msg, message_body, '\t');
-
-    // Start idx at 1 to skip over the block id
-    for (long unsigned int msg_idx = 1; msg_idx < split_msg.size(); msg_idx += 3) {
-        DataBlock* block = new DataBlock;
-
-        block->locus = split_msg[msg_idx] + "\t" + split_msg[msg_idx + 1];
-        block->data = split_msg[msg_idx + 2];
-        blocks.push_back(block);
+// length of "locus\talleles\t", the genotypes start right after
+static size_t locus_and_allele_length(const std::string& line) {
+    const size_t locus_end = line.find('\t');
+    const size_t allele_end = locus_end == std::string::npos ? locus_end : line.find('\t', locus_end + 1);
+    if (allele_end == std::string::npos) {
+        throw std::runtime_error("Invalid alleles file! Fewer than three columns");
     }
+    return allele_end + 1;
 }
 
 int Parser::parse_hash(const std::string& line, const int encryptor_list_size) {
-    std::vector<std::string> line_split;
-    Parser::split(line_split, line, '\t', 2);
-    std::string locus_and_allele = line_split[0] + '\t' + line_split[1] + '\t';
-    return hash_string(locus_and_allele, encryptor_list_size, false);
+    return hash_string(line.substr(0, locus_and_allele_length(line)), encryptor_list_size, false);
+}
+
+uint64_t Parser::parse_variant_key(const char* locus, const size_t length) {
+    // chrom:pos\t["a1","a2"]
+    size_t idx = 0;
+    int chrom = 0;
+    if (length && locus[0] == 'X') {
+        chrom = LOCI_X;
+        idx = 1;
+    } else {
+        while (idx < length && isdigit(locus[idx])) {
+            chrom = chrom * 10 + (locus[idx++] - '0');
+        }
+    }
+    if (idx >= length || locus[idx++] != ':') {
+        throw std::runtime_error("Invalid locus: " + std::string(locus, length));
+    }
+    uint64_t pos = 0;
+    while (idx < length && isdigit(locus[idx])) {
+        pos = pos * 10 + (locus[idx++] - '0');
+    }
+    if (pos > UINT32_MAX || length != idx + 10 || locus[idx] != '\t') {
+        throw std::runtime_error("Invalid locus: " + std::string(locus, length));
+    }
+    return pack_variant_key(chrom, static_cast<uint32_t>(pos), locus[idx + 3], locus[idx + 7]);
 }
 
 void Parser::parse_allele_line(std::string& line, 
-                              std::vector<uint8_t>& vals, 
+                              const int num_patients, 
                               std::vector<uint8_t>& compressed_vals, 
                               std::vector<std::vector<AESCrypto> >& encryptor_list, 
                               const int enclave_node_hash) {
-    std::vector<std::string> line_split;
-    Parser::split(line_split, line, '\t', 2);
-    std::string locus_and_allele = line_split[0] + '\t' + line_split[1] + '\t';
+    const size_t genotypes_start = locus_and_allele_length(line);
+    const std::string locus_and_allele = line.substr(0, genotypes_start);
 
-    // Use the AES encryptor that corresponds to the appropriate thread on the server end
+    // Use the AES encryptor of the key stream this locus hashes to. The enclave node recomputes
+    // the same hash to tell the enclave which stream key to use, but any of its threads may decrypt it.
     std::vector<AESCrypto>& aes_list = encryptor_list[enclave_node_hash];
     AESCrypto& encryptor = aes_list[hash_string(locus_and_allele, aes_list.size(), true)];
 
-    std::string line_vals = line_split.back();
-    int val_idx = 0;
-    for (std::size_t line_idx = 0; line_idx < line_vals.length(); line_idx += 2) {
-        switch(line_vals[line_idx]) {
-            case '0':
-                vals[val_idx++] = static_cast<char>(0);
-                break;
-
-            case '1':
-                vals[val_idx++] = static_cast<char>(1);
-                break;
-
-            case '2':
-                vals[val_idx++] = static_cast<char>(2);
-                break;
-
-            case 'N':
-                vals[val_idx++] = static_cast<char>(3);
-                line_idx++;
-                break;
-
-            default:
-                throw std::runtime_error("Invalid alleles file!");
-        }
+    size_t genotypes_end = line.length();
+    // files written on Windows
+    if (genotypes_end > genotypes_start && line[genotypes_end - 1] == '\r') {
+        --genotypes_end;
     }
-    two_bit_compress(&vals[0], &compressed_vals[0], vals.size());
-    const std::string enc = encryptor.encrypt_line((byte *)&compressed_vals[0], compressed_vals.size());
+    genotype_tokenizer::pack(line.data(), genotypes_start, genotypes_end, &compressed_vals[0], num_patients);
+    const std::string enc = encryptor.encrypt_line_with_iv((byte *)&compressed_vals[0], compressed_vals.size());
     line = locus_and_allele + enc + "\n";
 }
 
@@ -157,21 +155,3 @@ void Parser::assert_non_empty(const std::string& str) {
         throw std::runtime_error("String is empty");
     }
 }
-
-void Parser::two_bit_compress(uint8_t* input, uint8_t* compressed, unsigned int size) {
-    int two_bit_arr = 0;
-    int two_bit_arr_count = 0;
-    int compressed_idx = 0;
-    for (unsigned int input_idx = 0; input_idx < size; ++input_idx) {
-        two_bit_arr += input[input_idx] << (2 * two_bit_arr_count++);
-        if (two_bit_arr_count == TWO_BIT_INT_ARR_SIZE) {
-            compressed[compressed_idx++] = two_bit_arr;
-            two_bit_arr = 0;
-            two_bit_arr_count = 0;
-        } 
-    }
-    // If our input is not a multiple of 4 we will have some trailing bits!
-    if (two_bit_arr_count != 0) {
-        compressed[compressed_idx] = two_bit_arr;
-    }
-}
@@ -0,0 +1,559 @@
+#include "reactor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include "socket_send.h"
+
+#define REACTOR_EPOLL_EVENTS 64
+// messages a handler thread takes from one connection before giving the others a turn
+#define REACTOR_HANDLER_BATCH 16
+
+static void reactor_log(const std::string& line) {
+    static std::mutex log_lock;
+    std::lock_guard<std::mutex> raii(log_lock);
+    std::cout << line << std::endl;
+}
+
+Reactor::Connection::Connection(int fd, IoThread* owner)
+    : fd(fd), owner(owner), header_read(0), reading_payload(false), payload_read(0),
+      scheduled(false), paused(false), peer_closed(false), close_requested(false), finalized(false) {}
+
+Reactor::IoThread::IoThread(Reactor* reactor) : reactor(reactor) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw std::runtime_error("epoll_create1 failed: " + std::to_string(errno));
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        throw std::runtime_error("eventfd failed: " + std::to_string(errno));
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0) {
+        throw std::runtime_error("epoll_ctl failed: " + std::to_string(errno));
+    }
+}
+
+Reactor::IoThread::~IoThread() {
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void Reactor::IoThread::start() {
+    // servers leave through exit(), nobody joins
+    thread = std::thread(&IoThread::loop, this);
+    thread.detach();
+}
+
+void Reactor::IoThread::post(const std::shared_ptr<Connection>& conn) {
+    {
+        std::lock_guard<std::mutex> raii(posted_lock);
+        posted.push_back(conn);
+    }
+    const uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        reactor_log("Reactor wake failed: " + std::to_string(errno));
+    }
+}
+
+void Reactor::IoThread::loop() {
+    struct epoll_event events[REACTOR_EPOLL_EVENTS];
+    std::vector<std::shared_ptr<Connection> > woken;
+    while (true) {
+        int count = epoll_wait(epoll_fd, events, REACTOR_EPOLL_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("epoll_wait failed: " + std::to_string(errno));
+        }
+        for (int idx = 0; idx < count; ++idx) {
+            if (events[idx].data.fd != wake_fd) {
+                auto found = connections.find(events[idx].data.fd);
+                // the connection may have been closed earlier in this batch
+                if (found != connections.end()) {
+                    service(found->second);
+                }
+                continue;
+            }
+            uint64_t wakes;
+            while (read(wake_fd, &wakes, sizeof(wakes)) > 0) {}
+            {
+                std::lock_guard<std::mutex> raii(posted_lock);
+                woken.swap(posted);
+            }
+            for (const std::shared_ptr<Connection>& conn : woken) {
+                if (conn->finalized) continue;
+                auto found = connections.find(conn->fd);
+                if (found == connections.end()) {
+                    struct epoll_event event;
+                    memset(&event, 0, sizeof(event));
+                    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+                    event.data.fd = conn->fd;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+                        reactor_log("epoll_ctl failed: " + std::to_string(errno));
+                        close(conn->fd);
+                        conn->finalized = true;
+                        continue;
+                    }
+                    connections[conn->fd] = conn;
+                } else if (found->second != conn) {
+                    continue;
+                }
+                service(conn);
+            }
+            woken.clear();
+        }
+    }
+}
+
+void Reactor::IoThread::service(const std::shared_ptr<Connection>& conn) {
+    bool can_read;
+    bool socket_open;
+    {
+        std::lock_guard<std::mutex> raii(conn->lock);
+        if (conn->paused && conn->pending.size() < reactor->max_queued_messages) {
+            conn->paused = false;
+        }
+        can_read = !conn->paused && !conn->close_requested;
+        socket_open = !conn->peer_closed;
+    }
+    if (can_read && socket_open) {
+        read_connection(conn);
+    }
+    // frames the sender put in the ring before it left are still delivered
+    if (can_read && conn->ring) {
+        read_ring(conn);
+    }
+    const bool ring_drained = !conn->ring || conn->ring->empty();
+    {
+        std::lock_guard<std::mutex> raii(conn->lock);
+        // a handler may still use the fd until it hands the connection back
+        if (!((conn->peer_closed && ring_drained) || conn->close_requested) || conn->scheduled) {
+            return;
+        }
+        conn->finalized = true;
+    }
+    finalize(conn);
+}
+
+void Reactor::IoThread::finalize(const std::shared_ptr<Connection>& conn) {
+    if (conn->ring) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->ring->get_notify_fd(), nullptr);
+        connections.erase(conn->ring->get_notify_fd());
+        conn->ring.reset();
+    }
+    for (int fd : conn->passed_fds) {
+        close(fd);
+    }
+    conn->passed_fds.clear();
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    connections.erase(conn->fd);
+    close(conn->fd);
+}
+
+// recv, also collecting the fds a sender passes along with a FRAME_FLAG_SHM_ATTACH header
+ssize_t Reactor::IoThread::receive_header(const std::shared_ptr<Connection>& conn, char* target, size_t wanted) {
+    union {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    iov.iov_base = target;
+    iov.iov_len = wanted;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t rval = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (rval <= 0) {
+        return rval;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t idx = 0; idx < count; ++idx) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + idx * sizeof(int), sizeof(int));
+            conn->passed_fds.push_back(fd);
+        }
+    }
+    return rval;
+}
+
+void Reactor::IoThread::read_connection(const std::shared_ptr<Connection>& conn) {
+    while (!conn->paused) {
+        ssize_t rval;
+        if (conn->reading_payload) {
+            rval = recv(conn->fd, conn->payload.get() + conn->payload_read,
+                        conn->header.payload_length - conn->payload_read, 0);
+        } else {
+            rval = receive_header(conn, reinterpret_cast<char*>(&conn->header) + conn->header_read,
+                                  sizeof(FrameHeader) - conn->header_read);
+        }
+        if (rval < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            reactor_log("Socket recv failed: " + std::string(strerror(errno)));
+        }
+        if (rval <= 0) {
+            std::lock_guard<std::mutex> raii(conn->lock);
+            conn->peer_closed = true;
+            return;
+        }
+
+        if (conn->reading_payload) {
+            conn->payload_read += rval;
+            if (conn->payload_read < conn->header.payload_length) {
+                continue;
+            }
+        } else {
+            conn->header_read += rval;
+            if (conn->header_read < sizeof(FrameHeader)) {
+                continue;
+            }
+            try {
+                check_frame_header(conn->header);
+            } catch (const std::runtime_error& e) {
+                reactor_log("Dropping connection: " + std::string(e.what()));
+                std::lock_guard<std::mutex> raii(conn->lock);
+                conn->close_requested = true;
+                return;
+            }
+            if (conn->header.flags & FRAME_FLAG_SHM_ATTACH) {
+                conn->header_read = 0;
+                if (!attach_ring(conn)) {
+                    std::lock_guard<std::mutex> raii(conn->lock);
+                    conn->close_requested = true;
+                    return;
+                }
+                continue;
+            }
+            if (!conn->passed_fds.empty()) {
+                reactor_log("Dropping connection: fds passed with an ordinary frame");
+                std::lock_guard<std::mutex> raii(conn->lock);
+                conn->close_requested = true;
+                return;
+            }
+            if (conn->header.payload_length) {
+                conn->payload = reactor->allocator(conn->header.payload_length);
+                conn->payload_read = 0;
+                conn->reading_payload = true;
+                continue;
+            }
+        }
+
+        Message message;
+        message.header = conn->header;
+        message.payload = std::move(conn->payload);
+        conn->payload.reset();
+        conn->header_read = 0;
+        conn->reading_payload = false;
+        conn->payload_read = 0;
+        deliver(conn, std::move(message));
+    }
+}
+
+bool Reactor::IoThread::attach_ring(const std::shared_ptr<Connection>& conn) {
+    std::vector<int> fds;
+    fds.swap(conn->passed_fds);
+    if (fds.size() != 2 || conn->ring || conn->header.payload_length) {
+        reactor_log("Dropping connection: malformed ring attach");
+        for (int fd : fds) {
+            close(fd);
+        }
+        return false;
+    }
+    try {
+        conn->ring = ShmRing::attach(fds[0], fds[1]);
+    } catch (const std::runtime_error& e) {
+        reactor_log("Dropping connection: " + std::string(e.what()));
+        return false;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = conn->ring->get_notify_fd();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->ring->get_notify_fd(), &event) < 0) {
+        reactor_log("epoll_ctl failed: " + std::to_string(errno));
+        conn->ring.reset();
+        return false;
+    }
+    connections[conn->ring->get_notify_fd()] = conn;
+    return true;
+}
+
+void Reactor::IoThread::read_ring(const std::shared_ptr<Connection>& conn) {
+    uint64_t wakes;
+    while (read(conn->ring->get_notify_fd(), &wakes, sizeof(wakes)) > 0) {}
+    while (!conn->paused) {
+        Message message;
+        try {
+            if (!conn->ring->peek(message.header)) {
+                // the sender only signals the eventfd once we said we are going to sleep
+                if (conn->ring->arm()) {
+                    return;
+                }
+                continue;
+            }
+            check_frame_header(message.header);
+            if (message.header.payload_length) {
+                message.payload = reactor->allocator(message.header.payload_length);
+            }
+            conn->ring->consume(message.header, message.payload.get(), message.header.payload_length);
+        } catch (const std::runtime_error& e) {
+            reactor_log("Dropping connection: " + std::string(e.what()));
+            std::lock_guard<std::mutex> raii(conn->lock);
+            conn->close_requested = true;
+            return;
+        }
+        deliver(conn, std::move(message));
+    }
+}
+
+void Reactor::IoThread::deliver(const std::shared_ptr<Connection>& conn, Message message) {
+    bool schedule_now = false;
+    {
+        std::lock_guard<std::mutex> raii(conn->lock);
+        if (conn->close_requested) {
+            return;
+        }
+        conn->pending.push_back(std::move(message));
+        if (!conn->scheduled) {
+            conn->scheduled = true;
+            schedule_now = true;
+        }
+        if (conn->pending.size() >= reactor->max_queued_messages) {
+            conn->paused = true;
+        }
+    }
+    if (schedule_now) {
+        reactor->schedule(conn);
+    }
+}
+
+Reactor::Reactor(const nlohmann::json& config, Handler handler, Allocator allocator)
+    : handler(handler), allocator(allocator) {
+    num_io_threads = 2;
+    num_handler_threads = std::max(4, static_cast<int>(std::thread::hardware_concurrency()));
+    max_queued_messages = 64;
+    if (config.count("reactor")) {
+        const nlohmann::json& reactor_config = config["reactor"];
+        if (reactor_config.count("io_threads")) {
+            num_io_threads = reactor_config["io_threads"];
+        }
+        if (reactor_config.count("handler_threads")) {
+            num_handler_threads = reactor_config["handler_threads"];
+        }
+        if (reactor_config.count("max_queued_messages")) {
+            if (reactor_config["max_queued_messages"].get<int>() < 1) {
+                throw std::runtime_error("max_queued_messages must be at least 1");
+            }
+            max_queued_messages = reactor_config["max_queued_messages"].get<int>();
+        }
+    }
+    if (num_io_threads < 1 || num_handler_threads < 1) {
+        throw std::runtime_error("The reactor needs at least one I/O thread and one handler thread");
+    }
+    if (!this->allocator) {
+        this->allocator = [](size_t payload_length) {
+            return std::shared_ptr<char>(new char[payload_length], std::default_delete<char[]>());
+        };
+    }
+    for (int id = 0; id < num_io_threads; ++id) {
+        io_threads.emplace_back(new IoThread(this));
+    }
+}
+
+Reactor::~Reactor() {
+    for (int listen_fd : listen_fds) {
+        close(listen_fd);
+    }
+}
+
+unsigned int Reactor::listen(unsigned int port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        throw std::runtime_error("socket failure: " + std::to_string(errno));
+    }
+    int yesval = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval));
+    // accepted connections inherit the buffer sizes
+    tune_socket(listen_fd);
+
+    struct sockaddr_in addr;
+    socklen_t addrSize = sizeof(addr);
+    memset(&addr, 0, addrSize);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    // bind to our given port, or randomly get one if port = 0
+    if (bind(listen_fd, (struct sockaddr*) &addr, addrSize) < 0) {
+        throw std::runtime_error("bind failure: " + std::to_string(errno));
+    }
+    if (getsockname(listen_fd, (struct sockaddr*) &addr, &addrSize) < 0) {
+        throw std::runtime_error("getsockname failure: " + std::to_string(errno));
+    }
+    if (::listen(listen_fd, 4096) < 0) {
+        throw std::runtime_error("listen failure: " + std::to_string(errno));
+    }
+    listen_fds.push_back(listen_fd);
+    port = ntohs(addr.sin_port);
+
+    // co-located senders fall back to TCP if this fails
+    try {
+        listen_local(local_socket_path(port));
+    } catch (const std::runtime_error& e) {
+        reactor_log("Not listening on a Unix socket: " + std::string(e.what()));
+    }
+    return port;
+}
+
+void Reactor::listen_local(const std::string& path) {
+    struct sockaddr_un addr;
+    const socklen_t addrSize = make_unix_sockaddr(&addr, path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        throw std::runtime_error("socket failure: " + std::to_string(errno));
+    }
+    // a socket file left behind by an earlier run, abstract names go away with their process
+    if (path[0] != '\0') {
+        unlink(path.c_str());
+    }
+    if (bind(listen_fd, (struct sockaddr*) &addr, addrSize) < 0) {
+        close(listen_fd);
+        throw std::runtime_error("bind failure on a Unix socket: " + std::to_string(errno));
+    }
+    if (::listen(listen_fd, 4096) < 0) {
+        close(listen_fd);
+        throw std::runtime_error("listen failure: " + std::to_string(errno));
+    }
+    listen_fds.push_back(listen_fd);
+}
+
+void Reactor::run() {
+    if (listen_fds.empty()) {
+        throw std::runtime_error("Reactor::run called before listen");
+    }
+    // every thread is started from here and inherits the caller's cores
+    for (std::unique_ptr<IoThread>& io_thread : io_threads) {
+        io_thread->start();
+    }
+    for (int id = 0; id < num_handler_threads; ++id) {
+        std::thread handler_thread(&Reactor::handler_loop, this);
+        handler_thread.detach();
+    }
+
+    std::vector<struct pollfd> poll_fds(listen_fds.size());
+    for (size_t idx = 0; idx < listen_fds.size(); ++idx) {
+        poll_fds[idx].fd = listen_fds[idx];
+        poll_fds[idx].events = POLLIN;
+    }
+    size_t next_io_thread = 0;
+    while (true) {
+        if (poll(poll_fds.data(), poll_fds.size(), -1) < 0) {
+            if (errno != EINTR) {
+                reactor_log("poll failed: " + std::to_string(errno));
+            }
+            continue;
+        }
+        for (struct pollfd& poll_fd : poll_fds) {
+            if (!poll_fd.revents) {
+                continue;
+            }
+            int connFD = accept4(poll_fd.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (connFD < 0) {
+                if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                    reactor_log("accept failed: " + std::to_string(errno));
+                }
+                continue;
+            }
+            if (!local_peer_trusted(connFD)) {
+                reactor_log("Refused a Unix socket connection from another user");
+                close(connFD);
+                continue;
+            }
+            IoThread* owner = io_threads[next_io_thread++ % io_threads.size()].get();
+            owner->post(std::make_shared<Connection>(connFD, owner));
+        }
+    }
+}
+
+void Reactor::schedule(const std::shared_ptr<Connection>& conn) {
+    {
+        std::lock_guard<std::mutex> raii(ready_lock);
+        ready.push_back(conn);
+    }
+    ready_condition.notify_one();
+}
+
+void Reactor::handler_loop() {
+    while (true) {
+        std::shared_ptr<Connection> conn;
+        {
+            std::unique_lock<std::mutex> raii(ready_lock);
+            ready_condition.wait(raii, [this]() { return !ready.empty(); });
+            conn = std::move(ready.front());
+            ready.pop_front();
+        }
+        handle_ready(conn);
+    }
+}
+
+void Reactor::handle_ready(const std::shared_ptr<Connection>& conn) {
+    for (int handled = 0; handled < REACTOR_HANDLER_BATCH; ++handled) {
+        Message message;
+        bool have_message = false;
+        bool wake_io;
+        {
+            std::lock_guard<std::mutex> raii(conn->lock);
+            if (conn->pending.empty()) {
+                // hand the connection back, the I/O thread resumes reading or closes it
+                conn->scheduled = false;
+                wake_io = conn->paused || conn->peer_closed || conn->close_requested;
+            } else {
+                message = std::move(conn->pending.front());
+                conn->pending.pop_front();
+                have_message = true;
+                wake_io = conn->paused && conn->pending.size() == max_queued_messages / 2;
+            }
+        }
+        if (wake_io) {
+            conn->owner->post(conn);
+        }
+        if (!have_message) {
+            return;
+        }
+
+        bool keep_open;
+        try {
+            keep_open = handler(conn->fd, message.header, message.payload);
+        } catch (const std::exception& e) {
+            reactor_log("Exception " + std::string(e.what()));
+            keep_open = false;
+        }
+        if (!keep_open) {
+            std::lock_guard<std::mutex> raii(conn->lock);
+            conn->close_requested = true;
+            conn->pending.clear();
+        }
+    }
+    // more are queued, let the other connections have a turn
+    schedule(conn);
+}
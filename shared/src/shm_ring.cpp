@@ -0,0 +1,202 @@
+#include "shm_ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#define SHM_RING_CONTROL_SIZE 4096
+// how often a producer waiting for space checks that the consumer is still there
+#define SHM_RING_WAIT_NS 5000000
+// the memfd can't change size once set up, a peer can't pull the mapping out from under us
+#define SHM_RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static_assert(sizeof(ShmRingControl) <= SHM_RING_CONTROL_SIZE, "ShmRingControl outgrew its page");
+
+// not FUTEX_PRIVATE, the word is shared with another process
+static void futex_wait(std::atomic<uint32_t>* word, uint32_t expected) {
+    struct timespec timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = SHM_RING_WAIT_NS;
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT, static_cast<int>(expected), &timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+ShmRing::ShmRing(int memfd, int notify_fd)
+    : memfd(memfd), notify_fd(notify_fd), mapping(MAP_FAILED), mapping_size(SHM_RING_CONTROL_SIZE + SHM_RING_CAPACITY),
+      control(nullptr), data(nullptr), capacity(SHM_RING_CAPACITY) {}
+
+ShmRing::~ShmRing() {
+    if (mapping != MAP_FAILED) {
+        munmap(mapping, mapping_size);
+    }
+    if (memfd != -1) {
+        close(memfd);
+    }
+    if (notify_fd != -1) {
+        close(notify_fd);
+    }
+}
+
+std::unique_ptr<ShmRing> ShmRing::create() {
+    int memfd = static_cast<int>(syscall(SYS_memfd_create, "secret-gwas-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (memfd < 0) {
+        throw std::runtime_error("memfd_create failed: " + std::to_string(errno));
+    }
+    int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd < 0) {
+        close(memfd);
+        throw std::runtime_error("eventfd failed: " + std::to_string(errno));
+    }
+    std::unique_ptr<ShmRing> ring(new ShmRing(memfd, notify_fd));
+    if (ftruncate(memfd, ring->mapping_size) < 0) {
+        throw std::runtime_error("ftruncate of the ring failed: " + std::to_string(errno));
+    }
+    if (fcntl(memfd, F_ADD_SEALS, SHM_RING_SEALS) < 0) {
+        throw std::runtime_error("Sealing the ring failed: " + std::to_string(errno));
+    }
+    ring->mapping = mmap(nullptr, ring->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ring->mapping == MAP_FAILED) {
+        throw std::runtime_error("mmap of the ring failed: " + std::to_string(errno));
+    }
+    ring->control = new (ring->mapping) ShmRingControl();
+    ring->control->head = 0;
+    ring->control->tail = 0;
+    ring->control->consumer_waiting = 0;
+    ring->control->producer_waiting = 0;
+    ring->control->space_epoch = 0;
+    ring->control->capacity = SHM_RING_CAPACITY;
+    ring->data = static_cast<char*>(ring->mapping) + SHM_RING_CONTROL_SIZE;
+    return ring;
+}
+
+std::unique_ptr<ShmRing> ShmRing::attach(int memfd, int notify_fd) {
+    std::unique_ptr<ShmRing> ring(new ShmRing(memfd, notify_fd));
+    // the fd comes from another process, only map it if it can't be shrunk under us later
+    struct stat memfd_stat;
+    if (fstat(memfd, &memfd_stat) < 0 || static_cast<size_t>(memfd_stat.st_size) != ring->mapping_size) {
+        throw std::runtime_error("Ring has the wrong size");
+    }
+    const int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || (seals & SHM_RING_SEALS) != SHM_RING_SEALS) {
+        throw std::runtime_error("Ring is not sealed");
+    }
+    ring->mapping = mmap(nullptr, ring->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ring->mapping == MAP_FAILED) {
+        throw std::runtime_error("mmap of the ring failed: " + std::to_string(errno));
+    }
+    ring->control = static_cast<ShmRingControl*>(ring->mapping);
+    if (ring->control->capacity != SHM_RING_CAPACITY) {
+        throw std::runtime_error("Ring capacity mismatch, both ends have to be built alike");
+    }
+    ring->data = static_cast<char*>(ring->mapping) + SHM_RING_CONTROL_SIZE;
+    return ring;
+}
+
+void ShmRing::copy_in(uint64_t pos, const char* source, size_t length) {
+    const size_t offset = pos % capacity;
+    const size_t first = std::min<size_t>(length, capacity - offset);
+    memcpy(data + offset, source, first);
+    memcpy(data, source + first, length - first);
+}
+
+void ShmRing::copy_out(uint64_t pos, char* target, size_t length) const {
+    const size_t offset = pos % capacity;
+    const size_t first = std::min<size_t>(length, capacity - offset);
+    memcpy(target, data + offset, first);
+    memcpy(target + first, data, length - first);
+}
+
+void ShmRing::write(const FrameHeader& header, const struct iovec* payload, int payload_count,
+                    const std::function<void()>& check_peer) {
+    const uint64_t needed = sizeof(FrameHeader) + header.payload_length;
+    if (needed > capacity) {
+        throw std::runtime_error("Frame larger than the ring");
+    }
+    const uint64_t head = control->head.load(std::memory_order_relaxed);
+    while (capacity - (head - control->tail.load(std::memory_order_acquire)) < needed) {
+        const uint32_t epoch = control->space_epoch.load(std::memory_order_seq_cst);
+        control->producer_waiting.store(1, std::memory_order_seq_cst);
+        // the consumer checks producer_waiting after moving tail, so one of us sees the other
+        if (capacity - (head - control->tail.load(std::memory_order_seq_cst)) >= needed) {
+            break;
+        }
+        futex_wait(&control->space_epoch, epoch);
+        check_peer();
+    }
+    control->producer_waiting.store(0, std::memory_order_relaxed);
+
+    uint64_t pos = head;
+    copy_in(pos, reinterpret_cast<const char*>(&header), sizeof(FrameHeader));
+    pos += sizeof(FrameHeader);
+    for (int idx = 0; idx < payload_count; ++idx) {
+        copy_in(pos, static_cast<const char*>(payload[idx].iov_base), payload[idx].iov_len);
+        pos += payload[idx].iov_len;
+    }
+    control->head.store(pos, std::memory_order_seq_cst);
+
+    if (control->consumer_waiting.load(std::memory_order_seq_cst) && control->consumer_waiting.exchange(0)) {
+        const uint64_t one = 1;
+        if (::write(notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            throw std::runtime_error("Failed to wake the ring's consumer: " + std::to_string(errno));
+        }
+    }
+}
+
+// Bytes published but not consumed. The producer only ever publishes whole frames, anything
+// else means the other side wrote garbage into the control block.
+uint64_t ShmRing::filled() const {
+    const uint64_t fill = control->head.load(std::memory_order_acquire) - control->tail.load(std::memory_order_relaxed);
+    if (fill > capacity || (fill && fill < sizeof(FrameHeader))) {
+        throw std::runtime_error("Corrupt ring, " + std::to_string(fill) + " bytes filled");
+    }
+    return fill;
+}
+
+bool ShmRing::peek(FrameHeader& header) const {
+    if (!filled()) {
+        return false;
+    }
+    copy_out(control->tail.load(std::memory_order_relaxed), reinterpret_cast<char*>(&header), sizeof(FrameHeader));
+    return true;
+}
+
+void ShmRing::consume(const FrameHeader& header, char* target, size_t target_size) {
+    if (header.payload_length > target_size || sizeof(FrameHeader) + header.payload_length > filled()) {
+        throw std::runtime_error("Ring frame of " + std::to_string(header.payload_length) + " bytes doesn't fit");
+    }
+    const uint64_t tail = control->tail.load(std::memory_order_relaxed);
+    if (header.payload_length) {
+        copy_out(tail + sizeof(FrameHeader), target, header.payload_length);
+    }
+    control->tail.store(tail + sizeof(FrameHeader) + header.payload_length, std::memory_order_seq_cst);
+    if (control->producer_waiting.load(std::memory_order_seq_cst)) {
+        control->space_epoch.fetch_add(1, std::memory_order_seq_cst);
+        futex_wake(&control->space_epoch);
+    }
+}
+
+bool ShmRing::arm() {
+    control->consumer_waiting.store(1, std::memory_order_seq_cst);
+    if (control->head.load(std::memory_order_seq_cst) != control->tail.load(std::memory_order_relaxed)) {
+        control->consumer_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::empty() const {
+    return control->head.load(std::memory_order_acquire) == control->tail.load(std::memory_order_relaxed);
+}
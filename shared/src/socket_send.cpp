@@ -1,5 +1,13 @@
 #include "socket_send.h"
+#include <ifaddrs.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <stdexcept>
+#include <vector>
 #include <curl/curl.h>
 #include "errno.h"
 
@@ -54,66 +62,447 @@ int get_port_number(int sockfd) {
 	return ntohs(addr.sin_port);
  }
 
-int send_message(const char *hostname, int port, const char *message, const int message_length, int sock) {
-	if (message_length > MAX_MESSAGE_SIZE) {
-		throw std::runtime_error("Message exceeds maximum length: " + std::to_string(message_length));
-		return -1;
+// getaddrinfo results, a run only ever talks to a handful of hosts
+static std::mutex resolved_lock;
+static std::map<std::pair<std::string, int>, std::vector<struct sockaddr_in> > resolved;
+
+static std::vector<struct sockaddr_in> resolve(const char *hostname, int port) {
+	const std::pair<std::string, int> key(hostname, port);
+	{
+		std::lock_guard<std::mutex> raii(resolved_lock);
+		auto found = resolved.find(key);
+		if (found != resolved.end()) {
+			return found->second;
+		}
 	}
-	// Connect to remote server
-	if (sock == -1) {
-		struct addrinfo hints = {}, *addrs;
-		char port_str[16] = {};
+	struct addrinfo hints = {}, *addrs;
+	char port_str[16] = {};
 
-		hints.ai_family = AF_INET; 
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-		sprintf(port_str, "%d", port);
+	hints.ai_family = AF_INET; 
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	sprintf(port_str, "%d", port);
 
-		if (getaddrinfo(hostname, port_str, &hints, &addrs) != 0) {
-			throw std::runtime_error("Failed to get addr info");
+	if (getaddrinfo(hostname, port_str, &hints, &addrs) != 0) {
+		throw std::runtime_error("Failed to get addr info");
+	}
+	std::vector<struct sockaddr_in> addresses;
+	for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next) {
+		if (!addr->ai_addr || addr->ai_addrlen != sizeof(struct sockaddr_in)) {
+			continue;
 		}
+		addresses.push_back(*reinterpret_cast<struct sockaddr_in *>(addr->ai_addr));
+	}
+	freeaddrinfo(addrs);
 
-		for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next) {
-			sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-			if (sock == -1)
-				break;
-			
-			if (!addr->ai_addr) {
-				std::cout << "addr ai was null, go to next?" << std::endl;
-				sock = -1;
-				continue;
-			}
-			if (!addr->ai_addrlen) {
-				std::cout << "addr ai len was 0, go to next?" << std::endl;
-				sock = -1;
-				continue;
-			}
-			if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0) {
-				break;
-			}
+	std::lock_guard<std::mutex> raii(resolved_lock);
+	resolved[key] = addresses;
+	return addresses;
+}
 
-			close(sock);
-			sock = -1;
-		}
-		freeaddrinfo(addrs);
+void tune_socket(int sock) {
+	int yesval = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yesval, sizeof(yesval));
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yesval, sizeof(yesval));
+	// the kernel caps these at net.core.[rw]mem_max
+	int buffer_size = SOCKET_BUFFER_SIZE;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+}
+
+static int connect_to(const char *hostname, int port) {
+	for (const struct sockaddr_in& addr : resolve(hostname, port)) {
+		int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
 		if (sock == -1) {
-			char buffer[ 256 ];
-			char * errorMsg = strerror_r( errno, buffer, 256 ); // GNU-specific version, Linux default
-			printf("Error %s\n", errorMsg); //return value has to be used since buffer might not be modified
-			throw std::runtime_error("Failed to connect\n");
+			break;
 		}
+		// before connect so the window scale is negotiated for the larger buffers
+		tune_socket(sock);
+		if (connect(sock, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) == 0) {
+			return sock;
+		}
+		close(sock);
+	}
+	// the host may have moved, look it up again next time
+	{
+		std::lock_guard<std::mutex> raii(resolved_lock);
+		resolved.erase(std::make_pair(std::string(hostname), port));
+	}
+	char buffer[ 256 ];
+	char * errorMsg = strerror_r( errno, buffer, 256 ); // GNU-specific version, Linux default
+	printf("Error %s\n", errorMsg); //return value has to be used since buffer might not be modified
+	throw std::runtime_error("Failed to connect\n");
+}
+
+std::string local_socket_path(int port) {
+	return std::string("\0secret-gwas-", 13) + std::to_string(port);
+}
+
+bool local_peer_trusted(int sock) {
+	int domain;
+	socklen_t domain_len = sizeof(domain);
+	if (getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) != 0) {
+		return false;
 	}
-	if (sock == -1 || !message || !message_length) {
-		throw std::runtime_error("Missed something on send.");
+	if (domain != AF_UNIX) {
+		return true;
 	}
-	// Send message to remote server
-	if (send(sock, message, message_length, 0) == -1) {
-		throw std::runtime_error("Hostname: " + std::string(hostname) + " error sending on stream socket");
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+		return false;
 	}
+	return cred.uid == getuid();
+}
+
+socklen_t make_unix_sockaddr(struct sockaddr_un *addr, const std::string& path) {
+	if (path.empty() || path.length() >= sizeof(addr->sun_path)) {
+		throw std::runtime_error("Bad Unix socket path: " + path);
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path.data(), path.length());
+	// abstract names are exactly their length, paths are NUL terminated
+	return offsetof(struct sockaddr_un, sun_path) + path.length() + (path[0] == '\0' ? 0 : 1);
+}
 
+bool parse_local_endpoint(const std::string& hostname, std::string& path, bool& shared_memory) {
+	static const std::string unix_scheme = "unix:";
+	static const std::string shm_scheme = "shm:";
+	if (hostname.compare(0, unix_scheme.length(), unix_scheme) == 0) {
+		path = hostname.substr(unix_scheme.length());
+		shared_memory = false;
+		return true;
+	}
+	if (hostname.compare(0, shm_scheme.length(), shm_scheme) == 0) {
+		path = hostname.substr(shm_scheme.length());
+		shared_memory = true;
+		return true;
+	}
+	return false;
+}
+
+static int connect_unix(const std::string& path) {
+	struct sockaddr_un addr;
+	socklen_t addr_len = make_unix_sockaddr(&addr, path);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		throw std::runtime_error("socket failure: " + std::to_string(errno));
+	}
+	int buffer_size = SOCKET_BUFFER_SIZE;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+	if (connect(sock, reinterpret_cast<const struct sockaddr *>(&addr), addr_len) != 0) {
+		close(sock);
+		throw std::runtime_error("Failed to connect to a Unix socket: " + std::to_string(errno));
+	}
+	// whoever bound the name first is at the other end
+	if (!local_peer_trusted(sock)) {
+		close(sock);
+		throw std::runtime_error("Unix socket is held by another user");
+	}
 	return sock;
 }
 
+// whether hostname resolves to one of this machine's addresses, asked once per hostname
+static bool is_local_host(const std::string& hostname, int port) {
+	static std::mutex local_lock;
+	static std::map<std::string, bool> local_hosts;
+	std::lock_guard<std::mutex> raii(local_lock);
+	auto found = local_hosts.find(hostname);
+	if (found != local_hosts.end()) {
+		return found->second;
+	}
+	std::vector<struct sockaddr_in> addresses;
+	try {
+		addresses = resolve(hostname.c_str(), port);
+	} catch (const std::runtime_error& e) {
+		// connect_to reports it
+		return false;
+	}
+	std::vector<in_addr_t> own;
+	struct ifaddrs *ifaddrs;
+	if (getifaddrs(&ifaddrs) == 0) {
+		for (struct ifaddrs *ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
+			if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET) {
+				own.push_back(reinterpret_cast<struct sockaddr_in *>(ifa->ifa_addr)->sin_addr.s_addr);
+			}
+		}
+		freeifaddrs(ifaddrs);
+	}
+	bool local = false;
+	for (const struct sockaddr_in& addr : addresses) {
+		if ((ntohl(addr.sin_addr.s_addr) >> 24) == 127 ||
+		    std::find(own.begin(), own.end(), addr.sin_addr.s_addr) != own.end()) {
+			local = true;
+		}
+	}
+	local_hosts[hostname] = local;
+	return local;
+}
+
+// Create a ring and pass it to the receiver, the frames after this one go through it.
+static std::unique_ptr<ShmRing> offer_ring(int sock) {
+	std::unique_ptr<ShmRing> ring = ShmRing::create();
+	FrameHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = FRAME_MAGIC;
+	header.version = FRAME_VERSION;
+	header.flags = FRAME_FLAG_SHM_ATTACH;
+
+	union {
+		char buffer[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov;
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	const int fds[2] = {ring->get_memfd(), ring->get_notify_fd()};
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t sent;
+	do {
+		sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (sent == -1 && errno == EINTR);
+	// a fresh Unix socket has room for one header
+	if (sent != static_cast<ssize_t>(sizeof(header))) {
+		throw std::runtime_error("Failed to hand over a shared memory ring: " + std::to_string(errno));
+	}
+	return ring;
+}
+
+static void make_frame_header(FrameHeader& header, const std::string& sender, int mtype,
+                              const struct iovec *payload, int payload_count) {
+	memset(&header, 0, sizeof(header));
+	header.magic = FRAME_MAGIC;
+	header.version = FRAME_VERSION;
+	header.mtype = static_cast<uint16_t>(mtype);
+
+	size_t payload_length = 0;
+	for (int idx = 0; idx < payload_count; ++idx) {
+		payload_length += payload[idx].iov_len;
+	}
+	if (payload_length > MAX_MESSAGE_SIZE) {
+		throw std::runtime_error("Message exceeds maximum length: " + std::to_string(payload_length));
+	}
+	if (sender.length() >= FRAME_SENDER_SIZE) {
+		throw std::runtime_error("Sender name too long for a frame: " + sender);
+	}
+	header.payload_length = static_cast<uint32_t>(payload_length);
+	memcpy(header.sender, sender.data(), sender.length());
+}
+
+// started is set once any byte of the frame went out, the receiver may then have part of it
+static void write_frame(int sock, const char *hostname, const FrameHeader& header,
+                        const struct iovec *payload, int payload_count, bool& started) {
+	std::vector<struct iovec> iov(payload_count + 1);
+	iov[0].iov_base = const_cast<FrameHeader *>(&header);
+	iov[0].iov_len = sizeof(header);
+	std::copy(payload, payload + payload_count, iov.begin() + 1);
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov.data();
+	msg.msg_iovlen = iov.size();
+	started = false;
+	// Send message to remote server, picking up where a partial write left off
+	while (msg.msg_iovlen) {
+		ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR) continue;
+			throw std::runtime_error("Hostname: " + std::string(hostname) + " error sending on stream socket");
+		}
+		started = started || sent > 0;
+		while (msg.msg_iovlen && static_cast<size_t>(sent) >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			++msg.msg_iov;
+			--msg.msg_iovlen;
+		}
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base = static_cast<char *>(msg.msg_iov->iov_base) + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+}
+
+int send_frame(const char *hostname, int port, const std::string& sender, int mtype,
+               const struct iovec *payload, int payload_count, int sock) {
+	FrameHeader header;
+	make_frame_header(header, sender, mtype, payload, payload_count);
+
+	// Connect to remote server
+	if (sock == -1) {
+		sock = connect_to(hostname, port);
+	}
+	bool started;
+	write_frame(sock, hostname, header, payload, payload_count, started);
+	return sock;
+}
+
+int send_frame(const char *hostname, int port, const std::string& sender, int mtype,
+               const char *payload, size_t payload_length, int sock) {
+	struct iovec iov;
+	iov.iov_base = const_cast<char *>(payload);
+	iov.iov_len = payload_length;
+	return send_frame(hostname, port, sender, mtype, &iov, payload_length ? 1 : 0, sock);
+}
+
+ConnectionPool& ConnectionPool::instance() {
+	static ConnectionPool pool;
+	return pool;
+}
+
+ConnectionPool::~ConnectionPool() {
+	for (auto& it : connections) {
+		it.second->reset();
+	}
+}
+
+void ConnectionPool::PooledConnection::reset() {
+	if (sock != -1) {
+		close(sock);
+		sock = -1;
+	}
+	ring.reset();
+}
+
+ConnectionPool::PooledConnection& ConnectionPool::get(const std::string& hostname, int port, int channel) {
+	std::lock_guard<std::mutex> raii(connections_lock);
+	std::unique_ptr<PooledConnection>& conn = connections[std::make_tuple(hostname, port, channel)];
+	if (!conn) {
+		conn.reset(new PooledConnection());
+	}
+	return *conn;
+}
+
+// Receivers never write back on a connection, so a readable socket means the receiver
+// closed its end. The next write would still succeed and the frame be lost.
+static bool peer_hung_up(int sock) {
+	struct pollfd poll_fd;
+	poll_fd.fd = sock;
+	poll_fd.events = POLLIN | POLLRDHUP;
+	poll_fd.revents = 0;
+	return poll(&poll_fd, 1, 0) > 0;
+}
+
+void ConnectionPool::open(PooledConnection& conn, const std::string& hostname, int port, int channel) {
+	const bool stream_channel = channel == CHANNEL_OUTPUT || channel >= CHANNEL_DATA;
+	std::string path;
+	bool shared_memory;
+	if (parse_local_endpoint(hostname, path, shared_memory)) {
+		conn.sock = connect_unix(path.empty() ? local_socket_path(port) : path);
+	} else if (is_local_host(hostname, port)) {
+		try {
+			conn.sock = connect_unix(local_socket_path(port));
+			shared_memory = true;
+		} catch (const std::runtime_error& e) {
+			conn.sock = connect_to(hostname.c_str(), port);
+			return;
+		}
+	} else {
+		conn.sock = connect_to(hostname.c_str(), port);
+		return;
+	}
+	if (!shared_memory || !stream_channel) {
+		return;
+	}
+	try {
+		conn.ring = offer_ring(conn.sock);
+	} catch (const std::runtime_error& e) {
+		// the receiver may have taken the ring after all, start over on a plain Unix socket
+		std::cout << "Not using shared memory for " << hostname << ": " << e.what() << std::endl;
+		close(conn.sock);
+		conn.sock = connect_unix(path.empty() ? local_socket_path(port) : path);
+	}
+}
+
+void ConnectionPool::write(PooledConnection& conn, const std::string& hostname, const FrameHeader& header,
+                           const struct iovec *payload, int payload_count, bool& started) {
+	if (!conn.ring) {
+		write_frame(conn.sock, hostname.c_str(), header, payload, payload_count, started);
+		return;
+	}
+	const int sock = conn.sock;
+	// only giving up while waiting for space leaves the frame unpublished
+	started = true;
+	conn.ring->write(header, payload, payload_count, [sock, &hostname, &started]() {
+		if (peer_hung_up(sock)) {
+			started = false;
+			throw std::runtime_error("Hostname: " + hostname + " let go of its shared memory ring");
+		}
+	});
+}
+
+void ConnectionPool::send(const std::string& hostname, int port, int channel,
+                          const std::string& sender, int mtype, const struct iovec *payload, int payload_count) {
+	FrameHeader header;
+	make_frame_header(header, sender, mtype, payload, payload_count);
+
+	PooledConnection& conn = get(hostname, port, channel);
+	// one frame at a time per connection, frames of concurrent senders must not interleave
+	std::lock_guard<std::mutex> raii(conn.lock);
+	if (conn.sock != -1 && peer_hung_up(conn.sock)) {
+		conn.reset();
+	}
+	bool fresh = conn.sock == -1;
+	if (fresh) {
+		open(conn, hostname, port, channel);
+	}
+	bool started;
+	try {
+		write(conn, hostname, header, payload, payload_count, started);
+		return;
+	} catch (const std::runtime_error& e) {
+		conn.reset();
+		// a receiver holding part of the frame may act on it, sending it again could duplicate it
+		if (fresh || started) {
+			throw;
+		}
+	}
+	// the receiver went away since the last frame, try once more on a new connection
+	open(conn, hostname, port, channel);
+	try {
+		write(conn, hostname, header, payload, payload_count, started);
+	} catch (const std::runtime_error& e) {
+		conn.reset();
+		throw;
+	}
+}
+
+void ConnectionPool::send(const std::string& hostname, int port, int channel,
+                          const std::string& sender, int mtype, const char *payload, size_t payload_length) {
+	struct iovec iov;
+	iov.iov_base = const_cast<char *>(payload);
+	iov.iov_len = payload_length;
+	send(hostname, port, channel, sender, mtype, &iov, payload_length ? 1 : 0);
+}
+
+void check_frame_header(const FrameHeader& header) {
+	if (header.magic != FRAME_MAGIC) {
+		throw std::runtime_error("Not a frame, bad magic " + std::to_string(header.magic));
+	}
+	if (header.version != FRAME_VERSION) {
+		throw std::runtime_error("Unsupported frame version " + std::to_string(header.version));
+	}
+	if (header.payload_length > MAX_MESSAGE_SIZE) {
+		throw std::runtime_error("Message exceeds maximum length: " + std::to_string(header.payload_length));
+	}
+}
+
+std::string frame_sender(const FrameHeader& header) {
+	return std::string(header.sender, strnlen(header.sender, FRAME_SENDER_SIZE));
+}
+
 size_t writefunc(void *ptr, size_t size, size_t nmemb, std::string *s) 
 {
   s->append(static_cast<char *>(ptr), size*nmemb);
@@ -0,0 +1,117 @@
+#include "thread_placement.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cctype>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+
+// the NUMA node a core belongs to is the nodeN entry in its sysfs directory
+static int core_numa_node(const int core) {
+    const std::string cpu_dir = "/sys/devices/system/cpu/cpu" + std::to_string(core);
+    DIR* dir = opendir(cpu_dir.c_str());
+    if (!dir) {
+        return -1;
+    }
+    int node = -1;
+    while (struct dirent* entry = readdir(dir)) {
+        if (!strncmp(entry->d_name, "node", 4) && isdigit(entry->d_name[4])) {
+            node = std::stoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+ThreadPlacement::ThreadPlacement() : isolate_network(false) {}
+
+void ThreadPlacement::load(const nlohmann::json& config, const std::vector<std::string>& component_roles) {
+    roles = component_roles;
+    if (!config.count("thread_placement")) {
+        return;
+    }
+    const int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const nlohmann::json& placement = config["thread_placement"];
+    for (auto it = placement.begin(); it != placement.end(); ++it) {
+        if (it.key() == "isolate_network") {
+            isolate_network = it.value();
+            continue;
+        }
+        if (std::find(roles.begin(), roles.end(), it.key()) == roles.end()) {
+            throw std::runtime_error("Unknown thread_placement role \"" + it.key() + "\".");
+        }
+        std::vector<int> cores = it.value().get<std::vector<int> >();
+        for (int core : cores) {
+            if (core < 0 || core >= num_cores || core >= CPU_SETSIZE) {
+                throw std::runtime_error("thread_placement core " + std::to_string(core) + " is not online.");
+            }
+        }
+        role_cores[it.key()] = cores;
+    }
+
+    if (!isolate_network || !role_cores.count(PLACEMENT_NETWORK)) {
+        return;
+    }
+    const std::vector<int>& network_cores = role_cores[PLACEMENT_NETWORK];
+    for (const std::string& role : roles) {
+        if (role == PLACEMENT_NETWORK) {
+            continue;
+        }
+        std::vector<int>& cores = role_cores[role];
+        if (cores.empty()) {
+            for (int core = 0; core < num_cores; ++core) {
+                cores.push_back(core);
+            }
+        }
+        cores.erase(std::remove_if(cores.begin(), cores.end(), [&network_cores](int core) {
+            return std::find(network_cores.begin(), network_cores.end(), core) != network_cores.end();
+        }), cores.end());
+        if (cores.empty()) {
+            throw std::runtime_error("thread_placement role \"" + role + "\" has no cores left after isolating the network threads.");
+        }
+    }
+}
+
+bool ThreadPlacement::pin_current(const std::string& role, const int index) const {
+    auto it = role_cores.find(role);
+    if (it == role_cores.end() || it->second.empty()) {
+        return false;
+    }
+    const std::vector<int>& cores = it->second;
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    if (index < 0) {
+        for (int core : cores) {
+            CPU_SET(core, &cpu_set);
+        }
+    } else {
+        CPU_SET(cores[index % cores.size()], &cpu_set);
+    }
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (err) {
+        std::cerr << "Failed to pin " << role << " thread: " << strerror(err) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string ThreadPlacement::report() const {
+    std::string report = "Thread placement:";
+    for (const std::string& role : roles) {
+        report += "\n" + role + "\t";
+        auto it = role_cores.find(role);
+        if (it == role_cores.end() || it->second.empty()) {
+            report += "unpinned";
+            continue;
+        }
+        for (int core : it->second) {
+            report += std::to_string(core) + "(node " + std::to_string(core_numa_node(core)) + ") ";
+        }
+        report.pop_back();
+    }
+    return report;
+}